@@ -1,18 +1,255 @@
 /*ATM machine*/
 
 /*Include*/
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L // pread and pwrite under -std=c11
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t on 32-bit systems too
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+/*Prepross*/
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef __STDC_NO_THREADS__
+#include <threads.h> // Server worker pool; without it requests run on the event loop
+typedef mtx_t atm_lock_t;
+#define LOCK(m) mtx_lock(m)
+#define UNLOCK(m) mtx_unlock(m)
+#else
+typedef int atm_lock_t;
+#define LOCK(m) ((void)(m))
+#define UNLOCK(m) ((void)(m))
+#endif
 
 /*Define*/
 #define MAX_PASS 5 // + '\0'
 #define MAX_NAME 50
 #define USER_DB "user_pass.txt"
+#define USER_INDEX "user_index.dat" // Hash table over USER_DB, rebuilt from it when missing
+#define INDEX_MAGIC 0x58444955 // "UIDX"
+#define INDEX_MIN_SLOTS 1024 // Power of two; doubled at 3/4 load
+#define ACCOUNTS_DB "accounts.dat" // Fixed record per account number
+#define TX_LOG "transactions.log" // Append-only, fixed-size records; later segments are transactions.<n>.log
+#define TX_ARCHIVE "transactions.archive" // Cold log segments, packed
+#define ACCOUNTS_SNAPSHOT "accounts.snap" // All accounts as of one log record
+#define ACCOUNTS_MAGIC 0x54434341 // "ACCT"
+#define TX_MAGIC 0x474C5854 // "TXLG"
+#define ARCHIVE_MAGIC 0x56435241 // "ARCV"
+#define BLOCK_MAGIC 0x4B4C4241 // "ABLK"
+#define SNAPSHOT_MAGIC 0x50414E53 // "SNAP"
+#define LOG_SEGMENT_RECORDS (1u << 20) // Records per log segment; each full one triggers a snapshot
+#define LOG_HOT_SEGMENTS 2 // Newest segments never archived
+#define ARCHIVE_CACHE 4 // Unpacked archive blocks kept for history reads
+#define TIME_INDEX "transactions.idx" // Time range of every TIME_BLOCK transactions of an account
+#define TIME_MAGIC 0x58444954 // "TIDX"
+#define TIME_BLOCK 64
+#define TIME_INDEX_STEP 65536 // Log records indexed per maintenance call
+#define TOTALS_DB "account_totals.dat" // Sums per account and day or month, kept with the time index
+#define TOTALS_MAGIC 0x4C544F54 // "TOTL"
+#define TOTALS_SEARCH 4 // Newest totals looked through for a transaction's period before starting another
+#define STATEMENT_MAX 400 // Most periods in one STATEMENT reply
+#define HISTORY_PAGE 10 // Operations per page in the menu
+#define HISTORY_MAX 100 // Most operations in one HISTORY reply
+#define ACCOUNT_OPEN 1 // Record in use; older text files were imported
+#define TX_DEPOSIT 1
+#define TX_WITHDRAW 2
+#define TX_OPENING 3 // Balance carried over from the old text files
+#define TX_TRANSFER_OUT 4 // Sent to the account of the next record
+#define TX_TRANSFER_IN 5 // Received from the account of the record before; always follows its TX_TRANSFER_OUT
+#define ATM_FUNDS -2 // Insufficient funds
+#define ATM_EXISTS -3 // User already registered
+#define ATM_DENIED -4 // Wrong user name or password
+#define ATM_NO_USER -5 // Transfer to a user that is not registered
+#define ATM_SOCKET "atm.sock" // Default server socket
+#define ATM_WORKERS 8 // Server threads executing requests
+#define ATM_COMMIT_DELAY 200 // Microseconds a commit may wait for others to share its fsync
+#define LOCK_STRIPES 1024 // Account locks, picked by account number
+#define MAX_REQUEST 256 // Longest request line
+#define BATCH_MAGIC 0x424D5441 // "ATMB"
+#define BATCH_WORKERS 8 // Default threads settling a batch
+#define BATCH_QUEUE 4096 // Transactions waiting per batch worker
+#define BENCH_CLIENTS 100 // Default simulated ATMs of a benchmark
+#define BENCH_SECONDS 10 // Default length of a benchmark
+#define BENCH_MIX "balance=40,deposit=20,withdraw=15,history=10,transfer=5,statement=5,login=4,register=1"
 
 /*Struct*/
+// Header of USER_INDEX, followed by the slots
+typedef struct {
+    uint32_t magic;
+    uint32_t capacity; // Slots
+    uint32_t count; // Users, also the last account number handed out
+    uint32_t reserved;
+    uint64_t source_size; // Bytes of USER_DB already indexed
+} index_header_t;
+
+// One user in USER_INDEX; an empty name marks a free slot
+typedef struct {
+    char name[MAX_NAME];
+    uint32_t account; // Registration number, from 1
+    uint64_t pass_hash;
+} user_slot_t;
+
+// Header of ACCOUNTS_DB, TX_ARCHIVE and every TX_LOG segment
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t checkpoint; // ACCOUNTS_DB: log records it reflected when last closed cleanly
+    uint64_t in_use; // ACCOUNTS_DB: set while a process has it open, so a crash is noticed
+    uint64_t base; // TX_LOG segments: seq of the record before their first
+} ledger_header_t;
+
+// Account record; all amounts are in kopecks
+typedef struct {
+    int64_t balance;
+    uint32_t flags;
+    uint32_t reserved;
+    int64_t created;
+    int64_t updated;
+    uint64_t operations;
+    uint64_t last_tx; // Seq of the latest transaction, 0 if none
+    uint64_t time_block; // Newest TIME_INDEX entry of the account, 0 if none
+    uint32_t day_total; // Newest TOTALS_DB entries of the account, 0 if none
+    uint32_t month_total;
+} account_t;
+
+// Transaction in TX_LOG; record seq lives at header + (seq - 1) * size
+typedef struct {
+    uint64_t seq;
+    uint32_t account;
+    uint32_t type; // TX_DEPOSIT, TX_WITHDRAW, ...
+    int64_t amount;
+    int64_t balance; // After the operation
+    int64_t time;
+    uint64_t prev; // Seq of the account's previous transaction, 0 for its first
+} tx_record_t;
+
+// Entry of TIME_INDEX; entries of one account chain backwards like its log records
+typedef struct {
+    uint32_t account;
+    uint32_t count; // Transactions in the block
+    uint64_t last; // Seq of the newest
+    uint64_t operations; // Ordinal of the newest among the account's transactions, from 1
+    int64_t first_time; // Earliest and latest time in the block
+    int64_t last_time;
+    uint64_t prev; // Entry of the block before, 0 for the first
+} time_block_t;
+
+// Entry of TOTALS_DB: an account's transactions in one day or month (local time)
+typedef struct {
+    uint32_t account;
+    uint32_t period; // YYYYMMDD or YYYYMM
+    uint32_t deposits; // Counts; an opening balance and money received count as deposits
+    uint32_t withdrawals;
+    int64_t deposited; // Kopecks
+    int64_t withdrawn;
+    int64_t min_balance; // Lowest and highest balance after one of the transactions
+    int64_t max_balance;
+    uint32_t prev; // Entry made before for the account, 0 for the first
+    uint32_t latest; // Latest period of this entry and the ones before
+} total_t;
+
+// Block of an account being filled while indexing
+typedef struct {
+    uint64_t block; // Latest entry written
+    uint64_t operations; // Its ordinal
+    uint32_t count; // Transactions indexed since
+    uint32_t loaded;
+    int64_t first_time;
+    int64_t last_time;
+    uint32_t day; // Newest TOTALS_DB entries
+    uint32_t month;
+} time_state_t;
+
+// One file of the transaction log
+typedef struct {
+    int fd;
+    uint64_t base; // Seq of the record before its first
+    uint64_t count;
+} segment_t;
+
+// Archived segment in TX_ARCHIVE, followed by its packed records
+typedef struct {
+    uint32_t magic;
+    uint32_t crc; // Of the packed records
+    uint64_t base;
+    uint64_t count;
+    uint64_t size; // Bytes of packed records
+} archive_block_t;
+
+typedef struct {
+    archive_block_t block;
+    uint64_t offset; // Of the packed records in TX_ARCHIVE
+} archive_entry_t;
+
+// Header of ACCOUNTS_SNAPSHOT, followed by the account records
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t seq; // Log records the snapshot reflects
+    uint64_t accounts;
+    uint32_t crc; // Of the account records
+    uint32_t reserved;
+} snapshot_header_t;
+
+// Binary batch file: this header, then count batch_record_t
+typedef struct {
+    uint32_t magic;
+    uint32_t record_size;
+    uint64_t count;
+} batch_header_t;
+
+typedef struct {
+    char user[MAX_NAME];
+    uint8_t type; // TX_DEPOSIT or TX_WITHDRAW
+    uint8_t reserved[5];
+    int64_t amount; // Kopecks
+    int64_t time; // Unix seconds; 0 means when settled
+} batch_record_t;
+
+// Growable reply text: "OK ..." or "ERR ...", optional lines, then a "." line
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} reply_t;
+
+// Logged-in state of one client (the interactive ATM has a single local one)
+typedef struct session {
+    int fd;
+    uint32_t account; // 0 until LOGIN succeeds
+    char user[MAX_NAME];
+    char in[4 * MAX_REQUEST]; // Received, not yet executed
+    size_t in_len;
+    int busy; // Handed to a worker; the event loop leaves it alone
+    int closing;
+    uint64_t commit_seq; // Log record the reply waits on, 0 if none
+    reply_t out; // Reply being sent
+    struct session *next; // Worker queue
+} session_t;
 
 /*PROTOTYPE FUNCTION*/
 int password_register();
@@ -22,15 +259,161 @@ void check_balance();
 void up_balance();
 void take_off_money();
 void history();
+void statement();
+void transfer();
 void space(char *str);
 void clear_screen();
 unsigned long hash(const unsigned char *str); //djb2
+int read_at(int fd, void *buf, size_t len, uint64_t offset);
+int write_at(int fd, const void *buf, size_t len, uint64_t offset);
+int user_index_open();
+void user_index_close();
+int user_index_find(const char *name, user_slot_t *slot);
+int user_register(const char *name, const char *pass);
+int user_login(const char *name, const char *pass, uint32_t *account);
+int ledger_open();
+void ledger_close();
+int account_read(uint32_t account, account_t *acc);
+int account_open(const char *user, uint32_t account);
+int account_balance(uint32_t account, int64_t *balance);
+int account_deposit(uint32_t account, int64_t amount, int64_t *balance, uint64_t *seq);
+int account_withdraw(uint32_t account, int64_t amount, int64_t *balance, uint64_t *seq);
+int account_apply(uint32_t account, uint32_t type, int64_t amount, int64_t when, int64_t *balance, uint64_t *seq);
+int account_transfer(uint32_t from, uint32_t to, int64_t amount, int64_t *balance, uint64_t *seq);
+int tx_read(uint64_t seq, tx_record_t *tx);
+int log_sync(uint64_t seq);
+void ledger_maintain();
+int ledger_verify();
+int time_index_open(int rebuild);
+void time_index_close(int clean);
+int time_index_update(uint64_t limit);
+int history_query(uint32_t account, uint64_t before, int64_t from, int64_t to, tx_record_t *out, size_t limit,
+                  size_t *found, uint64_t *next);
+int statement_query(uint32_t account, int monthly, uint32_t from, uint32_t to, total_t *out, size_t limit, size_t *found);
+int parse_amount(const char *text, int64_t *amount);
+int parse_time(const char *text, int64_t *when);
+void format_amount(int64_t amount, char *out, size_t size);
+void local_time(int64_t when, struct tm *out);
+int locks_init();
+void reply_add(reply_t *reply, const char *format, ...);
+void session_execute(session_t *session, char *line, reply_t *reply);
+int atm_request(reply_t *reply, const char *format, ...);
+int atm_batch(const char *path, int workers, const char *rejects);
+int atm_server(const char *path);
+int atm_connect(const char *path);
+int atm_bench(const char *path, int clients, int seconds, uint64_t requests, const char *mix);
 
 char current_user[MAX_NAME] = ""; // Current user
+session_t local_session; // Requests of the interactive ATM when it is not a client
+int remote_fd = -1; // Server connection of a client
+int index_fd = -1; // USER_INDEX, open for the whole run
+index_header_t index_header;
+int accounts_fd = -1; // ACCOUNTS_DB
+int tx_fd = -1; // Log segment being appended to
+segment_t *segments = NULL; // Log segments still in files, oldest first
+size_t segment_count = 0;
+size_t segment_first = 0; // File number of segments[0]; the ones before are archived
+uint64_t segment_records = LOG_SEGMENT_RECORDS;
+int archive_fd = -1; // TX_ARCHIVE
+archive_entry_t *archive = NULL;
+size_t archive_count = 0;
+uint64_t snapshot_seq = 0; // Log records the latest ACCOUNTS_SNAPSHOT reflects
+int snapshot_due = 0; // A segment filled up since the last snapshot
+int time_fd = -1; // TIME_INDEX
+uint64_t time_count = 0; // Its entries
+uint64_t time_indexed = 0; // Log records it covers
+int time_fresh = 0; // Built from the first record, so accounts not seen yet have no blocks
+time_state_t *time_states = NULL; // By account, for the indexer
+size_t time_state_cap = 0;
+int totals_fd = -1; // TOTALS_DB, indexed together with TIME_INDEX
+uint32_t totals_count = 0;
+uint64_t tx_count = 0; // Transactions in TX_LOG
+uint64_t tx_durable = 0; // Of those, the ones known to be on disk
+long commit_delay = ATM_COMMIT_DELAY;
+int ledger_owned = 0; // ledger_open() succeeded; ledger_close() writes the checkpoint
+atm_lock_t index_lock; // USER_INDEX and USER_DB
+atm_lock_t log_lock; // Appends to TX_LOG, tx_count and tx_durable
+atm_lock_t sync_lock; // One fsync of TX_LOG at a time
+atm_lock_t segment_lock; // Log segment and archive tables, for readers
+atm_lock_t account_locks[LOCK_STRIPES]; // Serialize balance updates per account
+atm_lock_t time_lock; // Totals and time_indexed, between the indexer and statements
+atm_lock_t batch_rejects_lock; // Rejects file of a batch, shared by its workers
 
-int main()
+int main(int argc, char *argv[])
 {
     int choice;
+    const char *socket_path = ATM_SOCKET;
+    const char *batch_path = NULL, *batch_rejects_file = NULL;
+    int batch_workers = BATCH_WORKERS;
+    int batch_mode = argc > 1 && strcmp(argv[1], "batch") == 0;
+    const char *bench_mix = BENCH_MIX;
+    int bench_clients = BENCH_CLIENTS, bench_seconds = 0; // No duration: BENCH_SECONDS unless --requests
+    uint64_t bench_requests = 0;
+    int bench_mode = argc > 1 && strcmp(argv[1], "bench") == 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--commit-delay") == 0 && i + 1 < argc) {
+            commit_delay = atol(argv[++i]);
+            if (commit_delay < 0) commit_delay = 0;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            batch_workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rejects") == 0 && i + 1 < argc) {
+            batch_rejects_file = argv[++i];
+        } else if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            bench_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            bench_seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            bench_requests = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            bench_mix = argv[++i];
+        } else if (batch_mode) {
+            batch_path = argv[i];
+        } else {
+            socket_path = argv[i];
+        }
+    }
+    if (bench_mode) {
+        // Load generator: only a client of the server, the ledger stays closed
+        int result = atm_bench(socket_path, bench_clients, bench_seconds, bench_requests, bench_mix);
+        return result == 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "client") == 0) {
+        // Thin client: the same menus, with every operation answered by the server
+        remote_fd = atm_connect(socket_path);
+        if (remote_fd < 0) {
+            printf("Error: Cannot connect to the ATM server at %s.\n", socket_path);
+            return 1;
+        }
+    } else if ((argc > 1 && strcmp(argv[1], "server") != 0 && strcmp(argv[1], "verify") != 0 && !batch_mode) ||
+               (batch_mode && !batch_path)) {
+        fprintf(stderr, "Usage: %s [server [--commit-delay US] [socket] | client [socket] | verify |\n"
+                        "           batch [--workers N] [--rejects FILE] FILE |\n"
+                        "           bench [--clients N] [--duration S] [--requests N] [--mix OP=WEIGHT,...] [socket]]\n",
+                argv[0]);
+        return 1;
+    } else if (locks_init() != 0 || user_index_open() != 0 || ledger_open() != 0) {
+        printf("Error: Cannot open user index or accounts.\n");
+        return 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+        int problems = ledger_verify();
+        ledger_close();
+        user_index_close();
+        return problems == 0 ? 0 : 1;
+    }
+    if (batch_mode) {
+        int result = atm_batch(batch_path, batch_workers, batch_rejects_file);
+        ledger_close();
+        user_index_close();
+        return result == 0 ? 0 : 1;
+    }
+    if (argc > 1 && strcmp(argv[1], "server") == 0) {
+        int result = atm_server(socket_path);
+        ledger_close();
+        user_index_close();
+        return result == 0 ? 0 : 1;
+    }
+
     do {
         printf("\nATM System\n");
         printf("1. Register\n2. Login\n3. Exit\n");
@@ -60,16 +443,45 @@ int main()
                 }
                 if (attempts == 0) {
                     printf("Too many failed attempts. Exiting...\n\n");
-                    return 0;
+                    choice = 3;
                 }
                 break;
             }
             case 3:
-                return 0;
+                break;
             default:
                 printf("Invalid choice!\n\n");
         }
-    } while(1);
+    } while(choice != 3);
+
+    if (remote_fd >= 0) {
+        close(remote_fd);
+    } else {
+        ledger_close();
+        user_index_close();
+    }
+    return 0;
+}
+
+// Flushes fd to disk; fdatasync skips the timestamps a log append does not need
+static int file_sync(int fd)
+{
+#if defined(_WIN32)
+    return _commit(fd);
+#elif defined(__APPLE__)
+    return fsync(fd);
+#else
+    return fdatasync(fd);
+#endif
+}
+
+static int file_truncate(int fd, uint64_t size)
+{
+#ifdef _WIN32
+    return _chsize_s(fd, (__int64)size) == 0 ? 0 : -1;
+#else
+    return ftruncate(fd, (off_t)size);
+#endif
 }
 
 void space(char *str)
@@ -96,7 +508,6 @@ int password_register()
 {
     char user_name[MAX_NAME];
     char pass[20];
-    FILE *file;
 
     printf("Input username (or 'cancel' to return): ");
     fgets(user_name, sizeof(user_name), stdin);
@@ -132,42 +543,14 @@ int password_register()
         return 0;
     }
 
-    // Hash pass
-    unsigned long pass_hash = hash((const unsigned char*)pass);
-
-    // Checking user
-    file = fopen(USER_DB, "r");
-    if (file) {
-        char line[100];
-        while (fgets(line, sizeof(line), file)) {
-            line[strcspn(line, "\n")] = '\0';
-            char *colon = strchr(line, ':');
-            if (colon) {
-                *colon = '\0';
-                char file_name_trimmed[MAX_NAME];
-                strcpy(file_name_trimmed, line);
-                space(file_name_trimmed);
-
-                if(strcmp(user_name, file_name_trimmed) == 0) {
-                    printf("User already exists!\n\n");
-                    fclose(file);
-                    return 0;
-                }
-            }
-        }
-        fclose(file);
-    }
-
-    file = fopen(USER_DB, "a");
-    if (file == NULL)
-    {
-        printf("Error: Cannot open user database.\n\n");
+    reply_t reply = {0};
+    int ok = atm_request(&reply, "REGISTER\t%s\t%s", user_name, pass);
+    if (ok != 1) {
+        printf("Error: %s\n\n", ok < 0 ? "Connection to the server lost." : reply.data + 4);
+        free(reply.data);
         return 0;
     }
-
-    // Saving Hash
-    fprintf(file, "%s:%lu\n", user_name, pass_hash);
-    fclose(file);
+    free(reply.data);
 
     printf("Registration successful!\n\n");
     return 1;
@@ -177,8 +560,6 @@ int password_login()
 {
     char input_name[MAX_NAME];
     char input_pass[20];
-    FILE *file;
-    int authenticated = 0;
 
     printf("Username (or 'cancel' to return): ");
     fgets(input_name, sizeof(input_name), stdin);
@@ -208,49 +589,19 @@ int password_login()
         return 0;
     }
 
-    // Hash pass
-    unsigned long input_hash = hash((const unsigned char*)input_pass);
-
-    file = fopen(USER_DB, "r");
-    if (file == NULL)
-    {
-        printf("Error: User database not found.\n\n");
-        return 0;
-    }
-
-    char line[100];
-    while(fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = '\0';
-
-        char *colon = strchr(line, ':');
-        if(!colon) continue;
-
-        *colon = '\0';
-        char file_name_trimmed[MAX_NAME];
-        strcpy(file_name_trimmed, line);
-        space(file_name_trimmed);
-
-        // Read Hash
-        unsigned long file_hash = strtoul(colon + 1, NULL, 10);
-
-        if(strcmp(input_name, file_name_trimmed) == 0 &&
-           input_hash == file_hash) {
-            authenticated = 1;
-            strcpy(current_user, input_name);
-            break;
-        }
-    }
-
-    fclose(file);
-
-    if(authenticated) {
+    reply_t reply = {0};
+    int authenticated = atm_request(&reply, "LOGIN\t%s\t%s", input_name, input_pass);
+    if(authenticated == 1) {
+        strcpy(current_user, input_name);
+        free(reply.data);
         printf("Login successful!\n\n");
         clear_screen();
         return 1;
     }
     else {
-        printf("Error: Invalid username or password.\n\n");
-        return 0;
+        printf("Error: %s\n\n", authenticated < 0 ? "Connection to the server lost." : reply.data + 4);
+        free(reply.data);
+        return authenticated < 0 ? -1 : 0;
     }
 }
 
@@ -263,7 +614,9 @@ void menu()
         printf("2. Top up your account\n");
         printf("3. Withdraw cash\n");
         printf("4. Operation history\n");
-        printf("5. Exit\n\n");
+        printf("5. Statement\n");
+        printf("6. Transfer to another user\n");
+        printf("7. Exit\n\n");
         printf("Input operation: ");
         scanf("%d", &your_choice);
         while(getchar() != '\n');
@@ -274,7 +627,15 @@ void menu()
             case 2: up_balance(); break;
             case 3: take_off_money(); break;
             case 4: history(); break;
-            case 5: clear_screen(); return;  // Come back in menu
+            case 5: statement(); break;
+            case 6: transfer(); break;
+            case 7: {
+                reply_t reply = {0};
+                atm_request(&reply, "LOGOUT");
+                free(reply.data);
+                clear_screen();
+                return;  // Come back in menu
+            }
             default: printf("Error: invalid operation!\n\n");
         }
     } while (1);
@@ -282,150 +643,257 @@ void menu()
 
 void check_balance()
 {
-    char filename[100];
-    sprintf(filename, "%s_balance.txt", current_user);
-
-    FILE *file = fopen(filename, "r");
-    if(!file)
+    reply_t reply = {0};
+    if(atm_request(&reply, "BALANCE") != 1)
     {
         printf("Balance: 0.00 Rub\n\n");
+        free(reply.data);
         return;
     }
 
-    double balance;
-    if(fscanf(file, "%lf", &balance) != 1) {
-        balance = 0.0;
-    }
-    fclose(file);
-
-    printf("Your current balance: %.2lf Rub.\n\n", balance);
+    printf("Your current balance: %s Rub.\n\n", reply.data + 3);
+    free(reply.data);
 }
 
 void up_balance()
 {
-    double money;
+    char input[32];
+    int64_t money = 0;
     printf("Enter amount to deposit: ");
-    scanf("%lf", &money);
-    while(getchar() != '\n');
-
-    if(money <= 0)
+    if(!fgets(input, sizeof(input), stdin) || parse_amount(input, &money) != 0 || money <= 0)
     {
         printf("Error: Invalid amount\n\n");
         return;
     }
 
-    char bal_file[100];
-    sprintf(bal_file, "%s_balance.txt", current_user);
+    // One log append and one account record update
+    char text[32];
+    format_amount(money, text, sizeof(text));
+    reply_t reply = {0};
+    int result = atm_request(&reply, "DEPOSIT\t%s", text);
+    if(result != 1)
+    {
+        printf("Error: %s\n\n", result < 0 ? "Connection to the server lost." : reply.data + 4);
+        free(reply.data);
+        return;
+    }
+    free(reply.data);
 
-    char hist_file[100];
-    sprintf(hist_file, "%s_history.txt", current_user);
+    printf("Successfully deposited %s Rub.\n\n", text);
+}
 
-    // Current balance
-    double balance = 0.0;
-    FILE *file = fopen(bal_file, "r");
-    if(file) {
-        fscanf(file, "%lf", &balance);
-        fclose(file);
+void take_off_money()
+{
+    char input[32];
+    int64_t money = 0;
+    printf("Enter amount to withdraw: ");
+    if(!fgets(input, sizeof(input), stdin) || parse_amount(input, &money) != 0 || money <= 0)
+    {
+        printf("Error: Amount must be positive!\n\n");
+        return;
     }
 
-    // Update Balance
-    balance += money;
-    file = fopen(bal_file, "w");
-    fprintf(file, "%.2lf", balance);
-    fclose(file);
-
-    // Record in history
-    file = fopen(hist_file, "a");
-    if(file) {
-        time_t now = time(NULL);
-        struct tm *t = localtime(&now);
-        fprintf(file, "%04d-%02d-%02d Deposit: +%.2lf\n",
-                t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, money);
-        fclose(file);
+    char text[32];
+    format_amount(money, text, sizeof(text));
+    reply_t reply = {0};
+    int result = atm_request(&reply, "WITHDRAW\t%s", text);
+    if(result != 1)
+    {
+        printf("Error: %s\n\n", result < 0 ? "Connection to the server lost." : reply.data + 4);
+        free(reply.data);
+        return;
     }
+    free(reply.data);
 
-    printf("Successfully deposited %.2lf Rub.\n\n", money);
+    printf("Successfully withdrawn %s Rub.\n\n", text);
 }
 
-void take_off_money()
+void transfer()
 {
-    double money;
-    printf("Enter amount to withdraw: ");
-    scanf("%lf", &money);
-    while(getchar() != '\n');
-
-    if(money <= 0)
+    char recipient[MAX_NAME + 2], input[32];
+    int64_t money = 0;
+    printf("Recipient username: ");
+    if(!fgets(recipient, sizeof(recipient), stdin)) return;
+    recipient[strcspn(recipient, "\r\n")] = '\0';
+    if(recipient[0] == '\0' || strchr(recipient, '\t'))
+    {
+        printf("Error: Invalid username\n\n");
+        return;
+    }
+    printf("Enter amount to transfer: ");
+    if(!fgets(input, sizeof(input), stdin) || parse_amount(input, &money) != 0 || money <= 0)
     {
         printf("Error: Amount must be positive!\n\n");
         return;
     }
 
-    char bal_file[100];
-    sprintf(bal_file, "%s_balance.txt", current_user);
-
-    char hist_file[100];
-    sprintf(hist_file, "%s_history.txt", current_user);
+    char text[32];
+    format_amount(money, text, sizeof(text));
+    reply_t reply = {0};
+    int result = atm_request(&reply, "TRANSFER\t%s\t%s", recipient, text);
+    if(result != 1)
+    {
+        printf("Error: %s\n\n", result < 0 ? "Connection to the server lost." : reply.data + 4);
+        free(reply.data);
+        return;
+    }
+    printf("Successfully transferred %s Rub to %s. Your balance: %s Rub.\n\n", text, recipient, reply.data + 3);
+    free(reply.data);
+}
 
-    // Current balance
-    double balance = 0.0;
-    FILE *file = fopen(bal_file, "r");
-    if(file) {
-        fscanf(file, "%lf", &balance);
-        fclose(file);
+// Reads a date for the history; end moves it to the last second of that day
+static int history_date(const char *prompt, int end, int64_t *when)
+{
+    char input[32];
+    printf("%s", prompt);
+    if(!fgets(input, sizeof(input), stdin)) return -1;
+    input[strcspn(input, "\r\n")] = '\0';
+    if(input[0] == '\0')
+    {
+        *when = 0;
+        return 0;
     }
+    if(parse_time(input, when) != 0) return -1;
+    if(end && strlen(input) == 10) *when += 24 * 60 * 60 - 1;
+    return 0;
+}
+
+void history()
+{
+    int choice;
+    uint64_t limit = 0, shown = 0, before = 0;
+    int64_t from = 0, to = 0;
+    printf("1. Last operations\n2. Operations between dates\n3. All operations\n");
+    printf("Your choice: ");
+    scanf("%d", &choice);
+    while(getchar() != '\n');
 
-    if(money > balance)
+    if(choice == 1)
+    {
+        printf("How many operations: ");
+        if(scanf("%llu", (unsigned long long*)&limit) != 1 || limit == 0)
+        {
+            while(getchar() != '\n');
+            printf("Error: Invalid number\n\n");
+            return;
+        }
+        while(getchar() != '\n');
+    }
+    else if(choice == 2)
+    {
+        if(history_date("From (YYYY-MM-DD, empty for the first): ", 0, &from) != 0 ||
+           history_date("To (YYYY-MM-DD, empty for today): ", 1, &to) != 0)
+        {
+            printf("Error: Invalid date\n\n");
+            return;
+        }
+    }
+    else if(choice != 3)
     {
-        printf("Error: Insufficient funds\n\n");
+        printf("Error: invalid operation!\n\n");
         return;
     }
 
-    // Update Balance
-    balance -= money;
-    file = fopen(bal_file, "w");
-    fprintf(file, "%.2lf", balance);
-    fclose(file);
+    // Pages go back in time; each reply carries the cursor for the next
+    printf("\nOperation History (newest first):\n");
+    for(;;)
+    {
+        uint64_t page = HISTORY_PAGE;
+        if(limit && limit - shown < page) page = limit - shown;
+        reply_t reply = {0};
+        int result = atm_request(&reply, "HISTORY\t%llu\t%llu\t%lld\t%lld", (unsigned long long)page,
+                                 (unsigned long long)before, (long long)from, (long long)to);
+        unsigned long long found = 0, next = 0;
+        if(result != 1 || sscanf(reply.data, "OK %llu %llu", &found, &next) != 2)
+        {
+            printf("Error: %s\n\n", result < 0 ? "Connection to the server lost." : result == 0 ? reply.data + 4 : "Bad reply");
+            free(reply.data);
+            return;
+        }
+        printf("%s", reply.data + strlen(reply.data) + 1);
+        free(reply.data);
+        shown += found;
+        before = next;
+        if(shown == 0) printf("No operations found\n");
+        if(next == 0 || (limit && shown >= limit)) break;
 
-    // Record for history
-    file = fopen(hist_file, "a");
-    if(file) {
-        time_t now = time(NULL);
-        struct tm *t = localtime(&now);
-        fprintf(file, "%04d-%02d-%02d Withdrawal: -%.2lf\n",
-                t->tm_year + 1900, t->tm_mon + 1, t->tm_mday, money);
-        fclose(file);
+        char input[8];
+        printf("-- Enter for older operations, q to stop: ");
+        if(!fgets(input, sizeof(input), stdin) || input[0] == 'q' || input[0] == 'Q') break;
     }
+    printf("\n");
+}
 
-    printf("Successfully withdrawn %.2lf Rub.\n\n", money);
+// Reads a YYYY-MM (or YYYY-MM-DD) period as YYYYMM (or YYYYMMDD); empty gives 0
+static int statement_period(const char *prompt, int monthly, uint32_t *period)
+{
+    char input[32];
+    unsigned year, month, day = 0;
+    int fields;
+    printf("%s", prompt);
+    if(!fgets(input, sizeof(input), stdin)) return -1;
+    input[strcspn(input, "\r\n")] = '\0';
+    if(input[0] == '\0')
+    {
+        *period = 0;
+        return 0;
+    }
+    fields = sscanf(input, "%4u-%2u-%2u", &year, &month, &day);
+    if(fields != (monthly ? 2 : 3) || month < 1 || month > 12 || (!monthly && (day < 1 || day > 31))) return -1;
+    *period = monthly ? year * 100 + month : (year * 100 + month) * 100 + day;
+    return 0;
 }
 
-void history()
+void statement()
 {
-    char filename[100];
-    sprintf(filename, "%s_history.txt", current_user);
+    int choice;
+    uint32_t from, to;
+    printf("1. By month\n2. By day\n");
+    printf("Your choice: ");
+    scanf("%d", &choice);
+    while(getchar() != '\n');
+    if(choice != 1 && choice != 2)
+    {
+        printf("Error: invalid operation!\n\n");
+        return;
+    }
 
-    FILE *file = fopen(filename, "r");
-    if(!file)
+    int monthly = choice == 1;
+    if(statement_period(monthly ? "From (YYYY-MM, empty for the first): " : "From (YYYY-MM-DD, empty for the first): ", monthly, &from) != 0 ||
+       statement_period(monthly ? "To (YYYY-MM, empty for the latest): " : "To (YYYY-MM-DD, empty for the latest): ", monthly, &to) != 0)
     {
-        printf("No operations found\n\n");
+        printf("Error: Invalid period\n\n");
         return;
     }
 
-    printf("\nOperation History:\n");
-    char line[100];
-    while(fgets(line, sizeof(line), file)) {
-        printf("%s", line);
+    reply_t reply = {0};
+    int result = atm_request(&reply, "STATEMENT\t%s\t%u\t%u", monthly ? "month" : "day", from, to);
+    if(result != 1)
+    {
+        printf("Error: %s\n\n", result < 0 ? "Connection to the server lost." : reply.data + 4);
+        free(reply.data);
+        return;
     }
-    fclose(file);
-    printf("\n");
+    if(strcmp(reply.data, "OK 0") == 0)
+    {
+        printf("No operations found\n\n");
+        free(reply.data);
+        return;
+    }
+
+    // Newest period first; balances are the lowest and highest after an operation
+    printf("\n%-10s %6s  %14s %6s  %14s  %14s %14s\n", "Period", "In", "Deposited", "Out", "Withdrawn", "Min balance", "Max balance");
+    printf("%s\n", reply.data + strlen(reply.data) + 1);
+    free(reply.data);
 }
 
 void clear_screen()
 {
+    // Only a terminal is cleared; scripted or redirected runs keep their output
 #ifdef _WIN32
-    system("cls");
+    if (_isatty(_fileno(stdout))) system("cls");
 #else
-    system("clear");
+    if (isatty(STDOUT_FILENO)) system("clear");
 #endif
 }
 
@@ -440,3 +908,3217 @@ unsigned long hash(const unsigned char *str)
 
     return hash;
 }
+
+/*Binary files*/
+// Positional reads and writes; 0 only when all of len was transferred
+int read_at(int fd, void *buf, size_t len, uint64_t offset)
+{
+    char *p = buf;
+    while (len > 0) {
+#ifdef _WIN32
+        if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return -1;
+        int n = _read(fd, p, (unsigned)len);
+#else
+        ssize_t n = pread(fd, p, len, (off_t)offset);
+#endif
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+int write_at(int fd, const void *buf, size_t len, uint64_t offset)
+{
+    const char *p = buf;
+    while (len > 0) {
+#ifdef _WIN32
+        if (_lseeki64(fd, (__int64)offset, SEEK_SET) < 0) return -1;
+        int n = _write(fd, p, (unsigned)len);
+#else
+        ssize_t n = pwrite(fd, p, len, (off_t)offset);
+#endif
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+/*User index*/
+// Slots are probed straight in the file, so a lookup costs one or two small reads however many users there are
+static uint64_t slot_offset(uint32_t pos)
+{
+    return sizeof(index_header_t) + (uint64_t)pos * sizeof(user_slot_t);
+}
+
+static uint32_t slot_home(const char *name, uint32_t capacity)
+{
+    uint64_t h = (uint64_t)hash((const unsigned char*)name) * 0x9E3779B97F4A7C15ULL;
+    return (uint32_t)(h >> 32) & (capacity - 1);
+}
+
+// Empty index with the given number of slots
+static int index_create(const char *path, uint32_t capacity, index_header_t *header)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (fd < 0) return -1;
+
+    memset(header, 0, sizeof(*header));
+    header->magic = INDEX_MAGIC;
+    header->capacity = capacity;
+
+    // Slots are written in chunks; a zero slot is free
+    user_slot_t chunk[256];
+    memset(chunk, 0, sizeof(chunk));
+    int result = write_at(fd, header, sizeof(*header), 0);
+    for (uint32_t pos = 0; result == 0 && pos < capacity; pos += 256) {
+        uint32_t n = (capacity - pos < 256) ? capacity - pos : 256;
+        result = write_at(fd, chunk, n * sizeof(user_slot_t), slot_offset(pos));
+    }
+    if (result != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Probes for name: 1 with its slot, 0 with the free slot it would take, -1 on a read error
+static int index_probe(int fd, const index_header_t *header, const char *name, user_slot_t *slot, uint32_t *pos)
+{
+    uint32_t p = slot_home(name, header->capacity);
+    for (uint32_t n = 0; n < header->capacity; n++, p = (p + 1) & (header->capacity - 1)) {
+        if (read_at(fd, slot, sizeof(*slot), slot_offset(p)) != 0) return -1;
+        if (slot->name[0] == '\0' || strncmp(slot->name, name, MAX_NAME) == 0) {
+            *pos = p;
+            return slot->name[0] != '\0';
+        }
+    }
+    return -1; // Full; never happens below 3/4 load
+}
+
+// Rehashes every user into a table twice the size and swaps it in
+static int index_grow()
+{
+    char tmp[] = USER_INDEX ".tmp";
+    index_header_t header;
+    int fd = index_create(tmp, index_header.capacity * 2, &header);
+    if (fd < 0) return -1;
+    header.count = index_header.count;
+    header.source_size = index_header.source_size;
+
+    int result = 0;
+    for (uint32_t pos = 0; result == 0 && pos < index_header.capacity; pos++) {
+        user_slot_t slot, probe;
+        uint32_t to;
+        if (read_at(index_fd, &slot, sizeof(slot), slot_offset(pos)) != 0) {
+            result = -1;
+        } else if (slot.name[0] != '\0') {
+            if (index_probe(fd, &header, slot.name, &probe, &to) != 0 ||
+                write_at(fd, &slot, sizeof(slot), slot_offset(to)) != 0) {
+                result = -1;
+            }
+        }
+    }
+    if (result == 0) result = write_at(fd, &header, sizeof(header), 0);
+    close(fd);
+    if (result != 0) {
+        remove(tmp);
+        return -1;
+    }
+
+    close(index_fd);
+    index_fd = -1;
+#ifdef _WIN32
+    remove(USER_INDEX); // rename does not replace on Windows
+#endif
+    if (rename(tmp, USER_INDEX) != 0) return -1;
+    index_fd = open(USER_INDEX, O_RDWR | O_BINARY);
+    if (index_fd < 0) return -1;
+    index_header = header;
+    return 0;
+}
+
+static int index_insert(const char *name, uint64_t pass_hash)
+{
+    if ((uint64_t)(index_header.count + 1) * 4 > (uint64_t)index_header.capacity * 3 && index_grow() != 0) {
+        return -1;
+    }
+
+    user_slot_t slot;
+    uint32_t pos;
+    int found = index_probe(index_fd, &index_header, name, &slot, &pos);
+    if (found < 0) return -1;
+    if (found) {
+        // Already indexed before an interrupted header update
+        if (slot.account > index_header.count) index_header.count = slot.account;
+        return 0;
+    }
+
+    memset(&slot, 0, sizeof(slot));
+    size_t len = strlen(name);
+    memcpy(slot.name, name, len < MAX_NAME ? len : MAX_NAME - 1);
+    slot.account = index_header.count + 1;
+    slot.pass_hash = pass_hash;
+    if (write_at(index_fd, &slot, sizeof(slot), slot_offset(pos)) != 0) return -1;
+    index_header.count++;
+    return 0;
+}
+
+// Indexes the lines USER_DB gained since the last run (all of it for a new index)
+static int index_catch_up()
+{
+    struct stat st;
+    if (stat(USER_DB, &st) != 0) return 0; // No users yet
+    if ((uint64_t)st.st_size == index_header.source_size) return 0;
+
+    FILE *file = fopen(USER_DB, "r");
+    if (!file) return -1;
+    if (fseek(file, (long)index_header.source_size, SEEK_SET) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    char line[100];
+    int result = 0;
+    long size = ftell(file);
+    while (result == 0 && fgets(line, sizeof(line), file)) {
+        // A line still being written by another process is left for the next call
+        if (!strchr(line, '\n')) break;
+        size = ftell(file);
+        line[strcspn(line, "\n")] = '\0';
+        char *colon = strchr(line, ':');
+        if (!colon) continue;
+
+        *colon = '\0';
+        if (strlen(line) >= MAX_NAME) continue; // Never accepted by registration
+        char file_name_trimmed[MAX_NAME];
+        strcpy(file_name_trimmed, line);
+        space(file_name_trimmed);
+        if (file_name_trimmed[0] == '\0') continue;
+
+        // The first line for a name wins, as with the old linear scan
+        result = index_insert(file_name_trimmed, strtoul(colon + 1, NULL, 10));
+    }
+    fclose(file);
+    if (result != 0 || size < 0) return -1;
+
+    index_header.source_size = (uint64_t)size;
+    return write_at(index_fd, &index_header, sizeof(index_header), 0);
+}
+
+// Opens USER_INDEX, building it from USER_DB when it is missing, damaged or older than the text file
+int user_index_open()
+{
+    index_fd = open(USER_INDEX, O_RDWR | O_BINARY);
+    struct stat st;
+    int valid = index_fd >= 0 && read_at(index_fd, &index_header, sizeof(index_header), 0) == 0 &&
+                index_header.magic == INDEX_MAGIC && index_header.capacity >= INDEX_MIN_SLOTS &&
+                (index_header.capacity & (index_header.capacity - 1)) == 0 &&
+                (stat(USER_DB, &st) != 0 ? index_header.source_size == 0 :
+                                           index_header.source_size <= (uint64_t)st.st_size);
+    if (!valid) {
+        if (index_fd >= 0) close(index_fd);
+        index_fd = index_create(USER_INDEX, INDEX_MIN_SLOTS, &index_header);
+        if (index_fd < 0) return -1;
+    }
+    return index_catch_up();
+}
+
+void user_index_close()
+{
+    if (index_fd >= 0) close(index_fd);
+    index_fd = -1;
+}
+
+static int index_lookup(const char *name, user_slot_t *slot)
+{
+    // Another ATM process may have registered users since the last call
+    if (index_catch_up() != 0) return -1;
+    uint32_t pos;
+    return index_probe(index_fd, &index_header, name, slot, &pos);
+}
+
+// 1 and the user's slot if registered, 0 if not, -1 if the index cannot be read
+int user_index_find(const char *name, user_slot_t *slot)
+{
+    LOCK(&index_lock);
+    int found = index_lookup(name, slot);
+    UNLOCK(&index_lock);
+    return found;
+}
+
+// 0 once name is registered, ATM_EXISTS if it already was, -1 on a file error
+int user_register(const char *name, const char *pass)
+{
+    unsigned long pass_hash = hash((const unsigned char*)pass);
+    user_slot_t slot;
+    LOCK(&index_lock);
+    int found = index_lookup(name, &slot);
+    if (found != 0) {
+        UNLOCK(&index_lock);
+        return found == 1 ? ATM_EXISTS : -1;
+    }
+
+    // The text file stays the record; the index picks the line up from it
+    FILE *file = fopen(USER_DB, "a");
+    if (file) {
+        fprintf(file, "%s:%lu\n", name, pass_hash);
+        found = (fclose(file) == 0) ? index_lookup(name, &slot) : -1;
+    }
+    UNLOCK(&index_lock);
+    return found == 1 ? 0 : -1;
+}
+
+// 0 and the account number if name and pass match, ATM_DENIED if not
+int user_login(const char *name, const char *pass, uint32_t *account)
+{
+    user_slot_t slot;
+    int found = user_index_find(name, &slot);
+    if (found < 0) return -1;
+    if (!found || slot.pass_hash != (uint64_t)hash((const unsigned char*)pass)) return ATM_DENIED;
+    if (account_open(name, slot.account) != 0) return -1;
+    *account = slot.account;
+    return 0;
+}
+
+/*Transaction log*/
+static uint32_t crc_table[256];
+
+static void crc_init()
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+// Standard CRC-32 (as in zip and PNG), continued from a previous result
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static int ledger_file(const char *path, uint32_t magic, uint32_t record_size, uint64_t base, uint64_t *records,
+                       ledger_header_t *header_out)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0644);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    ledger_header_t header;
+    memset(&header, 0, sizeof(header));
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        header.magic = magic;
+        header.record_size = record_size;
+        header.base = base;
+        if (write_at(fd, &header, sizeof(header), 0) != 0) {
+            close(fd);
+            return -1;
+        }
+        st.st_size = sizeof(header);
+    } else if (read_at(fd, &header, sizeof(header), 0) != 0 || header.magic != magic ||
+               header.record_size != record_size) {
+        printf("Error: %s is not a valid file.\n", path);
+        close(fd);
+        return -1;
+    }
+    // A record cut short by a crash is overwritten by the next append
+    *records = ((uint64_t)st.st_size - sizeof(header)) / record_size;
+    if (header_out) *header_out = header;
+    return fd;
+}
+
+// Segment 0 keeps the TX_LOG name, so logs from before segments are its first part
+static void segment_name(size_t number, char *out, size_t size)
+{
+    if (number == 0) snprintf(out, size, "%s", TX_LOG);
+    else snprintf(out, size, "transactions.%llu.log", (unsigned long long)number);
+}
+
+static uint64_t segment_offset(const segment_t *segment, uint64_t seq)
+{
+    return sizeof(ledger_header_t) + (seq - segment->base - 1) * sizeof(tx_record_t);
+}
+
+// Live segment holding seq, which must be past segments[0].base; the caller holds segment_lock
+static size_t segment_find(uint64_t seq)
+{
+    size_t lo = 0, hi = segment_count - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (segments[mid].base < seq) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+static size_t archive_find(uint64_t seq)
+{
+    size_t lo = 0, hi = archive_count - 1;
+    while (lo < hi) {
+        size_t mid = (lo + hi + 1) / 2;
+        if (archive[mid].block.base < seq) lo = mid;
+        else hi = mid - 1;
+    }
+    return lo;
+}
+
+static uint8_t *varint_put(uint8_t *out, uint64_t v)
+{
+    while (v >= 0x80) {
+        *out++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (uint8_t)v;
+    return out;
+}
+
+static const uint8_t *varint_get(const uint8_t *in, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; in < end && shift < 64; shift += 7) {
+        uint8_t byte = *in++;
+        *v |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) return in;
+    }
+    return NULL;
+}
+
+// Signed deltas as small unsigned numbers: 0, -1, 1, -2, ...
+static uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (v < 0 ? UINT64_MAX : 0);
+}
+
+static int64_t unzigzag(uint64_t v)
+{
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+// Change tx makes to its account's balance
+static int64_t tx_delta(const tx_record_t *tx)
+{
+    return (tx->type == TX_WITHDRAW || tx->type == TX_TRANSFER_OUT) ? -tx->amount : tx->amount;
+}
+
+// Balance after tx if its account's previous record is in the same block, else 0
+static int64_t tx_predict(const tx_record_t *records, uint64_t base, const tx_record_t *tx)
+{
+    if (tx->prev <= base) return 0;
+    const tx_record_t *prev = &records[tx->prev - base - 1];
+    return prev->balance + tx_delta(tx);
+}
+
+/* Packs a segment for TX_ARCHIVE. The seq is implied and the other fields become
+ * varints of small numbers: prev as a distance back, time as a step from the record
+ * before, balance as the error of the prediction from the account's last record.
+ * Types past 3 take type bits 0 and a varint of their own. The result is never
+ * longer than the records themselves. */
+static size_t archive_pack(const tx_record_t *records, uint64_t base, uint64_t count, uint8_t *out)
+{
+    uint8_t *p = out;
+    int64_t time = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        const tx_record_t *tx = &records[i];
+        int64_t expected = tx_predict(records, base, tx);
+        p = varint_put(p, ((uint64_t)tx->account << 2) | (tx->type <= 3 ? tx->type : 0));
+        if (tx->type > 3) p = varint_put(p, tx->type);
+        p = varint_put(p, zigzag(tx->amount));
+        p = varint_put(p, zigzag((int64_t)((uint64_t)tx->balance - (uint64_t)expected)));
+        p = varint_put(p, zigzag((int64_t)((uint64_t)tx->time - (uint64_t)time)));
+        p = varint_put(p, tx->prev ? tx->seq - tx->prev : 0);
+        time = tx->time;
+    }
+    return (size_t)(p - out);
+}
+
+static int archive_unpack(const uint8_t *in, size_t size, uint64_t base, uint64_t count, tx_record_t *out)
+{
+    const uint8_t *end = in + size;
+    int64_t time = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        tx_record_t *tx = &out[i];
+        uint64_t v[5], type;
+        if (!(in = varint_get(in, end, &v[0]))) return -1;
+        type = v[0] & 3;
+        if (type == 0 && !(in = varint_get(in, end, &type))) return -1;
+        for (int k = 1; k < 5; k++) {
+            if (!(in = varint_get(in, end, &v[k]))) return -1;
+        }
+        memset(tx, 0, sizeof(*tx));
+        tx->seq = base + i + 1;
+        tx->account = (uint32_t)(v[0] >> 2);
+        tx->type = (uint32_t)type;
+        tx->amount = unzigzag(v[1]);
+        tx->time = (int64_t)((uint64_t)time + (uint64_t)unzigzag(v[3]));
+        if (v[4] >= tx->seq) return -1;
+        tx->prev = v[4] ? tx->seq - v[4] : 0;
+        tx->balance = (int64_t)((uint64_t)tx_predict(out, base, tx) + (uint64_t)unzigzag(v[2]));
+        time = tx->time;
+    }
+    return in == end ? 0 : -1;
+}
+
+// Unpacked archive blocks for history reads, replaced round robin
+static struct {
+    uint64_t base;
+    tx_record_t *records;
+} archive_cache[ARCHIVE_CACHE];
+static size_t archive_cache_next = 0;
+
+// Records of an archive block; the caller holds segment_lock
+static const tx_record_t *archive_records(size_t index)
+{
+    const archive_entry_t *entry = &archive[index];
+    for (int i = 0; i < ARCHIVE_CACHE; i++) {
+        if (archive_cache[i].records && archive_cache[i].base == entry->block.base) return archive_cache[i].records;
+    }
+
+    uint8_t *packed = malloc(entry->block.size ? entry->block.size : 1);
+    tx_record_t *records = malloc((entry->block.count ? entry->block.count : 1) * sizeof(tx_record_t));
+    if (!packed || !records || read_at(archive_fd, packed, entry->block.size, entry->offset) != 0 ||
+        crc32_update(0, packed, entry->block.size) != entry->block.crc ||
+        archive_unpack(packed, entry->block.size, entry->block.base, entry->block.count, records) != 0) {
+        printf("Error: Archived transactions %llu-%llu are damaged.\n", (unsigned long long)entry->block.base + 1,
+               (unsigned long long)(entry->block.base + entry->block.count));
+        free(packed);
+        free(records);
+        return NULL;
+    }
+    free(packed);
+    free(archive_cache[archive_cache_next].records);
+    archive_cache[archive_cache_next].base = entry->block.base;
+    archive_cache[archive_cache_next].records = records;
+    archive_cache_next = (archive_cache_next + 1) % ARCHIVE_CACHE;
+    return records;
+}
+
+// Copies records first .. first + n - 1 (all appended already) from the segments or the archive
+static int log_read(uint64_t first, tx_record_t *out, uint64_t n)
+{
+    int result = 0;
+    LOCK(&segment_lock);
+    while (n > 0 && result == 0) {
+        uint64_t take = n;
+        if (first > segments[0].base) {
+            size_t i = segment_find(first);
+            if (i + 1 < segment_count && segments[i + 1].base + 1 - first < take) take = segments[i + 1].base + 1 - first;
+            result = read_at(segments[i].fd, out, take * sizeof(*out), segment_offset(&segments[i], first));
+        } else if (archive_count > 0) {
+            size_t i = archive_find(first);
+            const archive_block_t *block = &archive[i].block;
+            const tx_record_t *records = archive_records(i);
+            if (!records || first <= block->base) {
+                result = -1;
+                break;
+            }
+            if (block->base + block->count + 1 - first < take) take = block->base + block->count + 1 - first;
+            memcpy(out, records + (first - block->base - 1), take * sizeof(*out));
+        } else {
+            result = -1;
+        }
+        first += take;
+        out += take;
+        n -= take;
+    }
+    UNLOCK(&segment_lock);
+    return result;
+}
+
+// Starts the next segment once the current one is full; the caller holds log_lock
+static int log_rotate()
+{
+    // Later syncs only flush the new file, so the full one is flushed now
+    if (file_sync(tx_fd) != 0) return -1;
+    char name[64];
+    uint64_t records;
+    segment_name(segment_first + segment_count, name, sizeof(name));
+    int fd = ledger_file(name, TX_MAGIC, sizeof(tx_record_t), tx_count, &records, NULL);
+    if (fd < 0) return -1;
+    if (records != 0 || file_sync(fd) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    LOCK(&segment_lock);
+    segment_t *more = realloc(segments, (segment_count + 1) * sizeof(*segments));
+    if (more) {
+        segments = more;
+        segments[segment_count].fd = fd;
+        segments[segment_count].base = tx_count;
+        segments[segment_count].count = 0;
+        segment_count++;
+    }
+    UNLOCK(&segment_lock);
+    if (!more) {
+        close(fd);
+        return -1;
+    }
+    tx_fd = fd;
+    snapshot_due = 1;
+    return 0;
+}
+
+// Writes tx as record tx->seq == tx_count + 1; the caller holds log_lock
+static int log_append(const tx_record_t *tx, uint64_t n)
+{
+    // Records appended together stay in one segment and one write
+    if (segments[segment_count - 1].count + n > segment_records && segments[segment_count - 1].count > 0 &&
+        log_rotate() != 0) return -1;
+    segment_t *segment = &segments[segment_count - 1];
+    if (write_at(segment->fd, tx, n * sizeof(*tx), segment_offset(segment, tx->seq)) != 0) return -1;
+    segment->count += n;
+    tx_count = tx[n - 1].seq;
+    return 0;
+}
+
+/* Makes the log durable up to seq. Callers that arrive while an fsync runs queue
+ * on sync_lock and usually find their record covered by it, so concurrent commits
+ * share one fsync (group commit). */
+int log_sync(uint64_t seq)
+{
+    int result = 0;
+    LOCK(&sync_lock);
+    LOCK(&log_lock);
+    uint64_t durable = tx_durable, target = tx_count;
+    int fd = tx_fd; // Segments before it were flushed when it was started
+    UNLOCK(&log_lock);
+    if (durable < seq) {
+        result = file_sync(fd);
+        if (result == 0) {
+            LOCK(&log_lock);
+            tx_durable = target;
+            UNLOCK(&log_lock);
+        }
+    }
+    UNLOCK(&sync_lock);
+    return result;
+}
+
+// Keeps records 1 .. count and drops the rest
+static int log_truncate(uint64_t count)
+{
+    char name[64];
+    while (segment_count > 1 && segments[segment_count - 1].base >= count) {
+        segment_count--;
+        close(segments[segment_count].fd);
+        segment_name(segment_first + segment_count, name, sizeof(name));
+        remove(name);
+    }
+    segment_t *segment = &segments[segment_count - 1];
+    segment->count = count - segment->base;
+    tx_count = count;
+    tx_fd = segment->fd;
+    return file_truncate(segment->fd, segment_offset(segment, count + 1));
+}
+
+// Cuts the log at the first record past from (known to be on disk) that a crash left torn or unwritten
+static int log_validate(uint64_t from)
+{
+    enum { CHUNK = 4096 };
+    tx_record_t *chunk = malloc(CHUNK * sizeof(tx_record_t));
+    uint32_t sent = 0; // Account of a TX_TRANSFER_OUT just read
+    if (!chunk) return -1;
+    if (from > 0 && from <= tx_count && log_read(from, chunk, 1) == 0 && chunk[0].type == TX_TRANSFER_OUT) sent = chunk[0].account;
+    for (uint64_t seq = from + 1; seq <= tx_count; ) {
+        uint64_t n = tx_count - seq + 1 < CHUNK ? tx_count - seq + 1 : CHUNK;
+        if (log_read(seq, chunk, n) != 0) {
+            free(chunk);
+            return -1;
+        }
+        for (uint64_t i = 0; i < n; i++, seq++) {
+            tx_record_t *tx = &chunk[i];
+            // A transfer whose credit is missing is dropped with it
+            if (sent && (tx->type != TX_TRANSFER_IN || tx->account == sent)) {
+                free(chunk);
+                return log_truncate(seq - 2);
+            }
+            if (tx->seq != seq || tx->account == 0 || tx->prev >= seq || tx->type < TX_DEPOSIT || tx->type > TX_TRANSFER_IN ||
+                (tx->type == TX_TRANSFER_IN && !sent)) {
+                free(chunk);
+                return log_truncate(seq - 1);
+            }
+            sent = (tx->type == TX_TRANSFER_OUT) ? tx->account : 0;
+        }
+    }
+    free(chunk);
+    return sent ? log_truncate(tx_count - 1) : 0;
+}
+
+// Indexes TX_ARCHIVE, if there is one; a block cut short by a crash is dropped
+static int archive_open()
+{
+    struct stat st;
+    uint64_t records;
+    if (stat(TX_ARCHIVE, &st) != 0) return 0;
+    archive_fd = ledger_file(TX_ARCHIVE, ARCHIVE_MAGIC, sizeof(tx_record_t), 0, &records, NULL);
+    if (archive_fd < 0 || fstat(archive_fd, &st) != 0) return -1;
+
+    uint64_t size = (uint64_t)st.st_size, offset = sizeof(ledger_header_t), expected = 0;
+    archive_block_t block;
+    while (offset + sizeof(block) <= size) {
+        if (read_at(archive_fd, &block, sizeof(block), offset) != 0) return -1;
+        if (block.magic != BLOCK_MAGIC || block.base != expected || block.size > size - offset - sizeof(block)) break;
+        archive_entry_t *more = realloc(archive, (archive_count + 1) * sizeof(*archive));
+        if (!more) return -1;
+        archive = more;
+        archive[archive_count].block = block;
+        archive[archive_count].offset = offset + sizeof(block);
+        archive_count++;
+        expected += block.count;
+        offset += sizeof(block) + block.size;
+    }
+    return offset < size ? file_truncate(archive_fd, offset) : 0;
+}
+
+// Opens the archive and every live segment, which must continue one another
+static int log_open()
+{
+    char name[64];
+    if (archive_open() != 0) return -1;
+    segment_first = archive_count;
+    uint64_t expected = archive_count ? archive[archive_count - 1].block.base + archive[archive_count - 1].block.count : 0;
+
+    // The newest archived segment survives if a compaction stopped before removing it
+    if (archive_count > 0) {
+        segment_name(archive_count - 1, name, sizeof(name));
+        remove(name);
+    }
+    for (size_t number = segment_first; ; number++) {
+        struct stat st;
+        uint64_t records;
+        ledger_header_t header;
+        segment_name(number, name, sizeof(name));
+        if (number > segment_first && stat(name, &st) != 0) break;
+        int fd = ledger_file(name, TX_MAGIC, sizeof(tx_record_t), expected, &records, &header);
+        if (fd < 0) return -1;
+        segment_t *more = realloc(segments, (segment_count + 1) * sizeof(*segments));
+        if (!more || header.base != expected) {
+            if (more) segments = more;
+            if (header.base != expected) printf("Error: %s does not continue the transaction log.\n", name);
+            close(fd);
+            return -1;
+        }
+        segments = more;
+        segments[segment_count].fd = fd;
+        segments[segment_count].base = expected;
+        segments[segment_count].count = records;
+        segment_count++;
+        expected += records;
+    }
+    tx_count = expected;
+    tx_fd = segments[segment_count - 1].fd;
+    return 0;
+}
+
+static void log_close()
+{
+    for (size_t i = 0; i < segment_count; i++) close(segments[i].fd);
+    for (int i = 0; i < ARCHIVE_CACHE; i++) {
+        free(archive_cache[i].records);
+        archive_cache[i].records = NULL;
+    }
+    free(segments);
+    free(archive);
+    segments = NULL;
+    archive = NULL;
+    segment_count = archive_count = 0;
+    if (archive_fd >= 0) close(archive_fd);
+    archive_fd = tx_fd = -1;
+}
+
+/* Moves cold segments - covered by the latest snapshot and older than the
+ * LOG_HOT_SEGMENTS newest - into TX_ARCHIVE and deletes their files. The block is
+ * on disk before the segment goes, and readers switch over under segment_lock. */
+static int log_compact()
+{
+    for (;;) {
+        LOCK(&log_lock);
+        int cold = segment_count > LOG_HOT_SEGMENTS && segments[0].base + segments[0].count <= snapshot_seq;
+        segment_t segment = segments[0];
+        size_t number = segment_first;
+        UNLOCK(&log_lock);
+        if (!cold) return 0;
+
+        uint64_t records;
+        if (archive_fd < 0) archive_fd = ledger_file(TX_ARCHIVE, ARCHIVE_MAGIC, sizeof(tx_record_t), 0, &records, NULL);
+        size_t bytes = (segment.count ? segment.count : 1) * sizeof(tx_record_t);
+        tx_record_t *data = malloc(bytes);
+        uint8_t *packed = malloc(bytes);
+        archive_block_t block = {BLOCK_MAGIC, 0, segment.base, segment.count, 0};
+        struct stat st;
+        int result = (archive_fd < 0 || !data || !packed || fstat(archive_fd, &st) != 0 ||
+                      read_at(segment.fd, data, segment.count * sizeof(tx_record_t), segment_offset(&segment, segment.base + 1)) != 0) ? -1 : 0;
+        uint64_t block_offset = result == 0 ? (uint64_t)st.st_size : 0;
+        if (result == 0) {
+            block.size = archive_pack(data, segment.base, segment.count, packed);
+            block.crc = crc32_update(0, packed, block.size);
+            if (write_at(archive_fd, &block, sizeof(block), block_offset) != 0 ||
+                write_at(archive_fd, packed, block.size, block_offset + sizeof(block)) != 0 || file_sync(archive_fd) != 0) result = -1;
+
+        }
+        if (result == 0) {
+            LOCK(&log_lock);
+            LOCK(&segment_lock);
+            archive_entry_t *more = realloc(archive, (archive_count + 1) * sizeof(*archive));
+            if (more) {
+                archive = more;
+                archive[archive_count].block = block;
+                archive[archive_count].offset = block_offset + sizeof(block);
+                archive_count++;
+                memmove(segments, segments + 1, (segment_count - 1) * sizeof(*segments));
+                segment_count--;
+                segment_first++;
+            }
+            UNLOCK(&segment_lock);
+            UNLOCK(&log_lock);
+            if (more) {
+                char name[64];
+                close(segment.fd);
+                segment_name(number, name, sizeof(name));
+                remove(name);
+            } else {
+                result = -1;
+            }
+        }
+        free(data);
+        free(packed);
+        if (result != 0) return -1;
+    }
+}
+
+/*Ledger*/
+// Amounts like "150", "99.5" or "12,34" in kopecks; 0 on success
+int parse_amount(const char *text, int64_t *amount)
+{
+    while (isspace((unsigned char)*text)) text++;
+    int64_t whole = 0;
+    int digits = 0, cents = 0, decimals = 0;
+    for (; isdigit((unsigned char)*text); text++, digits++) {
+        if (whole > (INT64_MAX / 100 - 9) / 10) return -1;
+        whole = whole * 10 + (*text - '0');
+    }
+    if (*text == '.' || *text == ',') {
+        for (text++; isdigit((unsigned char)*text); text++, decimals++) {
+            if (decimals >= 2) return -1; // Finer than a kopeck
+            cents = cents * 10 + (*text - '0');
+        }
+    }
+    while (isspace((unsigned char)*text)) text++;
+    if (*text != '\0' || digits + decimals == 0) return -1;
+
+    if (decimals == 1) cents *= 10;
+    *amount = whole * 100 + cents;
+    return 0;
+}
+
+// Unix seconds, "YYYY-MM-DD" or "YYYY-MM-DD HH:MM[:SS]" (local time); empty means now
+int parse_time(const char *text, int64_t *when)
+{
+    struct tm t;
+    char *end;
+    while (isspace((unsigned char)*text)) text++;
+    if (*text == '\0') {
+        *when = (int64_t)time(NULL);
+        return 0;
+    }
+    memset(&t, 0, sizeof(t));
+    int fields = sscanf(text, "%d-%d-%d%*[ T]%d:%d:%d", &t.tm_year, &t.tm_mon, &t.tm_mday, &t.tm_hour, &t.tm_min, &t.tm_sec);
+    if (fields == 3 || fields >= 5) {
+        t.tm_year -= 1900;
+        t.tm_mon -= 1;
+        t.tm_isdst = -1;
+        *when = (int64_t)mktime(&t);
+        return 0;
+    }
+    long long seconds = strtoll(text, &end, 10);
+    while (isspace((unsigned char)*end)) end++;
+    if (end == text || *end != '\0') return -1;
+    *when = seconds;
+    return 0;
+}
+
+void format_amount(int64_t amount, char *out, size_t size)
+{
+    uint64_t abs = amount < 0 ? (uint64_t)0 - (uint64_t)amount : (uint64_t)amount;
+    snprintf(out, size, "%s%llu.%02llu", amount < 0 ? "-" : "", (unsigned long long)(abs / 100),
+             (unsigned long long)(abs % 100));
+}
+
+static uint64_t account_offset(uint32_t account)
+{
+    return sizeof(ledger_header_t) + (uint64_t)(account - 1) * sizeof(account_t);
+}
+
+// Accounts never written read back as empty records
+int account_read(uint32_t account, account_t *acc)
+{
+    if (account == 0) return -1;
+    memset(acc, 0, sizeof(*acc));
+    struct stat st;
+    if (fstat(accounts_fd, &st) != 0) return -1;
+    if (account_offset(account) + sizeof(*acc) > (uint64_t)st.st_size) return 0;
+    return read_at(accounts_fd, acc, sizeof(*acc), account_offset(account));
+}
+
+static int account_write(uint32_t account, const account_t *acc)
+{
+    return write_at(accounts_fd, acc, sizeof(*acc), account_offset(account));
+}
+
+int tx_read(uint64_t seq, tx_record_t *tx)
+{
+    LOCK(&log_lock);
+    uint64_t count = tx_count;
+    UNLOCK(&log_lock);
+    if (seq == 0 || seq > count) return -1;
+    return log_read(seq, tx, 1);
+}
+
+/* Appends a transaction and then updates the account it applies to. The record
+ * is durable only after log_sync(); the account is a cache the log can rebuild.
+ * The caller holds the account's lock; the log lock only covers the append. */
+static int tx_commit(uint32_t account, account_t *acc, uint32_t type, int64_t amount, int64_t when)
+{
+    tx_record_t tx;
+    memset(&tx, 0, sizeof(tx));
+    tx.account = account;
+    tx.type = type;
+    tx.amount = amount;
+    tx.balance = acc->balance + (type == TX_WITHDRAW ? -amount : amount);
+    tx.time = when;
+    tx.prev = acc->last_tx;
+    LOCK(&log_lock);
+    tx.seq = tx_count + 1;
+    int result = log_append(&tx, 1);
+    UNLOCK(&log_lock);
+    if (result != 0) return -1;
+
+    acc->balance = tx.balance;
+    acc->updated = tx.time;
+    acc->operations++;
+    acc->last_tx = tx.seq;
+    return account_write(account, acc);
+}
+
+static int ledger_mark(uint64_t checkpoint, uint64_t in_use)
+{
+    ledger_header_t header;
+    if (read_at(accounts_fd, &header, sizeof(header), 0) != 0) return -1;
+    header.checkpoint = checkpoint;
+    header.in_use = in_use;
+    if (write_at(accounts_fd, &header, sizeof(header), 0) != 0) return -1;
+    return file_sync(accounts_fd);
+}
+
+static void account_replay(account_t *acc, const tx_record_t *tx)
+{
+    if (acc->last_tx >= tx->seq) return;
+    acc->balance = tx->balance;
+    acc->updated = tx->time;
+    if (!acc->created) acc->created = tx->time;
+    acc->operations++;
+    acc->last_tx = tx->seq;
+}
+
+// In-memory copy of the accounts, for snapshots, restores and checks
+typedef struct {
+    account_t *records;
+    uint64_t count;
+    uint64_t cap;
+} account_table_t;
+
+static account_t *table_account(account_table_t *table, uint32_t account)
+{
+    if (account > table->cap) {
+        uint64_t cap = table->cap ? table->cap : 1024;
+        while (cap < account) cap *= 2;
+        account_t *more = realloc(table->records, cap * sizeof(account_t));
+        if (!more) return NULL;
+        table->records = more;
+        table->cap = cap;
+    }
+    if (account > table->count) {
+        memset(table->records + table->count, 0, (account - table->count) * sizeof(account_t));
+        table->count = account;
+    }
+    return &table->records[account - 1];
+}
+
+// Applies log records first .. last to the table; check, if set, counts records that break their account's chain
+static int table_replay(account_table_t *table, uint64_t first, uint64_t last, uint64_t *check)
+{
+    enum { CHUNK = 4096 };
+    tx_record_t *chunk = malloc(CHUNK * sizeof(tx_record_t));
+    if (!chunk) return -1;
+    for (uint64_t seq = first; seq <= last; ) {
+        uint64_t n = last - seq + 1 < CHUNK ? last - seq + 1 : CHUNK;
+        if (log_read(seq, chunk, n) != 0) {
+            free(chunk);
+            return -1;
+        }
+        for (uint64_t i = 0; i < n; i++, seq++) {
+            tx_record_t *tx = &chunk[i];
+            account_t *acc = table_account(table, tx->account);
+            if (!acc) {
+                free(chunk);
+                return -1;
+            }
+            if (check && (tx->prev != acc->last_tx ||
+                          (tx->prev && acc->balance + tx_delta(tx) != tx->balance))) {
+                if (*check < 5) printf("Transaction %llu does not follow account %u's previous one.\n",
+                                       (unsigned long long)tx->seq, tx->account);
+                (*check)++;
+            }
+            account_replay(acc, tx);
+        }
+    }
+    free(chunk);
+    return 0;
+}
+
+/* Writes ACCOUNTS_SNAPSHOT, all accounts as of one log record, while transactions go
+ * on: the accounts are copied a few at a time under their locks, then the records
+ * appended meanwhile are replayed onto the copy, which makes it exact as of the last. */
+static int ledger_snapshot()
+{
+    account_table_t table = {NULL, 0, 0};
+    struct stat st;
+    LOCK(&log_lock);
+    uint64_t start = tx_count;
+    UNLOCK(&log_lock);
+    if (fstat(accounts_fd, &st) != 0) return -1;
+    uint64_t accounts = ((uint64_t)st.st_size - sizeof(ledger_header_t)) / sizeof(account_t);
+    if (accounts > 0 && !table_account(&table, (uint32_t)accounts)) return -1;
+
+    // Runs of consecutive stripes, locked in ascending order like every multi-account lock
+    for (uint64_t account = 1; account <= accounts; ) {
+        uint64_t stripe = account % LOCK_STRIPES, n = LOCK_STRIPES - stripe;
+        if (n > 64) n = 64;
+        if (n > accounts - account + 1) n = accounts - account + 1;
+        for (uint64_t k = 0; k < n; k++) LOCK(&account_locks[stripe + k]);
+        int result = read_at(accounts_fd, &table.records[account - 1], n * sizeof(account_t), account_offset((uint32_t)account));
+        for (uint64_t k = n; k-- > 0; ) UNLOCK(&account_locks[stripe + k]);
+        if (result != 0) {
+            free(table.records);
+            return -1;
+        }
+        account += n;
+    }
+
+    LOCK(&log_lock);
+    uint64_t end = tx_count;
+    UNLOCK(&log_lock);
+    char tmp[64];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", ACCOUNTS_SNAPSHOT);
+    snapshot_header_t header = {SNAPSHOT_MAGIC, sizeof(account_t), end, 0, 0, 0};
+    int fd = -1, result = -1;
+    if (log_sync(end) == 0 && table_replay(&table, start + 1, end, NULL) == 0) {
+        header.accounts = table.count;
+        header.crc = crc32_update(0, table.records, table.count * sizeof(account_t));
+        fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    }
+    if (fd >= 0) {
+        result = (write_at(fd, &header, sizeof(header), 0) == 0 &&
+                  write_at(fd, table.records, table.count * sizeof(account_t), sizeof(header)) == 0 && file_sync(fd) == 0) ? 0 : -1;
+        close(fd);
+        // Written beside the snapshot and renamed over it, so a crash leaves the old one
+        if (result == 0) remove(ACCOUNTS_SNAPSHOT); // rename does not replace on Windows
+        if (result == 0 && rename(tmp, ACCOUNTS_SNAPSHOT) != 0) result = -1;
+    }
+    free(table.records);
+    if (result != 0) return -1;
+    LOCK(&log_lock);
+    snapshot_seq = end;
+    UNLOCK(&log_lock);
+    return 0;
+}
+
+// Reads ACCOUNTS_SNAPSHOT into table; 1 if there is none, -1 if it is damaged
+static int snapshot_load(account_table_t *table, uint64_t *seq)
+{
+    snapshot_header_t header;
+    struct stat st;
+    int fd = open(ACCOUNTS_SNAPSHOT, O_RDONLY | O_BINARY);
+    if (fd < 0) return 1;
+    int result = -1;
+    if (fstat(fd, &st) == 0 && read_at(fd, &header, sizeof(header), 0) == 0 && header.magic == SNAPSHOT_MAGIC &&
+        header.record_size == sizeof(account_t) && header.accounts <= UINT32_MAX &&
+        (uint64_t)st.st_size == sizeof(header) + header.accounts * sizeof(account_t) &&
+        (header.accounts == 0 || table_account(table, (uint32_t)header.accounts)) &&
+        read_at(fd, table->records, header.accounts * sizeof(account_t), sizeof(header)) == 0 &&
+        crc32_update(0, table->records, header.accounts * sizeof(account_t)) == header.crc) {
+        *seq = header.seq;
+        result = 0;
+    }
+    close(fd);
+    if (result != 0) printf("Error: %s is damaged.\n", ACCOUNTS_SNAPSHOT);
+    return result;
+}
+
+// Replaces ACCOUNTS_DB with the snapshot brought up to date by the log after it
+static int ledger_restore(account_table_t *table, uint64_t seq)
+{
+    if (table_replay(table, seq + 1, tx_count, NULL) != 0) return -1;
+    if (file_truncate(accounts_fd, sizeof(ledger_header_t) + table->count * sizeof(account_t)) != 0) return -1;
+    if (write_at(accounts_fd, table->records, table->count * sizeof(account_t), sizeof(ledger_header_t)) != 0) return -1;
+    printf("Restored %llu accounts from the snapshot and %llu later transactions.\n",
+           (unsigned long long)table->count, (unsigned long long)(tx_count - seq));
+    return 0;
+}
+
+static int account_rebuild(uint32_t account, uint64_t latest)
+{
+    account_t acc;
+    tx_record_t tx;
+    if (account_read(account, &acc) != 0) return -1;
+    acc.balance = 0;
+    acc.operations = 0;
+    acc.last_tx = latest;
+    for (uint64_t seq = latest; seq; seq = tx.prev) {
+        if (tx_read(seq, &tx) != 0 || tx.account != account || tx.prev >= seq) return -1;
+        if (acc.operations++ == 0) {
+            acc.balance = tx.balance;
+            acc.updated = tx.time;
+        }
+    }
+    return account_write(account, &acc);
+}
+
+static int account_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* Without a snapshot, ACCOUNTS_DB is fixed in place: records up to the checkpoint
+ * were synced with it, and every account written since is rebuilt from its chain of
+ * records, which also undoes updates whose log records never reached the disk. */
+static int ledger_rebuild(uint64_t checkpoint, uint64_t accounts)
+{
+    enum { CHUNK = 4096 };
+    tx_record_t *chunk = malloc(CHUNK * sizeof(tx_record_t));
+    uint32_t *need = NULL;
+    uint64_t *latest = NULL;
+    size_t count = 0, cap = 0;
+    int result = -1;
+    if (!chunk) return -1;
+    if (checkpoint > tx_count) checkpoint = tx_count;
+
+    // Accounts named by records past the checkpoint
+    for (uint64_t seq = checkpoint + 1; seq <= tx_count; ) {
+        uint64_t n = tx_count - seq + 1 < CHUNK ? tx_count - seq + 1 : CHUNK;
+        if (log_read(seq, chunk, n) != 0) goto done;
+        for (uint64_t i = 0; i < n; i++, seq++) {
+            tx_record_t *tx = &chunk[i];
+            if (count == cap) {
+                cap = cap ? cap * 2 : 1024;
+                uint32_t *more = realloc(need, cap * sizeof(*need));
+                if (!more) goto done;
+                need = more;
+            }
+            need[count++] = tx->account;
+        }
+    }
+
+    // Accounts ahead of the log hold updates whose records were lost
+    account_t acc;
+    for (uint32_t account = 1; account <= accounts; account++) {
+        if (account_read(account, &acc) != 0) goto done;
+        if (acc.last_tx <= tx_count) continue;
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            uint32_t *more = realloc(need, cap * sizeof(*need));
+            if (!more) goto done;
+            need = more;
+        }
+        need[count++] = account;
+    }
+
+    size_t unique = 0;
+    if (count) qsort(need, count, sizeof(*need), account_compare);
+    for (size_t i = 0; i < count; i++) {
+        if (unique == 0 || need[unique - 1] != need[i]) need[unique++] = need[i];
+    }
+
+    // Latest surviving record of each, scanning the log backwards
+    latest = calloc(unique ? unique : 1, sizeof(*latest));
+    if (!latest) goto done;
+    size_t missing = unique;
+    for (uint64_t end = tx_count; end > 0 && missing > 0; ) {
+        uint64_t n = end < CHUNK ? end : CHUNK;
+        if (log_read(end - n + 1, chunk, n) != 0) goto done;
+        for (uint64_t i = n; i-- > 0 && missing > 0; ) {
+            uint32_t *found = bsearch(&chunk[i].account, need, unique, sizeof(*need), account_compare);
+            if (found && latest[found - need] == 0) {
+                latest[found - need] = chunk[i].seq;
+                missing--;
+            }
+        }
+        end -= n;
+    }
+    for (size_t i = 0; i < unique; i++) {
+        if (account_rebuild(need[i], latest[i]) != 0) goto done;
+    }
+    if (unique) printf("Recovered %zu accounts from the transaction log.\n", unique);
+    result = 0;
+
+done:
+    free(chunk);
+    free(need);
+    free(latest);
+    return result;
+}
+
+/* Brings ACCOUNTS_DB back in line with the log after a crash. The log is cut at the
+ * first torn record past what the checkpoint or the snapshot saw on disk, then the
+ * accounts are restored from the snapshot and the records after it, so the work
+ * depends on the snapshot interval rather than on the size of the log. */
+static int ledger_recover(uint64_t checkpoint, uint64_t accounts)
+{
+    account_table_t table = {NULL, 0, 0};
+    uint64_t seq = 0;
+    int found = snapshot_load(&table, &seq);
+    if (found < 0 || seq > tx_count) {
+        if (found == 0) printf("Error: %s is ahead of the transaction log.\n", ACCOUNTS_SNAPSHOT);
+        free(table.records);
+        return -1;
+    }
+    if (checkpoint > tx_count) checkpoint = tx_count;
+    int result = log_validate(checkpoint > seq ? checkpoint : seq);
+    if (result == 0) result = (found == 0) ? ledger_restore(&table, seq) : ledger_rebuild(checkpoint, accounts);
+    if (found == 0) snapshot_seq = seq;
+    free(table.records);
+    return result;
+}
+
+int ledger_open()
+{
+    uint64_t accounts;
+    ledger_header_t header;
+    crc_init();
+    accounts_fd = ledger_file(ACCOUNTS_DB, ACCOUNTS_MAGIC, sizeof(account_t), 0, &accounts, &header);
+    if (accounts_fd < 0) return -1;
+
+#ifndef _WIN32
+    // One process owns the ledger; others reach it through the server
+    struct flock owner;
+    memset(&owner, 0, sizeof(owner));
+    owner.l_type = F_WRLCK;
+    owner.l_whence = SEEK_SET;
+    if (fcntl(accounts_fd, F_SETLK, &owner) != 0) {
+        printf("Error: Accounts are in use by another ATM process; run \"atm client\" to reach its server.\n");
+        ledger_close();
+        return -1;
+    }
+#endif
+    if (log_open() != 0) {
+        ledger_close();
+        return -1;
+    }
+
+    // A clean close leaves the accounts matching the whole log; anything else is replayed
+    int recovered = header.in_use || header.checkpoint != tx_count;
+    if (recovered && (ledger_recover(header.checkpoint, accounts) != 0 ||
+        file_sync(tx_fd) != 0 || file_sync(accounts_fd) != 0)) {
+        printf("Error: Cannot recover accounts from %s.\n", TX_LOG);
+        ledger_close();
+        return -1;
+    }
+    tx_durable = tx_count;
+    if (ledger_mark(tx_count, 1) != 0) {
+        ledger_close();
+        return -1;
+    }
+    ledger_owned = 1;
+    if (time_index_open(recovered) != 0) {
+        printf("Error: Cannot open %s.\n", TIME_INDEX);
+        ledger_close();
+        return -1;
+    }
+
+    // Recovery always has a snapshot to start from, and cold segments wait for one
+    account_table_t table = {NULL, 0, 0};
+    if (snapshot_load(&table, &snapshot_seq) == 1 || segment_count > LOG_HOT_SEGMENTS) snapshot_due = 1;
+    free(table.records);
+    ledger_maintain();
+    return 0;
+}
+
+void ledger_close()
+{
+    // Checkpoint: the accounts now reflect every record, so the next start replays nothing
+    if (ledger_owned && log_sync(tx_count) == 0 && file_sync(accounts_fd) == 0) ledger_mark(tx_count, 0);
+    time_index_close(ledger_owned);
+    ledger_owned = 0;
+    if (accounts_fd >= 0) close(accounts_fd);
+    accounts_fd = -1;
+    log_close();
+}
+
+/* Takes the snapshot a full segment asked for, archives the segments it made cold
+ * and brings the time index closer to the end of the log */
+void ledger_maintain()
+{
+    LOCK(&log_lock);
+    int due = snapshot_due;
+    snapshot_due = 0;
+    UNLOCK(&log_lock);
+    if (due && (ledger_snapshot() != 0 || log_compact() != 0)) {
+        printf("Error: Cannot write the accounts snapshot or archive the transaction log.\n");
+    }
+    if (time_index_update(TIME_INDEX_STEP) != 0) printf("Error: Cannot update %s.\n", TIME_INDEX);
+}
+
+/* Checks the latest snapshot, that every log record after it continues its account's
+ * chain of balances, and that the result is what ACCOUNTS_DB holds. The work depends
+ * on the snapshot interval and the number of accounts. Returns the problems found. */
+int ledger_verify()
+{
+    account_table_t table = {NULL, 0, 0};
+    uint64_t seq = 0, problems = 0;
+    int found = snapshot_load(&table, &seq);
+    if (found < 0 || seq > tx_count || table_replay(&table, seq + 1, tx_count, &problems) != 0) {
+        printf("Error: Cannot replay the transaction log.\n");
+        free(table.records);
+        return 1;
+    }
+
+    struct stat st;
+    uint64_t accounts = (fstat(accounts_fd, &st) == 0) ? ((uint64_t)st.st_size - sizeof(ledger_header_t)) / sizeof(account_t) : 0;
+    if (table.count > accounts) accounts = table.count;
+    for (uint64_t account = 1; account <= accounts; account++) {
+        account_t acc, empty;
+        memset(&empty, 0, sizeof(empty));
+        const account_t *expected = (account <= table.count) ? &table.records[account - 1] : &empty;
+        if (account_read((uint32_t)account, &acc) != 0 || acc.balance != expected->balance ||
+            acc.operations != expected->operations || acc.last_tx != expected->last_tx) {
+            if (problems < 5) printf("Account %llu does not match the log.\n", (unsigned long long)account);
+            problems++;
+        }
+    }
+    printf("Checked %llu transactions after snapshot %llu and %llu accounts: %llu problems.\n",
+           (unsigned long long)(tx_count - seq), (unsigned long long)seq, (unsigned long long)accounts,
+           (unsigned long long)problems);
+    free(table.records);
+    return problems ? 1 : 0;
+}
+
+// Parses a "YYYY-MM-DD Deposit: +12.50" line of the old history files
+static int parse_history_line(const char *line, uint32_t *type, int64_t *amount, int64_t *when)
+{
+    struct tm t;
+    char kind[16], value[32];
+    memset(&t, 0, sizeof(t));
+    if (sscanf(line, "%d-%d-%d %15[A-Za-z]: %31s", &t.tm_year, &t.tm_mon, &t.tm_mday, kind, value) != 5) return -1;
+    if (strcmp(kind, "Deposit") == 0) *type = TX_DEPOSIT;
+    else if (strcmp(kind, "Withdrawal") == 0) *type = TX_WITHDRAW;
+    else return -1;
+    if (parse_amount(value + 1, amount) != 0) return -1;
+
+    t.tm_year -= 1900;
+    t.tm_mon -= 1;
+    t.tm_hour = 12;
+    t.tm_isdst = -1;
+    *when = (int64_t)mktime(&t);
+    return 0;
+}
+
+/* Opens the ledger record of a user on first login, moving over the balance and
+ * history of the old <user>_balance.txt and <user>_history.txt, which are then removed. */
+static int account_import(const char *user, uint32_t account)
+{
+    account_t acc;
+    if (account_read(account, &acc) != 0) return -1;
+    if (acc.flags & ACCOUNT_OPEN) return 0;
+    char bal_file[100], hist_file[100];
+    sprintf(bal_file, "%s_balance.txt", user);
+    sprintf(hist_file, "%s_history.txt", user);
+
+    double old_balance = 0.0;
+    int carried = 0;
+    FILE *file = fopen(bal_file, "r");
+    if (file) {
+        carried = (fscanf(file, "%lf", &old_balance) == 1);
+        fclose(file);
+    }
+    int64_t final_balance = (int64_t)(old_balance * 100 + (old_balance < 0 ? -0.5 : 0.5));
+
+    // History first, starting from the balance that makes it end at the stored one
+    if (!acc.created) acc.created = (int64_t)time(NULL);
+    file = fopen(hist_file, "r");
+    if (file) {
+        char line[100];
+        int64_t net = 0, amount, when;
+        uint32_t type, parsed = 0;
+        while (fgets(line, sizeof(line), file)) {
+            if (parse_history_line(line, &type, &amount, &when) != 0) continue;
+            net += (type == TX_DEPOSIT) ? amount : -amount;
+            parsed++;
+        }
+        // A history with no usable line leaves the balance to the opening record below
+        if (acc.operations == 0 && carried && parsed > 0) acc.balance = final_balance - net;
+
+        // Lines already moved before an interrupted import are skipped
+        uint64_t done = acc.operations, n = 0;
+        rewind(file);
+        while (fgets(line, sizeof(line), file)) {
+            if (parse_history_line(line, &type, &amount, &when) != 0 || n++ < done) continue;
+            if (tx_commit(account, &acc, type, amount, when) != 0) {
+                fclose(file);
+                return -1;
+            }
+            if (acc.operations == 1) acc.created = when;
+        }
+        fclose(file);
+    }
+    // Without history the carried balance needs a record of its own to be rebuilt from the log
+    if (carried && acc.operations == 0 && final_balance != 0 &&
+        tx_commit(account, &acc, TX_OPENING, final_balance, acc.created) != 0) return -1;
+    if (carried) acc.balance = final_balance;
+    acc.flags |= ACCOUNT_OPEN;
+    if (!acc.updated) acc.updated = acc.created;
+    if (account_write(account, &acc) != 0) return -1;
+
+    // The old files go only once the ledger holds everything they did
+    if (log_sync(acc.last_tx) != 0 || file_sync(accounts_fd) != 0) return -1;
+    remove(bal_file);
+    remove(hist_file);
+    return 0;
+}
+
+int account_open(const char *user, uint32_t account)
+{
+    atm_lock_t *lock = &account_locks[account % LOCK_STRIPES];
+    LOCK(lock);
+    int result = account_import(user, account);
+    UNLOCK(lock);
+    return result;
+}
+
+// Read, check and commit under the account's lock, so concurrent sessions never lose an update;
+// when is the time recorded for the transaction
+int account_apply(uint32_t account, uint32_t type, int64_t amount, int64_t when, int64_t *balance, uint64_t *seq)
+{
+    account_t acc;
+    atm_lock_t *lock = &account_locks[account % LOCK_STRIPES];
+    if (amount <= 0) return -1;
+    LOCK(lock);
+    int result = account_read(account, &acc);
+    if (result == 0 && type == TX_WITHDRAW && amount > acc.balance) result = ATM_FUNDS;
+    if (result == 0 && type == TX_DEPOSIT && acc.balance > INT64_MAX - amount) result = -1;
+    if (result == 0) result = tx_commit(account, &acc, type, amount, when);
+    if (result == 0) {
+        *balance = acc.balance;
+        *seq = acc.last_tx;
+    }
+    UNLOCK(lock);
+    return result;
+}
+
+int account_balance(uint32_t account, int64_t *balance)
+{
+    account_t acc;
+    atm_lock_t *lock = &account_locks[account % LOCK_STRIPES];
+    LOCK(lock);
+    int result = account_read(account, &acc);
+    UNLOCK(lock);
+    if (result == 0) *balance = acc.balance;
+    return result;
+}
+
+/* Moves amount from one account to another as a single log append of two records,
+ * the debit and then the credit, each chained to its own account. Both locks are
+ * taken in ascending stripe order, like every multi-account lock, so transfers
+ * crossing in opposite directions cannot deadlock. ATM_FUNDS when from cannot
+ * cover it; balance is from's, and seq the record to pass to log_sync(). */
+int account_transfer(uint32_t from, uint32_t to, int64_t amount, int64_t *balance, uint64_t *seq)
+{
+    account_t src, dst;
+    size_t first = from % LOCK_STRIPES, second = to % LOCK_STRIPES;
+    if (amount <= 0 || from == to) return -1;
+    if (first > second) {
+        size_t swap = first;
+        first = second;
+        second = swap;
+    }
+    LOCK(&account_locks[first]);
+    if (second != first) LOCK(&account_locks[second]);
+    int result = (account_read(from, &src) == 0 && account_read(to, &dst) == 0) ? 0 : -1;
+    if (result == 0 && amount > src.balance) result = ATM_FUNDS;
+    if (result == 0 && dst.balance > INT64_MAX - amount) result = -1;
+    if (result == 0) {
+        tx_record_t tx[2];
+        memset(tx, 0, sizeof(tx));
+        tx[0].account = from;
+        tx[0].type = TX_TRANSFER_OUT;
+        tx[0].balance = src.balance - amount;
+        tx[0].prev = src.last_tx;
+        tx[1].account = to;
+        tx[1].type = TX_TRANSFER_IN;
+        tx[1].balance = dst.balance + amount;
+        tx[1].prev = dst.last_tx;
+        tx[0].amount = tx[1].amount = amount;
+        tx[0].time = tx[1].time = (int64_t)time(NULL);
+        LOCK(&log_lock);
+        tx[0].seq = tx_count + 1;
+        tx[1].seq = tx_count + 2;
+        result = log_append(tx, 2);
+        UNLOCK(&log_lock);
+        if (result == 0) {
+            account_replay(&src, &tx[0]);
+            account_replay(&dst, &tx[1]);
+            result = (account_write(from, &src) == 0 && account_write(to, &dst) == 0) ? 0 : -1;
+        }
+        if (result == 0) {
+            *balance = src.balance;
+            *seq = tx[1].seq;
+        }
+    }
+    if (second != first) UNLOCK(&account_locks[second]);
+    UNLOCK(&account_locks[first]);
+    return result;
+}
+
+// seq is the log record to pass to log_sync() before the deposit is reported done
+int account_deposit(uint32_t account, int64_t amount, int64_t *balance, uint64_t *seq)
+{
+    return account_apply(account, TX_DEPOSIT, amount, (int64_t)time(NULL), balance, seq);
+}
+
+// ATM_FUNDS when the balance does not cover the amount
+int account_withdraw(uint32_t account, int64_t amount, int64_t *balance, uint64_t *seq)
+{
+    return account_apply(account, TX_WITHDRAW, amount, (int64_t)time(NULL), balance, seq);
+}
+
+/*Time index*/
+// Drops the index and builds it again from the first log record
+static int time_index_reset()
+{
+    if (file_truncate(time_fd, sizeof(ledger_header_t)) != 0 || file_truncate(totals_fd, sizeof(ledger_header_t)) != 0) return -1;
+    free(time_states);
+    time_states = NULL;
+    time_state_cap = 0;
+    time_count = time_indexed = 0;
+    totals_count = 0;
+    time_fresh = 1;
+    return 0;
+}
+
+// Entry number of TIME_INDEX into block; 0 if it is not one of the account's
+static int time_block_read(uint64_t entry, uint32_t account, time_block_t *block)
+{
+    if (entry == 0 || read_at(time_fd, block, sizeof(*block), sizeof(ledger_header_t) + (entry - 1) * sizeof(*block)) != 0 ||
+        block->account != account || block->count == 0 || block->count > block->operations) return -1;
+    return 0;
+}
+
+/* Indexing state of an account, picked up from its latest block: the records after
+ * that block, found through the chain, form the block being filled. */
+static time_state_t *time_state(uint32_t account, const tx_record_t *tx)
+{
+    if (account > time_state_cap) {
+        size_t cap = time_state_cap ? time_state_cap : 1024;
+        while (cap < account) cap *= 2;
+        time_state_t *more = realloc(time_states, cap * sizeof(*more));
+        if (!more) return NULL;
+        memset(more + time_state_cap, 0, (cap - time_state_cap) * sizeof(*more));
+        time_states = more;
+        time_state_cap = cap;
+    }
+    time_state_t *state = &time_states[account - 1];
+    if (state->loaded) return state;
+    state->loaded = 1;
+    if (time_fresh) return state;
+
+    account_t acc;
+    time_block_t block;
+    tx_record_t older;
+    uint64_t stop = 0;
+    if (account_read(account, &acc) != 0) return NULL;
+    state->day = acc.day_total;
+    state->month = acc.month_total;
+    if (time_block_read(acc.time_block, account, &block) == 0 && block.last < tx->seq) {
+        state->block = acc.time_block;
+        state->operations = block.operations;
+        stop = block.last;
+    }
+    for (uint64_t seq = tx->prev; seq > stop; seq = older.prev) {
+        if (state->count == TIME_BLOCK || tx_read(seq, &older) != 0 || older.account != account) return NULL;
+        if (state->count == 0 || older.time < state->first_time) state->first_time = older.time;
+        if (state->count == 0 || older.time > state->last_time) state->last_time = older.time;
+        state->count++;
+        if (older.prev < stop) return NULL;
+    }
+    return state;
+}
+
+static int totals_read(uint32_t entry, uint32_t account, total_t *total)
+{
+    if (entry == 0 || entry > totals_count ||
+        read_at(totals_fd, total, sizeof(*total), sizeof(ledger_header_t) + (uint64_t)(entry - 1) * sizeof(*total)) != 0 ||
+        total->account != account) return -1;
+    return 0;
+}
+
+static uint32_t totals_period(int64_t when, int monthly)
+{
+    struct tm t;
+    local_time(when, &t);
+    uint32_t month = (uint32_t)(t.tm_year + 1900) * 100 + (uint32_t)(t.tm_mon + 1);
+    return monthly ? month : month * 100 + (uint32_t)t.tm_mday;
+}
+
+static void totals_fold(total_t *total, const tx_record_t *tx)
+{
+    if (tx_delta(tx) < 0) {
+        total->withdrawals++;
+        total->withdrawn += tx->amount;
+    } else {
+        total->deposits++;
+        total->deposited += tx->amount;
+    }
+    if (tx->balance < total->min_balance) total->min_balance = tx->balance;
+    if (tx->balance > total->max_balance) total->max_balance = tx->balance;
+}
+
+/* Adds tx to its day's (or month's) total in the chain starting at *head. Periods
+ * normally arrive in order, so the total is the newest one; a transaction dated
+ * further back than TOTALS_SEARCH entries starts another, merged when read. */
+static int totals_add(uint32_t *head, const tx_record_t *tx, int monthly)
+{
+    total_t total;
+    uint32_t period = totals_period(tx->time, monthly), latest = period, entry = *head;
+    int found = 0;
+    for (int i = 0; entry && i < TOTALS_SEARCH && !found; i++) {
+        if (totals_read(entry, tx->account, &total) != 0) return 1;
+        if (i == 0 && total.latest > latest) latest = total.latest;
+        found = total.period == period;
+        if (!found) entry = total.prev;
+    }
+    if (!found) {
+        memset(&total, 0, sizeof(total));
+        total.account = tx->account;
+        total.period = period;
+        total.min_balance = total.max_balance = tx->balance;
+        total.prev = *head;
+        total.latest = latest;
+        entry = ++totals_count;
+        *head = entry;
+    }
+    totals_fold(&total, tx);
+    return write_at(totals_fd, &total, sizeof(total), sizeof(ledger_header_t) + (uint64_t)(entry - 1) * sizeof(total));
+}
+
+static int time_index_add(const tx_record_t *tx)
+{
+    time_state_t *state = time_state(tx->account, tx);
+    if (!state) return 1; // The index does not match the log
+    uint32_t day = state->day, month = state->month;
+    int result = totals_add(&state->day, tx, 0);
+    if (result == 0) result = totals_add(&state->month, tx, 1);
+    if (result != 0) return result;
+    int moved = state->day != day || state->month != month;
+
+    if (state->count == 0 || tx->time < state->first_time) state->first_time = tx->time;
+    if (state->count == 0 || tx->time > state->last_time) state->last_time = tx->time;
+    if (++state->count == TIME_BLOCK) {
+        time_block_t block = {tx->account, TIME_BLOCK, tx->seq, state->operations + TIME_BLOCK, state->first_time,
+                              state->last_time, state->block};
+        if (write_at(time_fd, &block, sizeof(block), sizeof(ledger_header_t) + time_count * sizeof(block)) != 0) return -1;
+        time_count++;
+        state->block = time_count;
+        state->operations = block.operations;
+        state->count = 0;
+        moved = 1;
+    }
+    if (!moved) return 0;
+
+    // The account points at its newest entries; its lock keeps the update from racing a commit
+    account_t acc;
+    atm_lock_t *lock = &account_locks[tx->account % LOCK_STRIPES];
+    LOCK(lock);
+    result = account_read(tx->account, &acc);
+    if (result == 0) {
+        acc.time_block = state->block;
+        acc.day_total = state->day;
+        acc.month_total = state->month;
+        result = account_write(tx->account, &acc);
+    }
+    UNLOCK(lock);
+    return result;
+}
+
+// Indexes up to limit log records past the ones already indexed
+int time_index_update(uint64_t limit)
+{
+    enum { CHUNK = 4096 };
+    if (time_fd < 0 || totals_fd < 0) return 0;
+    LOCK(&log_lock);
+    uint64_t last = tx_count;
+    UNLOCK(&log_lock);
+    if (last > time_indexed + limit) last = time_indexed + limit;
+    if (last <= time_indexed) return 0;
+    tx_record_t *chunk = malloc(CHUNK * sizeof(tx_record_t));
+    if (!chunk) return -1;
+    int result = 0;
+    while (result == 0 && time_indexed < last) {
+        uint64_t n = last - time_indexed < CHUNK ? last - time_indexed : CHUNK;
+        if (log_read(time_indexed + 1, chunk, n) != 0) result = -1;
+        for (uint64_t i = 0; result == 0 && i < n; i++) {
+            LOCK(&time_lock);
+            result = time_index_add(&chunk[i]);
+            if (result == 0) time_indexed++;
+            UNLOCK(&time_lock);
+        }
+    }
+    free(chunk);
+    if (result > 0) {
+        printf("The time index does not match the transaction log; rebuilding it.\n");
+        LOCK(&time_lock);
+        result = time_index_reset();
+        UNLOCK(&time_lock);
+    }
+    return result;
+}
+
+// Both files record the log records they cover and whether a process has them open
+static int time_index_mark(int fd, uint64_t checkpoint, uint64_t in_use)
+{
+    ledger_header_t header;
+    if (read_at(fd, &header, sizeof(header), 0) != 0) return -1;
+    header.checkpoint = checkpoint;
+    header.in_use = in_use;
+    if (write_at(fd, &header, sizeof(header), 0) != 0) return -1;
+    return file_sync(fd);
+}
+
+/* Opens TIME_INDEX and TOTALS_DB. They are derived from the log, so after a crash,
+ * or when the accounts had to be recovered, they are dropped and rebuilt a step at a
+ * time by ledger_maintain(); queries stay correct meanwhile, only slower. */
+int time_index_open(int rebuild)
+{
+    ledger_header_t header, totals;
+    uint64_t records;
+    time_fd = ledger_file(TIME_INDEX, TIME_MAGIC, sizeof(time_block_t), 0, &time_count, &header);
+    if (time_fd < 0) return -1;
+    totals_fd = ledger_file(TOTALS_DB, TOTALS_MAGIC, sizeof(total_t), 0, &records, &totals);
+    if (totals_fd < 0 || records > UINT32_MAX) return -1;
+    totals_count = (uint32_t)records;
+    time_indexed = header.checkpoint;
+    time_fresh = time_indexed == 0;
+    if ((rebuild || header.in_use || totals.in_use || totals.checkpoint != time_indexed || time_indexed > tx_count) &&
+        time_index_reset() != 0) return -1;
+    if (time_index_mark(time_fd, time_indexed, 1) != 0 || time_index_mark(totals_fd, time_indexed, 1) != 0) return -1;
+    return 0;
+}
+
+void time_index_close(int clean)
+{
+    if (time_fd < 0) return;
+    if (clean && totals_fd >= 0 && file_sync(time_fd) == 0 && file_sync(totals_fd) == 0) {
+        time_index_mark(time_fd, time_indexed, 0);
+        time_index_mark(totals_fd, time_indexed, 0);
+    }
+    close(time_fd);
+    if (totals_fd >= 0) close(totals_fd);
+    time_fd = totals_fd = -1;
+    free(time_states);
+    time_states = NULL;
+    time_state_cap = 0;
+}
+
+/* Collects up to limit transactions of the account with ordinal (1 for its first)
+ * below before - 0 for no bound - and time within from .. to, newest first. The
+ * chain of records is walked from the newest; whole blocks of the time index out of
+ * range are stepped over, and any entry that does not fit the chain is ignored. On
+ * return *next is the ordinal to pass as before for the page after, 0 if none. */
+int history_query(uint32_t account, uint64_t before, int64_t from, int64_t to, tx_record_t *out, size_t limit,
+                  size_t *found, uint64_t *next)
+{
+    account_t acc;
+    time_block_t block;
+    tx_record_t tx;
+    *found = 0;
+    *next = 0;
+    if (account_read(account, &acc) != 0) return -1;
+    if (before == 0 || before > acc.operations) before = acc.operations + 1;
+
+    uint64_t seq = acc.last_tx, ord = acc.operations;
+    uint64_t entry = (time_fd >= 0 && time_block_read(acc.time_block, account, &block) == 0 &&
+                      block.last <= seq && block.operations <= ord) ? acc.time_block : 0;
+    while (seq && *found < limit) {
+        // Below the current block: its predecessor must end right here
+        if (entry && ord <= block.operations - block.count) {
+            uint64_t prev = block.prev;
+            entry = (time_block_read(prev, account, &block) == 0 && block.last == seq && block.operations == ord) ? prev : 0;
+        }
+        if (entry && ord == block.operations && seq != block.last) entry = 0;
+        if (entry && ord == block.operations &&
+            (block.operations - block.count + 1 >= before || block.last_time < from || block.first_time > to)) {
+            uint64_t bottom = block.operations - block.count;
+            if (bottom == 0) {
+                seq = 0;
+                break;
+            }
+            uint64_t prev = block.prev;
+            if (time_block_read(prev, account, &block) == 0 && block.operations == bottom) {
+                entry = prev;
+                seq = block.last;
+                ord = bottom;
+                continue;
+            }
+            entry = 0; // Walked record by record instead
+        }
+
+        if (tx_read(seq, &tx) != 0 || tx.account != account) return -1;
+        if (ord < before && tx.time >= from && tx.time <= to) out[(*found)++] = tx;
+        seq = tx.prev;
+        ord--;
+    }
+    if (seq && *found == limit) *next = ord + 1;
+    return 0;
+}
+
+static int totals_merge(total_t **periods, size_t *count, size_t *cap, const total_t *total)
+{
+    for (size_t i = *count; i-- > 0; ) {
+        total_t *same = &(*periods)[i];
+        if (same->period != total->period) continue;
+        same->deposits += total->deposits;
+        same->withdrawals += total->withdrawals;
+        same->deposited += total->deposited;
+        same->withdrawn += total->withdrawn;
+        if (total->min_balance < same->min_balance) same->min_balance = total->min_balance;
+        if (total->max_balance > same->max_balance) same->max_balance = total->max_balance;
+        return 0;
+    }
+    if (*count == *cap) {
+        size_t more_cap = *cap ? *cap * 2 : 64;
+        total_t *more = realloc(*periods, more_cap * sizeof(*more));
+        if (!more) return -1;
+        *periods = more;
+        *cap = more_cap;
+    }
+    (*periods)[(*count)++] = *total;
+    return 0;
+}
+
+static int totals_compare(const void *a, const void *b)
+{
+    uint32_t x = ((const total_t*)a)->period, y = ((const total_t*)b)->period;
+    return (x < y) - (x > y); // Newest first
+}
+
+/* Totals of the account by day (or month) for periods from .. to, as YYYYMMDD or
+ * YYYYMM, newest first and at most limit of them. The work is the number of stored
+ * periods back to from, plus the transactions the indexer has not reached yet,
+ * which are added from the log so the statement is exact. */
+int statement_query(uint32_t account, int monthly, uint32_t from, uint32_t to, total_t *out, size_t limit, size_t *found)
+{
+    account_t acc;
+    total_t total;
+    total_t *periods = NULL;
+    size_t count = 0, cap = 0;
+    int result = 0;
+    *found = 0;
+
+    LOCK(&time_lock);
+    uint64_t indexed = (totals_fd >= 0) ? time_indexed : 0;
+    if (account_read(account, &acc) != 0) result = -1;
+    for (uint32_t entry = monthly ? acc.month_total : acc.day_total; result == 0 && indexed && entry; entry = total.prev) {
+        if (totals_read(entry, account, &total) != 0) {
+            // Not the account's: read everything from the log instead
+            count = 0;
+            indexed = 0;
+            break;
+        }
+        if (total.latest < from) break;
+        if (total.period >= from && total.period <= to) result = totals_merge(&periods, &count, &cap, &total);
+    }
+    UNLOCK(&time_lock);
+
+    tx_record_t tx;
+    for (uint64_t seq = acc.last_tx; result == 0 && seq > indexed; seq = tx.prev) {
+        if (tx_read(seq, &tx) != 0 || tx.account != account) {
+            result = -1;
+            break;
+        }
+        memset(&total, 0, sizeof(total));
+        total.period = totals_period(tx.time, monthly);
+        if (total.period < from || total.period > to) continue;
+        total.min_balance = total.max_balance = tx.balance;
+        totals_fold(&total, &tx);
+        result = totals_merge(&periods, &count, &cap, &total);
+    }
+
+    if (result == 0) {
+        if (count) qsort(periods, count, sizeof(*periods), totals_compare);
+        *found = count < limit ? count : limit;
+        if (*found) memcpy(out, periods, *found * sizeof(*out));
+    }
+    free(periods);
+    return result;
+}
+
+/*Requests*/
+void local_time(int64_t when, struct tm *out)
+{
+    time_t t = (time_t)when;
+#ifdef _WIN32
+    localtime_s(out, &t);
+#else
+    localtime_r(&t, out); // Server threads format history at the same time
+#endif
+}
+
+int locks_init()
+{
+#ifndef __STDC_NO_THREADS__
+    if (mtx_init(&index_lock, mtx_plain) != thrd_success || mtx_init(&log_lock, mtx_plain) != thrd_success ||
+        mtx_init(&sync_lock, mtx_plain) != thrd_success || mtx_init(&segment_lock, mtx_plain) != thrd_success ||
+        mtx_init(&time_lock, mtx_plain) != thrd_success || mtx_init(&batch_rejects_lock, mtx_plain) != thrd_success) return -1;
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        if (mtx_init(&account_locks[i], mtx_plain) != thrd_success) return -1;
+    }
+#endif
+    return 0;
+}
+
+static void reply_reserve(reply_t *reply, size_t extra)
+{
+    if (reply->len + extra + 1 <= reply->cap) return;
+    size_t cap = reply->cap ? reply->cap : 256;
+    while (cap < reply->len + extra + 1) cap *= 2;
+    char *data = realloc(reply->data, cap);
+    if (!data) {
+        printf("Error: Not enough memory\n");
+        exit(1);
+    }
+    reply->data = data;
+    reply->cap = cap;
+}
+
+void reply_add(reply_t *reply, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    int need = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (need < 0) return;
+    reply_reserve(reply, (size_t)need);
+    va_start(args, format);
+    vsnprintf(reply->data + reply->len, reply->cap - reply->len, format, args);
+    va_end(args);
+    reply->len += (size_t)need;
+}
+
+static void history_line(reply_t *reply, const tx_record_t *tx)
+{
+    struct tm t;
+    local_time(tx->time, &t);
+    char text[32], kind[48];
+    format_amount(tx->amount, text, sizeof(text));
+    if (tx->type == TX_TRANSFER_OUT || tx->type == TX_TRANSFER_IN) {
+        // The other side of a transfer is the record next to it
+        tx_record_t peer;
+        int sent = tx->type == TX_TRANSFER_OUT;
+        if (tx_read(sent ? tx->seq + 1 : tx->seq - 1, &peer) != 0) peer.account = 0;
+        snprintf(kind, sizeof(kind), "Transfer %s account %u", sent ? "to" : "from", peer.account);
+    } else {
+        snprintf(kind, sizeof(kind), "%s", tx->type == TX_DEPOSIT ? "Deposit" : tx->type == TX_WITHDRAW ? "Withdrawal" : "Opening balance");
+    }
+    reply_add(reply, "%04d-%02d-%02d %02d:%02d:%02d %s: %c%s\n", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+              t.tm_hour, t.tm_min, t.tm_sec, kind, tx_delta(tx) < 0 ? '-' : '+', text);
+}
+
+// The whole history, oldest first
+static void session_history(session_t *session, reply_t *reply)
+{
+    account_t acc;
+    if (account_read(session->account, &acc) != 0) {
+        reply_add(reply, "ERR Cannot read the account\n");
+        return;
+    }
+
+    // The account's records are chained backwards through the shared log
+    uint64_t *chain = malloc((acc.operations ? acc.operations : 1) * sizeof(uint64_t));
+    if (!chain) {
+        reply_add(reply, "ERR Not enough memory\n");
+        return;
+    }
+    uint64_t count = 0;
+    tx_record_t tx;
+    for (uint64_t seq = acc.last_tx; seq && count < acc.operations; seq = tx.prev) {
+        if (tx_read(seq, &tx) != 0) break;
+        chain[count++] = seq;
+    }
+
+    reply_add(reply, "OK %llu\n", (unsigned long long)count);
+    while (count > 0) {
+        if (tx_read(chain[--count], &tx) != 0) break;
+        history_line(reply, &tx);
+    }
+    free(chain);
+}
+
+/* One page of history, newest first: "HISTORY<TAB>limit<TAB>before<TAB>from<TAB>to"
+ * with before an ordinal cursor and from .. to Unix seconds, 0 meaning no bound.
+ * Answers "OK <operations> <next cursor>", 0 for the cursor on the last page. */
+static void session_history_page(session_t *session, char **args, reply_t *reply)
+{
+    char *end[4];
+    unsigned long long limit = strtoull(args[1], &end[0], 10), before = strtoull(args[2], &end[1], 10);
+    long long from = strtoll(args[3], &end[2], 10), to = strtoll(args[4], &end[3], 10);
+    if (*end[0] || *end[1] || *end[2] || *end[3] || limit == 0) {
+        reply_add(reply, "ERR Bad request\n");
+        return;
+    }
+    if (limit > HISTORY_MAX) limit = HISTORY_MAX;
+    tx_record_t page[HISTORY_MAX];
+    size_t found;
+    uint64_t next;
+    if (history_query(session->account, before, from, to ? to : INT64_MAX, page, limit, &found, &next) != 0) {
+        reply_add(reply, "ERR Cannot read the history\n");
+        return;
+    }
+    reply_add(reply, "OK %zu %llu\n", found, (unsigned long long)next);
+    for (size_t i = 0; i < found; i++) history_line(reply, &page[i]);
+}
+
+/* Totals by period: "STATEMENT<TAB>day|month<TAB>from<TAB>to", periods given as
+ * YYYYMMDD or YYYYMM and 0 for no bound. Answers "OK <periods>", newest first. */
+static void session_statement(session_t *session, char **args, reply_t *reply)
+{
+    char *end[2];
+    int monthly = strcmp(args[1], "month") == 0;
+    unsigned long from = strtoul(args[2], &end[0], 10), to = strtoul(args[3], &end[1], 10);
+    if ((!monthly && strcmp(args[1], "day") != 0) || *end[0] || *end[1]) {
+        reply_add(reply, "ERR Bad request\n");
+        return;
+    }
+    total_t *periods = malloc(STATEMENT_MAX * sizeof(*periods));
+    size_t found;
+    if (!periods || statement_query(session->account, monthly, (uint32_t)from, to ? (uint32_t)to : UINT32_MAX,
+                                    periods, STATEMENT_MAX, &found) != 0) {
+        reply_add(reply, "ERR Cannot read the statement\n");
+        free(periods);
+        return;
+    }
+    reply_add(reply, "OK %zu\n", found);
+    for (size_t i = 0; i < found; i++) {
+        const total_t *total = &periods[i];
+        char deposited[32], withdrawn[32], low[32], high[32], period[16];
+        format_amount(total->deposited, deposited, sizeof(deposited));
+        format_amount(total->withdrawn, withdrawn, sizeof(withdrawn));
+        format_amount(total->min_balance, low, sizeof(low));
+        format_amount(total->max_balance, high, sizeof(high));
+        if (monthly) snprintf(period, sizeof(period), "%04u-%02u", total->period / 100, total->period % 100);
+        else snprintf(period, sizeof(period), "%04u-%02u-%02u", total->period / 10000, total->period / 100 % 100, total->period % 100);
+        reply_add(reply, "%-10s %6u  %14s %6u  %14s  %14s %14s\n", period, total->deposits, deposited,
+                  total->withdrawals, withdrawn, low, high);
+    }
+    free(periods);
+}
+
+/* Runs one request line, "COMMAND<TAB>arg...", and appends its reply: a status line
+ * "OK [value]" or "ERR message", any data lines, then a line holding a single ".".
+ * A reply to a transaction must not be sent before log_sync(session->commit_seq). */
+void session_execute(session_t *session, char *line, reply_t *reply)
+{
+    char *args[5];
+    int count = 0;
+    line[strcspn(line, "\r\n")] = '\0';
+    for (char *field = line; count < 5; count++) {
+        args[count] = field;
+        field = strchr(field, '\t');
+        if (!field) {
+            count++;
+            break;
+        }
+        *field++ = '\0';
+    }
+
+    const char *command = args[0];
+    int64_t amount, balance;
+    char text[32];
+    if ((strcmp(command, "REGISTER") == 0 || strcmp(command, "LOGIN") == 0) && count == 3) {
+        size_t name_len = strlen(args[1]);
+        if (name_len == 0 || name_len > MAX_NAME - 1 || strchr(args[1], ':') || strlen(args[2]) != 4) {
+            reply_add(reply, "ERR Invalid username or password\n");
+        } else if (command[0] == 'R') {
+            int result = user_register(args[1], args[2]);
+            if (result == 0) reply_add(reply, "OK\n");
+            else reply_add(reply, result == ATM_EXISTS ? "ERR User already exists!\n" : "ERR Cannot update user index\n");
+        } else {
+            uint32_t account;
+            int result = user_login(args[1], args[2], &account);
+            if (result == 0) {
+                session->account = account;
+                strcpy(session->user, args[1]);
+                reply_add(reply, "OK\n");
+            } else {
+                reply_add(reply, result == ATM_DENIED ? "ERR Invalid username or password.\n" : "ERR Cannot open the account.\n");
+            }
+        }
+    } else if (strcmp(command, "QUIT") == 0 && count == 1) {
+        session->closing = 1;
+        reply_add(reply, "OK\n");
+    } else if (session->account == 0) {
+        reply_add(reply, "ERR Not logged in\n");
+    } else if (strcmp(command, "LOGOUT") == 0 && count == 1) {
+        session->account = 0;
+        session->user[0] = '\0';
+        reply_add(reply, "OK\n");
+    } else if (strcmp(command, "BALANCE") == 0 && count == 1) {
+        if (account_balance(session->account, &balance) == 0) {
+            format_amount(balance, text, sizeof(text));
+            reply_add(reply, "OK %s\n", text);
+        } else {
+            reply_add(reply, "ERR Cannot read the account\n");
+        }
+    } else if ((strcmp(command, "DEPOSIT") == 0 || strcmp(command, "WITHDRAW") == 0) && count == 2) {
+        if (parse_amount(args[1], &amount) != 0 || amount <= 0) {
+            reply_add(reply, "ERR Invalid amount\n");
+        } else {
+            int result = (command[0] == 'D') ? account_deposit(session->account, amount, &balance, &session->commit_seq)
+                                             : account_withdraw(session->account, amount, &balance, &session->commit_seq);
+            if (result == 0) {
+                format_amount(balance, text, sizeof(text));
+                reply_add(reply, "OK %s\n", text);
+            } else reply_add(reply, result == ATM_FUNDS ? "ERR Insufficient funds\n" : "ERR Cannot update the account\n");
+        }
+    } else if (strcmp(command, "TRANSFER") == 0 && count == 3) {
+        user_slot_t slot;
+        int found = user_index_find(args[1], &slot);
+        int result = (found < 0) ? -1 : (found == 0) ? ATM_NO_USER : 0;
+        if (parse_amount(args[2], &amount) != 0 || amount <= 0) {
+            reply_add(reply, "ERR Invalid amount\n");
+        } else if (result == 0 && slot.account == session->account) {
+            reply_add(reply, "ERR Cannot transfer to your own account\n");
+        } else {
+            // The recipient's old files join the ledger first, as at a login
+            if (result == 0) result = account_open(args[1], slot.account);
+            if (result == 0) result = account_transfer(session->account, slot.account, amount, &balance, &session->commit_seq);
+            if (result == 0) {
+                format_amount(balance, text, sizeof(text));
+                reply_add(reply, "OK %s\n", text);
+            } else {
+                reply_add(reply, result == ATM_FUNDS ? "ERR Insufficient funds\n" :
+                                 result == ATM_NO_USER ? "ERR No such user\n" : "ERR Cannot update the account\n");
+            }
+        }
+    } else if (strcmp(command, "HISTORY") == 0 && count == 1) {
+        session_history(session, reply);
+    } else if (strcmp(command, "HISTORY") == 0 && count == 5) {
+        session_history_page(session, args, reply);
+    } else if (strcmp(command, "STATEMENT") == 0 && count == 4) {
+        session_statement(session, args, reply);
+    } else {
+        reply_add(reply, "ERR Bad request\n");
+    }
+    reply_add(reply, ".\n");
+}
+
+static int reply_complete(const reply_t *reply)
+{
+    return reply->len >= 2 && memcmp(reply->data + reply->len - 2, ".\n", 2) == 0 &&
+           (reply->len == 2 || reply->data[reply->len - 3] == '\n');
+}
+
+/* Sends one request from the menus, to the server in client mode and to the local
+ * session otherwise. Leaves the status line in reply->data with the data lines after
+ * its terminator; returns 1 for OK, 0 for ERR and -1 if the server is gone. */
+int atm_request(reply_t *reply, const char *format, ...)
+{
+    char line[MAX_REQUEST];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line) - 1) return -1;
+    reply->len = 0;
+
+    if (remote_fd < 0) {
+        local_session.commit_seq = 0;
+        session_execute(&local_session, line, reply);
+        if (local_session.commit_seq && log_sync(local_session.commit_seq) != 0) {
+            reply->len = 0;
+            reply_add(reply, "ERR Cannot sync the transaction log\n.\n");
+        }
+        ledger_maintain();
+    } else {
+#ifndef _WIN32
+        line[len++] = '\n';
+        for (int sent = 0; sent < len; ) {
+            ssize_t n = send(remote_fd, line + sent, (size_t)(len - sent), 0);
+            if (n <= 0) return -1;
+            sent += (int)n;
+        }
+        // Requests go one at a time, so everything up to the "." line is this reply
+        do {
+            reply_reserve(reply, 512);
+            ssize_t n = recv(remote_fd, reply->data + reply->len, reply->cap - reply->len - 1, 0);
+            if (n <= 0) return -1;
+            reply->len += (size_t)n;
+        } while (!reply_complete(reply));
+#endif
+    }
+
+    reply->data[reply->len - 2] = '\0'; // Drop the "." line
+    reply->data[strcspn(reply->data, "\n")] = '\0';
+    return strncmp(reply->data, "OK", 2) == 0 ? 1 : 0;
+}
+
+/*Batch*/
+// Reject reasons, as counted in the report
+enum { REJECT_INVALID, REJECT_USER, REJECT_FUNDS, REJECT_FAILED, REJECT_KINDS };
+static const char *reject_names[REJECT_KINDS] = {"invalid record", "unknown user", "insufficient funds", "failed"};
+
+typedef struct {
+    uint32_t account;
+    uint32_t type;
+    int64_t amount;
+    int64_t time;
+    uint64_t line; // Line or record number in the file, for the rejects list
+} batch_item_t;
+
+// Transactions of the accounts one worker owns, in file order
+typedef struct {
+    batch_item_t *items; // Ring of BATCH_QUEUE
+    size_t head;
+    size_t count;
+    int closed;
+#ifndef __STDC_NO_THREADS__
+    mtx_t lock;
+    cnd_t ready;
+    cnd_t space;
+    thrd_t thread;
+#endif
+    uint64_t applied[3]; // By type
+    uint64_t rejected[REJECT_KINDS];
+    uint64_t last_seq;
+} batch_shard_t;
+
+// Users the reader has resolved, so repeats skip the index and the import check
+typedef struct {
+    char name[MAX_NAME];
+    uint32_t account;
+} batch_user_t;
+
+typedef struct {
+    batch_shard_t *shards;
+    int workers;
+    int threaded;
+    batch_user_t *users; // Open addressing, capacity a power of two
+    size_t user_count;
+    size_t user_capacity;
+    uint64_t rejected[REJECT_KINDS];
+} batch_reader_t;
+
+static FILE *batch_rejects = NULL; // Opened at the first reject
+static const char *batch_rejects_path = NULL;
+
+static void batch_reject(uint64_t *counts, int reason, uint64_t line, const char *detail)
+{
+    counts[reason]++;
+    LOCK(&batch_rejects_lock);
+    if (!batch_rejects) batch_rejects = fopen(batch_rejects_path, "w");
+    if (batch_rejects) fprintf(batch_rejects, "%llu,%s,%s\n", (unsigned long long)line, reject_names[reason], detail);
+    UNLOCK(&batch_rejects_lock);
+}
+
+// take_off_money() rules: a positive amount the balance covers
+static void batch_apply(batch_shard_t *shard, const batch_item_t *item)
+{
+    int64_t balance;
+    uint64_t seq;
+    int result = account_apply(item->account, item->type, item->amount, item->time, &balance, &seq);
+    if (result == 0) {
+        shard->applied[item->type]++;
+        shard->last_seq = seq;
+    } else {
+        batch_reject(shard->rejected, result == ATM_FUNDS ? REJECT_FUNDS : REJECT_FAILED, item->line, "");
+    }
+}
+
+#ifndef __STDC_NO_THREADS__
+static int batch_worker(void *arg)
+{
+    batch_shard_t *shard = arg;
+    mtx_lock(&shard->lock);
+    for (;;) {
+        while (shard->count == 0 && !shard->closed) cnd_wait(&shard->ready, &shard->lock);
+        if (shard->count == 0) break;
+        batch_item_t item = shard->items[shard->head];
+        shard->head = (shard->head + 1) % BATCH_QUEUE;
+        shard->count--;
+        cnd_signal(&shard->space);
+        mtx_unlock(&shard->lock);
+        batch_apply(shard, &item);
+        mtx_lock(&shard->lock);
+    }
+    mtx_unlock(&shard->lock);
+    return 0;
+}
+#endif
+
+static void batch_dispatch(batch_shard_t *shard, const batch_item_t *item, int threaded)
+{
+    if (!threaded) {
+        batch_apply(shard, item);
+        return;
+    }
+#ifndef __STDC_NO_THREADS__
+    mtx_lock(&shard->lock);
+    while (shard->count == BATCH_QUEUE) cnd_wait(&shard->space, &shard->lock);
+    shard->items[(shard->head + shard->count) % BATCH_QUEUE] = *item;
+    shard->count++;
+    cnd_signal(&shard->ready);
+    mtx_unlock(&shard->lock);
+#endif
+}
+
+static int batch_type(const char *text)
+{
+    char word[16];
+    size_t len = 0;
+    while (isspace((unsigned char)*text)) text++;
+    for (; *text && !isspace((unsigned char)*text) && len + 1 < sizeof(word); text++) word[len++] = (char)tolower((unsigned char)*text);
+    word[len] = '\0';
+    if (strcmp(word, "deposit") == 0 || strcmp(word, "d") == 0) return TX_DEPOSIT;
+    if (strcmp(word, "withdraw") == 0 || strcmp(word, "withdrawal") == 0 || strcmp(word, "w") == 0) return TX_WITHDRAW;
+    return -1;
+}
+
+static batch_user_t *batch_user_slot(batch_user_t *users, size_t capacity, const char *name)
+{
+    size_t pos = hash((const unsigned char*)name) & (capacity - 1);
+    while (users[pos].name[0] && strcmp(users[pos].name, name) != 0) pos = (pos + 1) & (capacity - 1);
+    return &users[pos];
+}
+
+// Account of user, or 0 if not registered; -1 on errors
+static int64_t batch_account(batch_reader_t *reader, const char *user)
+{
+    if (reader->user_count * 4 >= reader->user_capacity * 3) {
+        size_t capacity = reader->user_capacity ? reader->user_capacity * 2 : 1024;
+        batch_user_t *users = calloc(capacity, sizeof(*users));
+        if (!users) return -1;
+        for (size_t i = 0; i < reader->user_capacity; i++) {
+            if (reader->users[i].name[0]) *batch_user_slot(users, capacity, reader->users[i].name) = reader->users[i];
+        }
+        free(reader->users);
+        reader->users = users;
+        reader->user_capacity = capacity;
+    }
+    batch_user_t *cached = batch_user_slot(reader->users, reader->user_capacity, user);
+    if (cached->name[0]) return cached->account;
+
+    user_slot_t slot;
+    int found = user_index_find(user, &slot);
+    if (found != 1) return found;
+    // First sight of an account moves its old text files into the ledger, as a login does
+    if (account_open(user, slot.account) != 0) return -1;
+    snprintf(cached->name, sizeof(cached->name), "%s", user);
+    cached->account = slot.account;
+    reader->user_count++;
+    return slot.account;
+}
+
+// Queues the transaction on the worker owning the user's account
+static void batch_route(batch_reader_t *reader, const char *user, batch_item_t *item)
+{
+    int64_t account = batch_account(reader, user);
+    if (account <= 0) {
+        batch_reject(reader->rejected, account == 0 ? REJECT_USER : REJECT_FAILED, item->line, user);
+        return;
+    }
+    item->account = (uint32_t)account;
+    batch_dispatch(&reader->shards[item->account % (uint32_t)reader->workers], item, reader->threaded);
+}
+
+// CSV lines "user,type,amount,timestamp"; a first line naming the columns is skipped
+static int batch_read_csv(FILE *file, batch_reader_t *reader, uint64_t *records)
+{
+    char line[256];
+    uint64_t number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || (number == 1 && strncmp(line, "user,", 5) == 0)) continue;
+        (*records)++;
+
+        char *fields[4] = {line, NULL, NULL, NULL};
+        for (int i = 1; i < 4 && fields[i - 1]; i++) {
+            char *comma = strchr(fields[i - 1], ',');
+            if (comma) {
+                *comma = '\0';
+                fields[i] = comma + 1;
+            }
+        }
+        batch_item_t item;
+        memset(&item, 0, sizeof(item));
+        item.line = number;
+        int type = fields[1] ? batch_type(fields[1]) : -1;
+        size_t name_len = strlen(fields[0]);
+        if (type < 0 || !fields[2] || parse_amount(fields[2], &item.amount) != 0 || item.amount <= 0 ||
+            parse_time(fields[3] ? fields[3] : "", &item.time) != 0 || name_len == 0 || name_len > MAX_NAME - 1) {
+            batch_reject(reader->rejected, REJECT_INVALID, number, "");
+            continue;
+        }
+        item.type = (uint32_t)type;
+        batch_route(reader, fields[0], &item);
+        if (*records % 65536 == 0) ledger_maintain();
+    }
+    return ferror(file) ? -1 : 0;
+}
+
+// Binary files: batch_header_t, then batch_record_t entries
+static int batch_read_binary(FILE *file, batch_reader_t *reader, uint64_t *records)
+{
+    batch_header_t header;
+    batch_record_t record;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.record_size != sizeof(record)) {
+        printf("Error: Unsupported batch file.\n");
+        return -1;
+    }
+    while (*records < header.count && fread(&record, sizeof(record), 1, file) == 1) {
+        (*records)++;
+        batch_item_t item;
+        memset(&item, 0, sizeof(item));
+        item.line = *records;
+        item.type = record.type;
+        item.amount = record.amount;
+        item.time = record.time ? record.time : (int64_t)time(NULL);
+        record.user[MAX_NAME - 1] = '\0';
+        if ((item.type != TX_DEPOSIT && item.type != TX_WITHDRAW) || item.amount <= 0 || record.user[0] == '\0') {
+            batch_reject(reader->rejected, REJECT_INVALID, item.line, "");
+            continue;
+        }
+        batch_route(reader, record.user, &item);
+        if (*records % 65536 == 0) ledger_maintain();
+    }
+    return (*records == header.count) ? 0 : -1;
+}
+
+/* Settles a file of transactions. The reader looks up each user and hands the
+ * transaction to the worker owning the account (account number mod workers), so
+ * every account is processed in file order by one thread while the others run in
+ * parallel. One log flush at the end covers the whole batch. */
+int atm_batch(const char *path, int workers, const char *rejects)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        printf("Error: Cannot open %s.\n", path);
+        return -1;
+    }
+    char default_rejects[FILENAME_MAX];
+    snprintf(default_rejects, sizeof(default_rejects), "%s.rejects", path);
+    batch_rejects_path = rejects ? rejects : default_rejects;
+    remove(batch_rejects_path);
+
+    int threaded = 0;
+#ifndef __STDC_NO_THREADS__
+    threaded = 1;
+#endif
+    if (workers < 1 || !threaded) workers = 1;
+    batch_shard_t *shards = calloc((size_t)workers, sizeof(*shards));
+    if (!shards) {
+        fclose(file);
+        return -1;
+    }
+#ifndef __STDC_NO_THREADS__
+    for (int i = 0; threaded && i < workers; i++) {
+        shards[i].items = malloc(BATCH_QUEUE * sizeof(batch_item_t));
+        if (!shards[i].items || mtx_init(&shards[i].lock, mtx_plain) != thrd_success || cnd_init(&shards[i].ready) != thrd_success ||
+            cnd_init(&shards[i].space) != thrd_success || thrd_create(&shards[i].thread, batch_worker, &shards[i]) != thrd_success) {
+            free(shards[i].items);
+            shards[i].items = NULL;
+            workers = i;
+            break;
+        }
+    }
+    if (workers == 0) {
+        threaded = 0;
+        workers = 1;
+    }
+#endif
+
+    struct timespec start, end;
+    timespec_get(&start, TIME_UTC);
+    uint64_t records = 0;
+    batch_reader_t reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.shards = shards;
+    reader.workers = workers;
+    reader.threaded = threaded;
+    uint32_t magic = 0;
+    int binary = fread(&magic, sizeof(magic), 1, file) == 1 && magic == BATCH_MAGIC;
+    rewind(file);
+    int result = binary ? batch_read_binary(file, &reader, &records) : batch_read_csv(file, &reader, &records);
+    fclose(file);
+    free(reader.users);
+
+#ifndef __STDC_NO_THREADS__
+    for (int i = 0; threaded && i < workers; i++) {
+        mtx_lock(&shards[i].lock);
+        shards[i].closed = 1;
+        cnd_signal(&shards[i].ready);
+        mtx_unlock(&shards[i].lock);
+        thrd_join(shards[i].thread, NULL);
+        free(shards[i].items);
+    }
+#endif
+
+    // The batch counts as settled once the log is on disk
+    uint64_t applied[3] = {0}, rejected[REJECT_KINDS], last = 0, total_rejected = 0;
+    memcpy(rejected, reader.rejected, sizeof(rejected));
+    for (int i = 0; i < workers; i++) {
+        applied[TX_DEPOSIT] += shards[i].applied[TX_DEPOSIT];
+        applied[TX_WITHDRAW] += shards[i].applied[TX_WITHDRAW];
+        for (int k = 0; k < REJECT_KINDS; k++) rejected[k] += shards[i].rejected[k];
+        if (shards[i].last_seq > last) last = shards[i].last_seq;
+    }
+    free(shards);
+    if (log_sync(last) != 0) result = -1;
+    ledger_maintain();
+    if (batch_rejects) fclose(batch_rejects);
+    batch_rejects = NULL;
+    timespec_get(&end, TIME_UTC);
+
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    for (int k = 0; k < REJECT_KINDS; k++) total_rejected += rejected[k];
+    printf("Batch %s: %llu records in %.2f s (%.0f records/s, %d workers)\n", path, (unsigned long long)records,
+           seconds, seconds > 0 ? (double)records / seconds : 0.0, workers);
+    printf("  Applied: %llu deposits, %llu withdrawals\n", (unsigned long long)applied[TX_DEPOSIT],
+           (unsigned long long)applied[TX_WITHDRAW]);
+    printf("  Rejected: %llu", (unsigned long long)total_rejected);
+    for (int k = 0; k < REJECT_KINDS; k++) {
+        if (rejected[k]) printf(", %s %llu", reject_names[k], (unsigned long long)rejected[k]);
+    }
+    printf(total_rejected ? " (listed in %s)\n" : "\n", batch_rejects_path);
+    if (result != 0) printf("Error: The batch stopped early; the report covers the records read.\n");
+    return result;
+}
+
+/*Server*/
+#ifndef _WIN32
+static volatile sig_atomic_t server_stop = 0;
+static int wake_pipe[2] = {-1, -1}; // Workers and signals interrupt poll() through it
+static atm_lock_t queue_lock; // Worker queue and every session's busy flag
+#ifndef __STDC_NO_THREADS__
+static cnd_t queue_ready;
+static session_t *queue_head = NULL, *queue_tail = NULL;
+static cnd_t commit_ready;
+static session_t *commit_head = NULL; // Replies waiting for the next log fsync
+#endif
+
+static void server_signal(int sig)
+{
+    (void)sig;
+    server_stop = 1;
+    ssize_t ignored = write(wake_pipe[1], "s", 1);
+    (void)ignored;
+}
+
+// Blocks on a full socket buffer instead of dropping the rest of a reply
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = send(fd, data, len, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd out = {fd, POLLOUT, 0};
+            if (poll(&out, 1, 5000) <= 0) return -1;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        data += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int session_has_line(const session_t *session)
+{
+    return !session->closing && memchr(session->in, '\n', session->in_len) != NULL;
+}
+
+/* Executes the complete lines the session has received. With defer set, it stops
+ * at a reply whose transaction is not on disk yet and returns 1; the committer
+ * sends that reply after its fsync. Otherwise the fsync is done here. */
+static int session_serve(session_t *session, int defer)
+{
+    while (session_has_line(session)) {
+        char *newline = memchr(session->in, '\n', session->in_len);
+        size_t used = (size_t)(newline - session->in) + 1;
+        *newline = '\0';
+        session->out.len = 0;
+        session->commit_seq = 0;
+        session_execute(session, session->in, &session->out);
+        memmove(session->in, session->in + used, session->in_len - used);
+        session->in_len -= used;
+        if (session->commit_seq) {
+            LOCK(&log_lock);
+            int durable = session->commit_seq <= tx_durable;
+            UNLOCK(&log_lock);
+            if (!durable && defer) return 1;
+            if (!durable && log_sync(session->commit_seq) != 0) {
+                printf("Error: Cannot sync the transaction log.\n");
+                server_stop = 1;
+                session->closing = 1;
+                return 0;
+            }
+        }
+        if (send_all(session->fd, session->out.data, session->out.len) != 0) session->closing = 1;
+    }
+    return 0;
+}
+
+#ifndef __STDC_NO_THREADS__
+// Queues a session for the workers; the caller holds queue_lock
+static void session_dispatch(session_t *session)
+{
+    session->busy = 1;
+    session->next = NULL;
+    if (queue_tail) queue_tail->next = session;
+    else queue_head = session;
+    queue_tail = session;
+    cnd_signal(&queue_ready);
+}
+
+// Hands a session back to the event loop; the caller holds queue_lock
+static void session_release(session_t *session)
+{
+    session->busy = 0;
+    ssize_t ignored = write(wake_pipe[1], "w", 1);
+    (void)ignored;
+}
+
+static int server_worker(void *arg)
+{
+    (void)arg;
+    mtx_lock(&queue_lock);
+    while (!server_stop) {
+        session_t *session = queue_head;
+        if (!session) {
+            cnd_wait(&queue_ready, &queue_lock);
+            continue;
+        }
+        queue_head = session->next;
+        if (!queue_head) queue_tail = NULL;
+        mtx_unlock(&queue_lock);
+
+        int deferred = session_serve(session, 1);
+
+        mtx_lock(&queue_lock);
+        if (deferred) {
+            session->next = commit_head;
+            commit_head = session;
+            cnd_signal(&commit_ready);
+        } else {
+            session_release(session);
+        }
+    }
+    mtx_unlock(&queue_lock);
+    return 0;
+}
+
+/* Group commit: one fsync covers every reply deferred since the last one, after
+ * waiting up to commit_delay for more to join. The workers keep executing requests
+ * meanwhile, so a batch grows with the load instead of each commit paying an fsync. */
+static int server_committer(void *arg)
+{
+    (void)arg;
+    mtx_lock(&queue_lock);
+    while (!server_stop) {
+        if (!commit_head) {
+            cnd_wait(&commit_ready, &queue_lock);
+            continue;
+        }
+        if (commit_delay > 0) {
+            mtx_unlock(&queue_lock);
+            struct timespec pause = {commit_delay / 1000000, (commit_delay % 1000000) * 1000};
+            thrd_sleep(&pause, NULL);
+            mtx_lock(&queue_lock);
+        }
+        session_t *batch = commit_head;
+        commit_head = NULL;
+        mtx_unlock(&queue_lock);
+
+        uint64_t target = 0;
+        for (session_t *session = batch; session; session = session->next) {
+            if (session->commit_seq > target) target = session->commit_seq;
+        }
+        if (log_sync(target) != 0) {
+            // The outcome of these transactions is unknown; stop rather than answer
+            printf("Error: Cannot sync the transaction log.\n");
+            server_stop = 1;
+            ssize_t ignored = write(wake_pipe[1], "s", 1);
+            (void)ignored;
+            mtx_lock(&queue_lock);
+            for (session_t *session = batch; session; session = session->next) session->closing = 1;
+            break;
+        }
+        for (session_t *session = batch; session; session = session->next) {
+            if (send_all(session->fd, session->out.data, session->out.len) != 0) session->closing = 1;
+        }
+
+        mtx_lock(&queue_lock);
+        while (batch) {
+            session_t *session = batch;
+            batch = session->next;
+            if (session_has_line(session)) session_dispatch(session);
+            else session_release(session);
+        }
+    }
+    mtx_unlock(&queue_lock);
+    return 0;
+}
+
+// Snapshots and archiving run beside the workers, so a full segment never stalls a request
+static int server_maintainer(void *arg)
+{
+    (void)arg;
+    struct timespec pause = {0, 100000000};
+    while (!server_stop) {
+        ledger_maintain();
+        thrd_sleep(&pause, NULL);
+    }
+    return 0;
+}
+#endif
+
+static int server_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Error: Socket path too long.\n");
+        return -1;
+    }
+
+    // A socket nobody answers on is left over from a server that did not exit cleanly
+    int running = atm_connect(path);
+    if (running >= 0) {
+        close(running);
+        printf("Error: An ATM server is already running on %s.\n", path);
+        return -1;
+    }
+    unlink(path);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 512) != 0) {
+        printf("Error: Cannot listen on %s.\n", path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+#endif
+
+/* Serves ATM sessions on a Unix socket until SIGINT or SIGTERM. One poll() loop
+ * accepts and reads; complete request lines go to ATM_WORKERS threads, and a
+ * session stays with one worker until its pending lines are answered, so its
+ * requests run in order. */
+int atm_server(const char *path)
+{
+#ifdef _WIN32
+    (void)path;
+    printf("Error: Server mode needs Unix domain sockets.\n");
+    return -1;
+#else
+    int listen_fd = server_socket(path);
+    if (listen_fd < 0) return -1;
+    if (pipe(wake_pipe) != 0) {
+        close(listen_fd);
+        return -1;
+    }
+    fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, server_signal);
+    signal(SIGTERM, server_signal);
+
+    // Thousands of sessions need as many descriptors as the system allows
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    int workers = 0;
+#ifndef __STDC_NO_THREADS__
+    thrd_t threads[ATM_WORKERS], committer, maintainer;
+    if (mtx_init(&queue_lock, mtx_plain) != thrd_success || cnd_init(&queue_ready) != thrd_success ||
+        cnd_init(&commit_ready) != thrd_success || thrd_create(&committer, server_committer, NULL) != thrd_success ||
+        thrd_create(&maintainer, server_maintainer, NULL) != thrd_success) {
+        close(listen_fd);
+        return -1;
+    }
+    while (workers < ATM_WORKERS && thrd_create(&threads[workers], server_worker, NULL) == thrd_success) workers++;
+#endif
+    printf("ATM server listening on %s (%d workers)\n", path, workers);
+    fflush(stdout);
+
+    session_t **sessions = NULL;
+    struct pollfd *fds = malloc(2 * sizeof(*fds));
+    size_t count = 0, cap = 0;
+    while (fds && !server_stop) {
+        // Sessions a worker holds are not polled until it hands them back
+        size_t nfds = 2;
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = wake_pipe[0];
+        fds[1].events = POLLIN;
+        LOCK(&queue_lock);
+        for (size_t i = 0; i < count; i++) {
+            session_t *session = sessions[i];
+            if (session->busy) continue;
+            if (session->closing) {
+                close(session->fd);
+                free(session->out.data);
+                free(session);
+                sessions[i--] = sessions[--count];
+                continue;
+            }
+            fds[nfds].fd = session->fd;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        UNLOCK(&queue_lock);
+
+        if (workers == 0) ledger_maintain();
+        if (poll(fds, (nfds_t)nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN) {
+            char drain[64];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+        }
+
+        // Readable sessions: fds[2..] match the non-busy sessions in order
+        size_t slot = 2;
+        for (size_t i = 0; i < count && slot < nfds; i++) {
+            session_t *session = sessions[i];
+            if (session->fd != fds[slot].fd) continue;
+            short events = fds[slot++].revents;
+            if (!events) continue;
+            ssize_t n = recv(session->fd, session->in + session->in_len, sizeof(session->in) - session->in_len, 0);
+            if (n <= 0) {
+                if (n == 0 || (errno != EAGAIN && errno != EINTR)) session->closing = 1;
+                continue;
+            }
+            session->in_len += (size_t)n;
+            if (!memchr(session->in, '\n', session->in_len)) {
+                if (session->in_len == sizeof(session->in)) session->closing = 1; // Line too long
+                continue;
+            }
+            if (workers == 0) {
+                session_serve(session, 0);
+                continue;
+            }
+#ifndef __STDC_NO_THREADS__
+            mtx_lock(&queue_lock);
+            session_dispatch(session);
+            mtx_unlock(&queue_lock);
+#endif
+        }
+
+        // New connections; the pollfd array always has room for every session plus two
+        if (fds[0].revents & POLLIN) {
+            int fd;
+            while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                session_t *session = calloc(1, sizeof(*session));
+                if (count == cap) {
+                    size_t grown = cap ? cap * 2 : 64;
+                    session_t **more = realloc(sessions, grown * sizeof(*sessions));
+                    if (more) sessions = more;
+                    struct pollfd *more_fds = realloc(fds, (grown + 2) * sizeof(*fds));
+                    if (more_fds) fds = more_fds;
+                    if (more && more_fds) cap = grown;
+                }
+                if (!session || count == cap) {
+                    free(session);
+                    close(fd);
+                    continue;
+                }
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                session->fd = fd;
+                sessions[count++] = session;
+            }
+        }
+    }
+
+#ifndef __STDC_NO_THREADS__
+    mtx_lock(&queue_lock);
+    server_stop = 1;
+    cnd_broadcast(&queue_ready);
+    cnd_broadcast(&commit_ready);
+    mtx_unlock(&queue_lock);
+    for (int i = 0; i < workers; i++) thrd_join(threads[i], NULL);
+    thrd_join(committer, NULL);
+    thrd_join(maintainer, NULL);
+#endif
+    for (size_t i = 0; i < count; i++) {
+        close(sessions[i]->fd);
+        free(sessions[i]->out.data);
+        free(sessions[i]);
+    }
+    free(sessions);
+    free(fds);
+    close(listen_fd);
+    close(wake_pipe[0]);
+    close(wake_pipe[1]);
+    unlink(path);
+    printf("ATM server stopped.\n");
+    return 0;
+#endif
+}
+
+/*Client*/
+// Connected socket to the server at path, or -1
+int atm_connect(const char *path)
+{
+#ifdef _WIN32
+    (void)path;
+    return -1;
+#else
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+/*Bench*/
+#ifndef _WIN32
+enum { BENCH_REGISTER, BENCH_LOGIN, BENCH_BALANCE, BENCH_DEPOSIT, BENCH_WITHDRAW, BENCH_HISTORY, BENCH_TRANSFER,
+       BENCH_STATEMENT, BENCH_OPS };
+static const char *bench_names[BENCH_OPS] = {"register", "login", "balance", "deposit", "withdraw", "history",
+                                             "transfer", "statement"};
+static char bench_tag[32]; // Start of the names this run registers, so reruns do not collide
+
+typedef struct {
+    uint32_t *samples; // Latency of every answered request, in microseconds
+    size_t count;
+    size_t cap;
+    uint64_t errors; // Requests answered with ERR
+} bench_op_t;
+
+// One simulated ATM: a connection with at most one request in flight
+typedef struct {
+    int fd;
+    int busy; // Waiting for a reply
+    int op; // Operation of that reply; -1 while the client sets up its account
+    int setup; // Setup requests left: register, log in, deposit
+    uint64_t sent; // When the request went out, in nanoseconds
+    uint64_t registered; // Users registered by this client
+    uint32_t seed;
+    reply_t reply;
+} bench_client_t;
+
+static uint64_t bench_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+// xorshift32; every client draws from its own seed
+static uint32_t bench_random(uint32_t *seed)
+{
+    uint32_t x = *seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+// "op=weight,..." into weights; operations left out get no requests
+static int bench_parse_mix(const char *mix, unsigned weights[BENCH_OPS])
+{
+    char copy[256];
+    unsigned total = 0;
+    if (strlen(mix) >= sizeof(copy)) return -1;
+    strcpy(copy, mix);
+    memset(weights, 0, BENCH_OPS * sizeof(unsigned));
+    for (char *item = strtok(copy, ","); item; item = strtok(NULL, ",")) {
+        char *value = strchr(item, '='), *end;
+        if (!value) return -1;
+        *value++ = '\0';
+        int op = 0;
+        while (op < BENCH_OPS && strcmp(bench_names[op], item) != 0) op++;
+        long weight = strtol(value, &end, 10);
+        if (op == BENCH_OPS || end == value || *end || weight < 0 || weight > 1000000) return -1;
+        weights[op] = (unsigned)weight;
+        total += (unsigned)weight;
+    }
+    return total > 0 ? 0 : -1;
+}
+
+static int bench_send(bench_client_t *client, const char *format, ...)
+{
+    char line[MAX_REQUEST + 1];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line) - 1, format, args);
+    va_end(args);
+    if (len < 0 || len >= (int)sizeof(line) - 1) return -1;
+    line[len++] = '\n';
+    client->busy = 1;
+    client->sent = bench_now();
+    for (int sent = 0; sent < len; ) {
+        ssize_t n = send(client->fd, line + sent, (size_t)(len - sent), 0);
+        if (n <= 0) return -1;
+        sent += (int)n;
+    }
+    return 0;
+}
+
+// Next setup request of client i; the user may be left over from an earlier run
+static int bench_setup(bench_client_t *client, int i)
+{
+    if (client->setup == 3) return bench_send(client, "REGISTER\tbench%d\t0000", i);
+    if (client->setup == 2) return bench_send(client, "LOGIN\tbench%d\t0000", i);
+    return bench_send(client, "DEPOSIT\t1000.00");
+}
+
+// Sends client i a request picked by weight; amounts are small so balances last the run
+static int bench_issue(bench_client_t *clients, int count, int i, const unsigned weights[BENCH_OPS], unsigned total)
+{
+    bench_client_t *client = &clients[i];
+    unsigned pick = bench_random(&client->seed) % total;
+    unsigned cents = 1 + bench_random(&client->seed) % 99;
+    int op = 0;
+    while (pick >= weights[op]) pick -= weights[op++];
+    client->op = op;
+    switch (op) {
+        case BENCH_REGISTER:
+            return bench_send(client, "REGISTER\t%s-%d-%llu\t0000", bench_tag, i,
+                              (unsigned long long)++client->registered);
+        case BENCH_LOGIN:
+            return bench_send(client, "LOGIN\tbench%d\t0000", i);
+        case BENCH_BALANCE:
+            return bench_send(client, "BALANCE");
+        case BENCH_DEPOSIT:
+            return bench_send(client, "DEPOSIT\t0.%02u", cents);
+        case BENCH_WITHDRAW:
+            return bench_send(client, "WITHDRAW\t0.%02u", cents);
+        case BENCH_HISTORY:
+            return bench_send(client, "HISTORY\t%d\t0\t0\t0", HISTORY_PAGE);
+        case BENCH_TRANSFER: {
+            // To another client's user; a single client can only try itself and gets ERR
+            int to = count > 1 ? (i + 1 + (int)(bench_random(&client->seed) % (unsigned)(count - 1))) % count : i;
+            return bench_send(client, "TRANSFER\tbench%d\t0.%02u", to, cents);
+        }
+        default:
+            return bench_send(client, "STATEMENT\tmonth\t0\t0");
+    }
+}
+
+static void bench_record(bench_op_t *op, uint64_t nanoseconds, int ok)
+{
+    if (!ok) op->errors++;
+    if (op->count == op->cap) {
+        size_t cap = op->cap ? op->cap * 2 : 4096;
+        uint32_t *samples = realloc(op->samples, cap * sizeof(*samples));
+        if (!samples) return;
+        op->samples = samples;
+        op->cap = cap;
+    }
+    uint64_t us = nanoseconds / 1000;
+    op->samples[op->count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of sorted samples, in milliseconds
+static double bench_percentile(const bench_op_t *op, double p)
+{
+    size_t rank = (size_t)(p * (double)op->count + 0.999999);
+    if (rank < 1) rank = 1;
+    if (rank > op->count) rank = op->count;
+    return op->samples[rank - 1] / 1000.0;
+}
+
+static void bench_report(bench_op_t ops[BENCH_OPS], int clients, double seconds)
+{
+    uint64_t requests = 0, errors = 0;
+    printf("\n%-10s %10s %8s %10s %9s %9s %9s %9s\n", "Operation", "Count", "ERR", "Ops/s", "p50 ms", "p99 ms",
+           "p99.9 ms", "max ms");
+    for (int k = 0; k < BENCH_OPS; k++) {
+        bench_op_t *op = &ops[k];
+        if (op->count == 0) continue;
+        qsort(op->samples, op->count, sizeof(*op->samples), bench_compare);
+        printf("%-10s %10zu %8llu %10.0f %9.2f %9.2f %9.2f %9.2f\n", bench_names[k], op->count,
+               (unsigned long long)op->errors, (double)op->count / seconds, bench_percentile(op, 0.50),
+               bench_percentile(op, 0.99), bench_percentile(op, 0.999), op->samples[op->count - 1] / 1000.0);
+        requests += op->count;
+        errors += op->errors;
+    }
+    printf("%-10s %10llu %8llu %10.0f\n", "total", (unsigned long long)requests, (unsigned long long)errors,
+           (double)requests / seconds);
+    printf("%d clients, %.2f s\n", clients, seconds);
+}
+#endif
+
+/* Load generator for a running server: clients ATMs on their own connections, each
+ * sending its next request as soon as the last one is answered, until seconds
+ * pass or requests are sent (0 for no limit). Each client first registers, logs
+ * in and funds bench<i>; the timed part then follows the weights of mix and ends
+ * with a table of throughput and latency percentiles per operation. */
+int atm_bench(const char *path, int clients, int seconds, uint64_t requests, const char *mix)
+{
+#ifdef _WIN32
+    (void)path; (void)clients; (void)seconds; (void)requests; (void)mix;
+    printf("Error: Benchmark mode needs Unix domain sockets.\n");
+    return -1;
+#else
+    unsigned weights[BENCH_OPS], total = 0;
+    if (bench_parse_mix(mix, weights) != 0) {
+        printf("Error: Invalid mix \"%s\"; expected operation=weight,... with operations", mix);
+        for (int k = 0; k < BENCH_OPS; k++) printf(" %s", bench_names[k]);
+        printf(".\n");
+        return -1;
+    }
+    for (int k = 0; k < BENCH_OPS; k++) total += weights[k];
+    if (clients < 1) clients = 1;
+    if (seconds < 1 && requests == 0) seconds = BENCH_SECONDS;
+    snprintf(bench_tag, sizeof(bench_tag), "bench%lld-%d", (long long)time(NULL), (int)getpid());
+    signal(SIGPIPE, SIG_IGN);
+
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0 && files.rlim_cur < files.rlim_max) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
+    }
+
+    bench_client_t *list = calloc((size_t)clients, sizeof(*list));
+    struct pollfd *polls = calloc((size_t)clients, sizeof(*polls));
+    bench_op_t ops[BENCH_OPS];
+    memset(ops, 0, sizeof(ops));
+    int result = (list && polls) ? 0 : -1;
+    for (int i = 0; result == 0 && i < clients; i++) list[i].fd = -1;
+    for (int i = 0; result == 0 && i < clients; i++) {
+        list[i].fd = atm_connect(path);
+        if (list[i].fd < 0) {
+            printf("Error: Cannot connect to the ATM server at %s; start one with ./atm server.\n", path);
+            result = -1;
+            break;
+        }
+        list[i].op = -1;
+        list[i].setup = 3;
+        list[i].seed = 2463534242u ^ ((uint32_t)i * 2654435761u);
+        if (list[i].seed == 0) list[i].seed = 1;
+        if (bench_setup(&list[i], i) != 0) result = -1;
+    }
+
+    // Every client finishes setting up before the clock starts
+    int waiting = result == 0 ? clients : 0, measuring = 0;
+    uint64_t start = 0, stop = 0, deadline = 0, issued = 0;
+    while (result == 0 && waiting > 0) {
+        for (int i = 0; i < clients; i++) {
+            polls[i].fd = list[i].busy ? list[i].fd : -1;
+            polls[i].events = POLLIN;
+            polls[i].revents = 0;
+        }
+        if (poll(polls, (nfds_t)clients, 1000) < 0) {
+            if (errno == EINTR) continue;
+            result = -1;
+            break;
+        }
+        for (int i = 0; result == 0 && i < clients; i++) {
+            if (!polls[i].revents) continue;
+            bench_client_t *client = &list[i];
+            reply_reserve(&client->reply, 4096);
+            ssize_t n = recv(client->fd, client->reply.data + client->reply.len,
+                             client->reply.cap - client->reply.len - 1, 0);
+            if (n <= 0) {
+                printf("Error: The ATM server closed the connection.\n");
+                result = -1;
+                break;
+            }
+            client->reply.len += (size_t)n;
+            if (!reply_complete(&client->reply)) continue;
+
+            uint64_t now = bench_now();
+            int ok = client->reply.len >= 2 && memcmp(client->reply.data, "OK", 2) == 0;
+            client->reply.len = 0;
+            client->busy = 0;
+            if (client->op < 0) {
+                if (client->setup == 2 && !ok) {
+                    printf("Error: Cannot log in as bench%d.\n", i);
+                    result = -1;
+                } else if (--client->setup > 0) {
+                    if (bench_setup(client, i) != 0) result = -1;
+                } else {
+                    waiting--;
+                }
+                continue;
+            }
+            bench_record(&ops[client->op], now - client->sent, ok);
+            stop = now;
+            if ((requests == 0 || issued < requests) && (seconds < 1 || now < deadline)) {
+                issued++;
+                if (bench_issue(list, clients, i, weights, total) != 0) result = -1;
+            } else {
+                waiting--;
+            }
+        }
+        if (result == 0 && waiting == 0 && !measuring) {
+            measuring = 1;
+            start = stop = bench_now();
+            deadline = start + (uint64_t)seconds * 1000000000u;
+            printf("%d clients ready; running %s\n", clients, mix);
+            fflush(stdout);
+            for (int i = 0; result == 0 && i < clients && (requests == 0 || issued < requests); i++) {
+                issued++;
+                waiting++;
+                if (bench_issue(list, clients, i, weights, total) != 0) result = -1;
+            }
+        }
+    }
+    if (result != 0 && measuring) printf("Error: The benchmark stopped early; the report covers the replies so far.\n");
+    if (measuring && stop > start) bench_report(ops, clients, (double)(stop - start) / 1e9);
+
+    for (int i = 0; list && i < clients; i++) {
+        if (list[i].fd >= 0) close(list[i].fd);
+        free(list[i].reply.data);
+    }
+    for (int k = 0; k < BENCH_OPS; k++) free(ops[k].samples);
+    free(list);
+    free(polls);
+    return result;
+#endif
+}
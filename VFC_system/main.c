@@ -1,34 +1,103 @@
 /*VFS (VIRTUAL FILE SYSTEM)*/
 
 /*Include*/
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L // fseeko and ftello under -std=c11
+#endif
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64 // 64-bit off_t on 32-bit systems too
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
 #include <time.h>
+#include <errno.h>
 #include <sys/types.h>
 
+/* Prepross */
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+#ifndef __STDC_NO_THREADS__
+#include <threads.h> // Background checkpoints; without it they are written in the foreground
+#endif
+
 /* Define */
 #define BLOCK_SIZE 4096
-#define MAX_BLOCKS 1024
-#define MAX_FILES 128
+#define DEFAULT_BLOCKS 1024 // Capacity of a new file system; grows on demand
+#define DEFAULT_FILES 128
+#define BLOCK_LIMIT (1u << 26) // 256 GB of blocks
+#define FILE_LIMIT (1u << 20)
+#define LEGACY_BLOCKS 1024 // Fixed table sizes of raw-struct images
+#define LEGACY_FILES 128
+#define NO_BLOCK UINT32_MAX // Failed block allocation
 #define MAX_NAME_LEN 256
 #define INODE_BLOCKS 16
 #define MAX_PATH_LEN 1024
 #define SAVE_FILE "vfs_save.bin"
+#define IO_BUFFER_SIZE (INODE_BLOCKS * BLOCK_SIZE) // Large enough for a whole file
+#define MAX_SNAPSHOTS 8
+#define CLUSTER_BLOCKS 4 // Blocks compressed together
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+#define INODE_CLUSTERS (INODE_BLOCKS / CLUSTER_BLOCKS)
+#define CLUSTER_RAW 0x8000 // Cluster stored uncompressed
+#define CLUSTER_CACHE_SLOTS 4
+#define LZ_HASH_BITS 12
+#define INODE_COMPRESSED 0x1
+#define STAT_BUCKETS 40
+#define LS_BATCH 32 // Entries fetched per vfs_readdir call when listing
+#define DEFRAG_STEP_NS 2000000ULL // Background defragmentation budget per command
+#define CHECKPOINT_INTERVAL 30 // Seconds between checkpoints of a changed file system
+#define IMAGE_IO_BUFFER (1 << 20) // Image writes reach the file in batches of this size
+#define VFS_MAGIC 0x33534656 // "VFS3": little-endian image with a section table
+#define VFS_VERSION 2 // Version 1 stored reference counts as u16
+#define VFS_MAGIC_V1 0xC0FFEE02 // Raw structs: reference-counted superblock, inodes with cluster table
+#define VFS_MAGIC_V0 0xDEADBEEF // Raw structs: bitmap-only superblock
+#define IMAGE_HEADER_SIZE 16
+#define IMAGE_SECTION_SIZE 32
+#define IMAGE_INODE_SIZE 112
+#define IMAGE_SNAPSHOT_SIZE(files) (MAX_NAME_LEN + 8 + (uint64_t)(files) * IMAGE_INODE_SIZE)
+#define IMAGE_CHUNK 4096 // Table entries encoded per write
 
 /* Struct */
 typedef enum { FILE_TYPE, DIR_TYPE } inode_type;
 
-// Inode
+// Inode: the metadata scanned by lookups, allocation and tree walks
 typedef struct {
     uint32_t id;
     inode_type type;
+    uint32_t flags;
     size_t size;
+} inode_t;
+
+// Block map and timestamps of the inode at the same index of its table
+typedef struct {
     time_t ctime;
     time_t mtime;
     uint32_t blocks[INODE_BLOCKS]; // Index blocks data
-} inode_t;
+    uint16_t cluster_len[INODE_CLUSTERS]; // Stored bytes per cluster of a compressed file
+} inode_map_t;
+
+// Inode record as stored in raw-struct images
+typedef struct {
+    uint32_t id;
+    inode_type type;
+    size_t size;
+    time_t ctime;
+    time_t mtime;
+    uint32_t blocks[INODE_BLOCKS];
+    uint32_t flags;
+    uint16_t cluster_len[INODE_CLUSTERS];
+} inode_disk_t;
 
 // Entry in the directory
 typedef struct {
@@ -40,34 +109,307 @@ typedef struct {
 typedef struct {
     uint32_t magic;
     uint32_t block_size;
-    uint32_t free_blocks[MAX_BLOCKS / 32];
+    uint32_t block_count; // Multiple of 32
+    uint32_t inode_count; // Entries in every inode table, snapshots included
+    uint32_t* free_blocks; // One bit per block
+    uint32_t* block_refs; // Inodes (live and snapshot) sharing each block, up to 9 * FILE_LIMIT * INODE_BLOCKS
 } superblock_t;
 
+// Super-block as stored in raw-struct images
+typedef struct {
+    uint32_t magic;
+    uint32_t block_size;
+    uint32_t free_blocks[LEGACY_BLOCKS / 32];
+    uint16_t block_refs[LEGACY_BLOCKS];
+} superblock_disk_t;
+
+// Named point-in-time copy of the inode table; its blocks are shared copy-on-write
+typedef struct {
+    char name[MAX_NAME_LEN];
+    time_t ctime;
+    inode_t* inodes;
+    inode_map_t* maps;
+} vfs_snapshot_t;
+
+// Snapshot as stored in raw-struct images
+typedef struct {
+    char name[MAX_NAME_LEN];
+    time_t ctime;
+    inode_disk_t inodes[LEGACY_FILES];
+} snapshot_disk_t;
+
+// Sections of a saved image, in file order
+typedef enum {
+    SECTION_GEOMETRY = 1, // Block size and table sizes the image was built with
+    SECTION_REFS, // u32 reference count per block (u16 in version 1); the bitmap is derived from it
+    SECTION_INODES, // Live inode table
+    SECTION_DATA, // Blocks with references, in ascending id order
+    SECTION_SNAPSHOTS, // Name, creation time and inode table per snapshot
+    SECTION_PATH, // Current directory, without terminator
+    SECTION_LIMIT
+} image_section_type;
+
+// Section table entry
+typedef struct {
+    uint32_t type;
+    uint32_t count; // Records in the section
+    uint64_t offset;
+    uint64_t length;
+    uint32_t crc;
+} image_section_t;
+
+// Instrumented operations
+typedef enum { OP_CREATE, OP_LOOKUP, OP_UNLINK, OP_WRITE, OP_READ, OP_SAVE, OP_LOAD, OP_COUNT } vfs_op_t;
+
+typedef struct {
+    uint64_t calls;
+    uint64_t failed;
+    uint64_t total_ns;
+    uint64_t bytes;
+    uint64_t hist[STAT_BUCKETS]; // Log2 nanosecond buckets
+} vfs_op_stats_t;
+
+typedef struct {
+    vfs_op_stats_t ops[OP_COUNT];
+    uint64_t alloc_calls;
+    uint64_t alloc_scanned; // Bitmap positions examined by vfs_alloc_block
+    uint64_t alloc_max_scan;
+} vfs_stats_t;
+
+// Totals gathered by vfs_du
+typedef struct {
+    uint32_t files;
+    uint32_t dirs;
+    uint64_t bytes; // Logical file sizes
+    uint64_t blocks; // Block references, shared blocks counted for each owner
+} vfs_usage_t;
+
+// Filters for vfs_find; zero fields match everything
+typedef struct {
+    char pattern[MAX_NAME_LEN];
+    size_t min_size;
+    size_t max_size;
+    time_t newer_than;
+    uint32_t matches;
+} vfs_find_t;
+
+// Directory entry as returned by vfs_readdir
+typedef struct {
+    char name[MAX_NAME_LEN];
+    uint32_t inode_id;
+    inode_type type;
+    size_t size;
+    time_t mtime; // Last modification, creation time if never written
+} vfs_dirent_t;
+
+// Open directory cursor
+typedef struct {
+    inode_t* dir;
+    uint32_t pos;
+    uint32_t count;
+    uint16_t* order; // Entry positions in name order, NULL for on-disk order
+} vfs_dir_t;
+
+// Decompressed cluster kept in memory
+typedef struct {
+    uint32_t inode_id; // 0 for an unused slot
+    uint32_t cluster;
+    uint32_t block; // First block and stored length identify the cluster contents
+    uint16_t len;
+    uint64_t stamp; // Last use, for LRU eviction
+    uint8_t* data;
+} vfs_cluster_t;
+
+// Everything an image records, read-only
+typedef struct {
+    uint32_t block_count;
+    uint32_t inode_count;
+    const uint32_t* block_refs;
+    uint8_t* const* blocks;
+    const inode_t* inodes; // Live tree
+    const inode_map_t* maps;
+    vfs_snapshot_t* const* snapshots;
+    const char* path;
+} vfs_image_t;
+
+// Copy of the file system being written by a checkpoint. Its blocks hold an extra
+// reference until the write ends, so foreground writes copy them instead of changing them.
+typedef struct {
+    uint32_t block_count;
+    uint32_t inode_count;
+    uint32_t* block_refs; // As captured, without the checkpoint's own references
+    uint8_t** blocks;
+    inode_t* inodes;
+    inode_map_t* maps;
+    vfs_snapshot_t* snapshots[MAX_SNAPSHOTS];
+    char path[MAX_PATH_LEN];
+    char filename[MAX_PATH_LEN];
+    uint64_t generation; // Of the captured state
+    int result;
+    int error; // errno of a failed write
+    uint64_t bytes;
+    uint64_t ns; // Time spent writing
+    int threaded;
+#ifndef __STDC_NO_THREADS__
+    thrd_t thread;
+    mtx_t lock;
+    int done;
+#endif
+} vfs_checkpoint_t;
+
 // VFS condition
 typedef struct {
     superblock_t super;
-    inode_t inodes[MAX_FILES];
-    uint8_t* blocks[MAX_BLOCKS];
+    inode_t* inodes;
+    inode_map_t* maps;
+    uint8_t** blocks;
     inode_t* root;
     inode_t* current_dir;
     char current_path[MAX_PATH_LEN];
+    vfs_snapshot_t* snapshots[MAX_SNAPSHOTS];
+    int mounted; // Index of the mounted snapshot or -1 for the live file system
+    inode_t* live_inodes; // Live inode table while a snapshot is mounted
+    inode_map_t* live_maps;
+    char live_path[MAX_PATH_LEN];
+    int dedup; // Share identical full blocks on write
+    uint64_t* block_hash; // Fingerprint of indexed blocks, 0 if not indexed
+    uint32_t* dedup_table; // Block id + 1, 0 for an empty bucket; open addressing
+    uint32_t dedup_mask; // Buckets - 1, at least twice the block count
+    uint64_t dedup_hits;
+    int compress_new; // New files get INODE_COMPRESSED
+    vfs_cluster_t cluster_cache[CLUSTER_CACHE_SLOTS];
+    uint64_t cache_clock;
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    vfs_stats_t stats;
+    int skip_load_check; // vfs_load leaves the image as found (for fsck)
+    int defrag_active; // Incremental defragmentation in progress
+    uint32_t defrag_cursor; // Next block id to fill; ids below it are already placed
+    uint32_t defrag_table; // 0 for the live tree, then snapshot index + 1
+    uint32_t defrag_pos; // Position in defrag_order or in the snapshot inode table
+    uint32_t* defrag_order; // Live inode ids in tree order, [0] is the count
+    uint64_t generation; // Bumped by every change an image records
+    uint64_t saved_generation; // Generation of the last image written
+    vfs_checkpoint_t* checkpoint; // Write in progress, NULL when idle
+    int checkpoint_interval; // Seconds, 0 disables periodic checkpoints
+    time_t checkpoint_time; // Last checkpoint started
+    uint64_t checkpoints; // Written successfully
+    uint64_t checkpoint_ns; // Duration of the last one
+    uint64_t checkpoint_bytes;
 } vfs_state_t;
 
 /* Prototype */
+typedef int (*vfs_visit_fn)(vfs_state_t* vfs, inode_t* inode, const char* path, void* ctx);
 void vfs_init(vfs_state_t* vfs);
+int vfs_format(vfs_state_t* vfs, uint32_t blocks, uint32_t inodes);
+int vfs_resize(vfs_state_t* vfs, uint32_t blocks, uint32_t inodes);
+int vfs_shrink(vfs_state_t* vfs);
 inode_t* vfs_create(vfs_state_t* vfs, const char* name, inode_type type);
 inode_t* vfs_lookup(vfs_state_t* vfs, const char* name);
 ssize_t vfs_write(vfs_state_t* vfs, inode_t* file, const char* data, size_t size);
+ssize_t vfs_pwrite(vfs_state_t* vfs, inode_t* file, size_t offset, const char* data, size_t size);
+ssize_t vfs_read(vfs_state_t* vfs, inode_t* file, size_t offset, char* buf, size_t size);
+int vfs_truncate(vfs_state_t* vfs, inode_t* file, size_t size);
+uint32_t vfs_alloc_block(vfs_state_t* vfs, uint32_t hint);
+void vfs_release_block(vfs_state_t* vfs, uint32_t block_id);
+uint32_t vfs_block_private(vfs_state_t* vfs, uint32_t* slot);
+int vfs_snapshot_create(vfs_state_t* vfs, const char* name);
+int vfs_snapshot_delete(vfs_state_t* vfs, const char* name);
+int vfs_snapshot_mount(vfs_state_t* vfs, const char* name);
+int vfs_snapshot_unmount(vfs_state_t* vfs);
+void vfs_snapshot_list(vfs_state_t* vfs);
+void vfs_dedup_enable(vfs_state_t* vfs, int enable);
+void vfs_dedup_block(vfs_state_t* vfs, uint32_t* slot);
+void vfs_dedup_stats(vfs_state_t* vfs);
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+size_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap);
+int vfs_set_compressed(vfs_state_t* vfs, inode_t* file, int enable);
+void vfs_cluster_cache_reset(vfs_state_t* vfs);
+void vfs_compression_stats(vfs_state_t* vfs);
+int vfs_import(vfs_state_t* vfs, const char* host_dir);
+int vfs_export(vfs_state_t* vfs, const char* name, const char* host_dir);
 void vfs_ls(vfs_state_t* vfs);
+int vfs_list(vfs_state_t* vfs, const char* pattern, int sorted, uint32_t page_size);
+int vfs_opendir(vfs_state_t* vfs, inode_t* dir, int sorted, vfs_dir_t* it);
+int vfs_readdir(vfs_state_t* vfs, vfs_dir_t* it, vfs_dirent_t* out, int max);
+void vfs_closedir(vfs_dir_t* it);
 int vfs_cd(vfs_state_t* vfs, const char* path);
 int vfs_unlink(vfs_state_t* vfs, const char* name);
 void clear_input_buffer();
 void print_menu();
+void vfs_free(vfs_state_t* vfs);
+void vfs_stats_print(vfs_state_t* vfs, FILE* out, int histograms);
+int vfs_stats_dump(vfs_state_t* vfs, const char* filename);
+int vfs_bench(int json, int rounds);
 int vfs_save(vfs_state_t* vfs, const char* filename);
 int vfs_load(vfs_state_t* vfs, const char* filename);
 int is_name_valid(const char* name);
+int host_mkdir(const char* path);
+int vfs_read_only(vfs_state_t* vfs);
+int vfs_walk(vfs_state_t* vfs, inode_t* start, const char* start_path, vfs_visit_fn visit, void* ctx);
+int vfs_du(vfs_state_t* vfs, const char* name, vfs_usage_t* usage);
+int vfs_find(vfs_state_t* vfs, const char* name, vfs_find_t* query);
+int vfs_remove_tree(vfs_state_t* vfs, const char* name);
+void vfs_defrag_start(vfs_state_t* vfs);
+int vfs_defrag_step(vfs_state_t* vfs, uint64_t budget_ns);
+void vfs_defrag_report(vfs_state_t* vfs);
+int vfs_check(vfs_state_t* vfs, int repair, int verbose);
+int vfs_fsck(const char* filename, int repair);
+int vfs_mkfs(const char* filename, uint32_t blocks, uint32_t inodes);
+int vfs_checkpoint_start(vfs_state_t* vfs, const char* filename);
+int vfs_checkpoint_wait(vfs_state_t* vfs);
+void vfs_checkpoint_tick(vfs_state_t* vfs, const char* filename);
+void vfs_checkpoint_report(vfs_state_t* vfs);
+
+int main(int argc, char* argv[]) {
+    if (argc > 1) {
+        if (strcmp(argv[1], "bench") == 0) {
+            int json = (argc > 2 && strcmp(argv[2], "json") == 0);
+            int rounds = (argc > 3) ? atoi(argv[3]) : 20;
+            return vfs_bench(json, rounds > 0 ? rounds : 20);
+        }
+        if (strcmp(argv[1], "fsck") == 0) {
+            const char* image = NULL;
+            int repair = 0, ok = 1;
+            for (int i = 2; ok && i < argc; i++) {
+                if (strcmp(argv[i], "--repair") == 0) {
+                    repair = 1;
+                } else if (argv[i][0] != '-' && !image) {
+                    image = argv[i];
+                } else {
+                    ok = 0;
+                }
+            }
+            if (ok) return vfs_fsck(image ? image : SAVE_FILE, repair);
+            fprintf(stderr, "Usage: %s fsck [--repair] [image]\n", argv[0]);
+            return 1;
+        }
+        if (strcmp(argv[1], "format") == 0) {
+            unsigned long blocks = DEFAULT_BLOCKS, inodes = DEFAULT_FILES;
+            const char* image = SAVE_FILE;
+            int ok = 1;
+            for (int i = 2; ok && i < argc; i++) {
+                if (strcmp(argv[i], "--blocks") == 0 && i + 1 < argc) {
+                    blocks = strtoul(argv[++i], NULL, 10);
+                } else if (strcmp(argv[i], "--inodes") == 0 && i + 1 < argc) {
+                    inodes = strtoul(argv[++i], NULL, 10);
+                } else if (argv[i][0] != '-') {
+                    image = argv[i];
+                } else {
+                    ok = 0;
+                }
+            }
+            if (ok && blocks >= 32 && blocks <= BLOCK_LIMIT && inodes > 0 && inodes <= FILE_LIMIT) {
+                return vfs_mkfs(image, (uint32_t)blocks, (uint32_t)inodes);
+            }
+            fprintf(stderr, "format needs 32..%u blocks and 1..%u inodes\n", BLOCK_LIMIT, FILE_LIMIT);
+            return 1;
+        }
+        fprintf(stderr, "Usage: %s [bench [csv|json] [rounds] | fsck [--repair] [image] |"
+                        " format [--blocks N] [--inodes M] [image]]\n", argv[0]);
+        return 1;
+    }
 
-int main() {
     vfs_state_t vfs;
     vfs_init(&vfs);
 
@@ -84,8 +426,16 @@ int main() {
     char path[MAX_PATH_LEN];
 
     while (1) {
+        // Background defragmentation advances a little between commands
+        vfs_defrag_step(&vfs, DEFRAG_STEP_NS);
+        vfs_checkpoint_tick(&vfs, SAVE_FILE);
+
         print_menu();
-        printf("\nVFS [%s] > ", vfs.current_path);
+        if (vfs.mounted >= 0) {
+            printf("\nVFS [%s:%s] > ", vfs.snapshots[vfs.mounted]->name, vfs.current_path);
+        } else {
+            printf("\nVFS [%s] > ", vfs.current_path);
+        }
         if (scanf("%d", &choice) != 1) {
             clear_input_buffer();
             printf("Invalid input. Please enter a number.\n");
@@ -160,6 +510,8 @@ int main() {
                     printf("File not found\n");
                 } else if (result == -2) {
                     printf("Cannot delete non-empty directory\n");
+                } else if (result == -3) {
+                    printf("Cannot delete from a read-only snapshot\n");
                 }
                 break;
 
@@ -215,6 +567,7 @@ int main() {
 
             case 8: // Exit
                 // Save the VFS state before exiting
+                vfs_checkpoint_wait(&vfs);
                 if (vfs_save(&vfs, SAVE_FILE) == 0) {
                     printf("VFS state saved to %s\n", SAVE_FILE);
                 } else {
@@ -222,157 +575,551 @@ int main() {
                 }
 
                 // Free resources
-                for (int i = 0; i < MAX_BLOCKS; i++) {
-                    if (vfs.blocks[i]) free(vfs.blocks[i]);
-                }
+                vfs_free(&vfs);
                 printf("Exiting VFS. Goodbye!\n");
                 return 0;
 
-            default:
-                printf("Invalid choice. Please try again.\n");
-        }
-    }
-    return 0;
-}
+            case 9: // Import host directory
+                printf("Enter host directory to import: ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
 
-/* Function Implementations */
-void vfs_init(vfs_state_t* vfs) {
-    memset(vfs, 0, sizeof(vfs_state_t));
-    vfs->super.magic = 0xDEADBEEF;
-    vfs->super.block_size = BLOCK_SIZE;
+                int imported = vfs_import(&vfs, path);
+                if (imported >= 0) {
+                    printf("Imported %d entries from '%s'\n", imported, path);
+                } else {
+                    printf("Failed to import '%s'\n", path);
+                }
+                break;
 
-    // Initialize root directory
-    vfs->root = &vfs->inodes[0];
-    vfs->root->id = 1;
-    vfs->root->type = DIR_TYPE;
-    vfs->root->ctime = time(NULL);
-    vfs->current_dir = vfs->root;
-    strcpy(vfs->current_path, "/");
+            case 10: // Export directory to host
+                printf("Enter VFS directory name (or '.' for current): ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
 
-    // Allocate root directory block
-    vfs->blocks[0] = malloc(BLOCK_SIZE);
-    if (!vfs->blocks[0]) {
-        fprintf(stderr, "FATAL: Failed to allocate root block\n");
-        exit(EXIT_FAILURE);
-    }
-    memset(vfs->blocks[0], 0, BLOCK_SIZE);
-    vfs->root->blocks[0] = 0;
-    vfs->super.free_blocks[0] |= 1; // Mark block 0 as used
+                printf("Enter host destination directory: ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
 
-    // Initialize root directory entries
-    dir_entry_t* root_dir = (dir_entry_t*)vfs->blocks[0];
-    strncpy(root_dir[0].name, ".", MAX_NAME_LEN);
-    root_dir[0].inode_id = 1;
-    strncpy(root_dir[1].name, "..", MAX_NAME_LEN);
-    root_dir[1].inode_id = 1;
-    vfs->root->size = 2 * sizeof(dir_entry_t);
-}
+                int exported = vfs_export(&vfs, name, path);
+                if (exported >= 0) {
+                    printf("Exported %d entries to '%s'\n", exported, path);
+                } else {
+                    printf("Failed to export '%s'\n", name);
+                }
+                break;
 
-int is_name_valid(const char* name) {
-    // Check for empty name
-    if (name == NULL || name[0] == '\0') {
-        return 0;
-    }
+            case 11: // Snapshots
+                printf("Enter snapshot command (create/list/mount/unmount/delete): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
 
-    // Check if name starts with space or tab
-    if (name[0] == ' ' || name[0] == '\t') {
-        return 0;
-    }
+                if (strcmp(path, "list") == 0) {
+                    vfs_snapshot_list(&vfs);
+                    break;
+                }
+                if (strcmp(path, "unmount") == 0) {
+                    if (vfs_snapshot_unmount(&vfs) == 0) {
+                        printf("Back to live file system: %s\n", vfs.current_path);
+                    } else {
+                        printf("No snapshot mounted\n");
+                    }
+                    break;
+                }
+                if (strcmp(path, "create") != 0 && strcmp(path, "mount") != 0 &&
+                    strcmp(path, "delete") != 0) {
+                    printf("Unknown snapshot command\n");
+                    break;
+                }
 
-    // Check each character in the name
-    for (int i = 0; name[i] != '\0'; i++) {
-        unsigned char c = name[i];
+                printf("Enter snapshot name: ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
 
-        // Allow only printable characters (ASCII 32-126)
-        if (c < 32 || c > 126) {
-            return 0;
-        }
+                if (strcmp(path, "create") == 0) {
+                    if (vfs_snapshot_create(&vfs, name) == 0) {
+                        printf("Snapshot '%s' created\n", name);
+                    } else {
+                        printf("Error creating snapshot\n");
+                    }
+                } else if (strcmp(path, "mount") == 0) {
+                    if (vfs_snapshot_mount(&vfs, name) == 0) {
+                        printf("Snapshot '%s' mounted read-only\n", name);
+                    } else {
+                        printf("Snapshot not found\n");
+                    }
+                } else if (vfs_snapshot_delete(&vfs, name) == 0) {
+                    printf("Snapshot '%s' deleted\n", name);
+                } else {
+                    printf("Error deleting snapshot\n");
+                }
+                break;
 
-        // Additional forbidden characters for safety
-        if (c == '/' || c == '\\' || c == ':' ||
-            c == '*' || c == '?' || c == '"' ||
-            c == '<' || c == '>' || c == '|') {
-            return 0;
-        }
-    }
+            case 12: // Deduplication
+                printf("Enter dedup command (on/off/stats): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
 
-    // Check if name consists only of whitespace
-    for (int i = 0; name[i] != '\0'; i++) {
-        if (name[i] != ' ' && name[i] != '\t') {
-            return 1;
-        }
-    }
+                if (strcmp(path, "on") == 0 || strcmp(path, "off") == 0) {
+                    vfs_dedup_enable(&vfs, strcmp(path, "on") == 0);
+                    printf("Deduplication %s\n", vfs.dedup ? "enabled" : "disabled");
+                } else if (strcmp(path, "stats") == 0) {
+                    vfs_dedup_stats(&vfs);
+                } else {
+                    printf("Unknown dedup command\n");
+                }
+                break;
 
-    return 0;
-}
+            case 13: // Compression
+                printf("Enter compression command (compress/decompress/auto/stats): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
 
-inode_t* vfs_create(vfs_state_t* vfs, const char* name, inode_type type) {
-    // Validate name
-    if (!is_name_valid(name)) {
-        printf("Invalid name: cannot be empty\n");
-        return NULL;
-    }
+                if (strcmp(path, "auto") == 0) {
+                    vfs.compress_new = !vfs.compress_new;
+                    printf("New files will be %s\n", vfs.compress_new ? "compressed" : "stored raw");
+                    break;
+                }
+                if (strcmp(path, "stats") == 0) {
+                    vfs_compression_stats(&vfs);
+                    break;
+                }
+                if (strcmp(path, "compress") != 0 && strcmp(path, "decompress") != 0) {
+                    printf("Unknown compression command\n");
+                    break;
+                }
 
-    // Check if name exists
-    if (vfs_lookup(vfs, name)) {
-        printf("Name '%s' already exists\n", name);
-        return NULL;
-    }
+                printf("Enter file name: ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
 
-    // Find free inode
-    uint32_t inode_id = 0;
-    for (; inode_id < MAX_FILES; inode_id++) {
-        if (vfs->inodes[inode_id].id == 0) break;
-    }
-    if (inode_id >= MAX_FILES) {
-        printf("No free inodes\n");
-        return NULL;
-    }
+                inode_t* target = vfs_lookup(&vfs, name);
+                if (!target || target->type != FILE_TYPE) {
+                    printf("File not found or is a directory\n");
+                } else if (vfs_set_compressed(&vfs, target, strcmp(path, "compress") == 0) == 0) {
+                    printf("File '%s' is now %s\n", name,
+                           (target->flags & INODE_COMPRESSED) ? "compressed" : "uncompressed");
+                } else {
+                    printf("Error converting file\n");
+                }
+                break;
 
-    // Find free block
-    uint32_t block_id = 0;
-    for (; block_id < MAX_BLOCKS; block_id++) {
-        if (!(vfs->super.free_blocks[block_id / 32] & (1 << (block_id % 32)))) break;
-    }
-    if (block_id >= MAX_BLOCKS) {
-        printf("No free blocks\n");
-        return NULL;
-    }
+            case 14: // Truncate file
+            case 15: // Write at offset
+                printf("Enter file name: ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
 
-    // Initialize inode
-    inode_t* inode = &vfs->inodes[inode_id];
-    inode->id = inode_id + 1;
-    inode->type = type;
-    inode->ctime = time(NULL);
-    inode->size = 0;
-    inode->blocks[0] = block_id;
+                inode_t* sparse = vfs_lookup(&vfs, name);
+                if (!sparse || sparse->type != FILE_TYPE) {
+                    printf("File not found or is a directory\n");
+                    break;
+                }
 
-    // Allocate block
-    vfs->blocks[block_id] = malloc(BLOCK_SIZE);
-    if (!vfs->blocks[block_id]) {
-        printf("Failed to allocate block\n");
-        memset(inode, 0, sizeof(inode_t));
-        return NULL;
-    }
-    memset(vfs->blocks[block_id], 0, BLOCK_SIZE);
-    vfs->super.free_blocks[block_id / 32] |= (1 << (block_id % 32));
+                unsigned long position;
+                printf(choice == 14 ? "Enter new size: " : "Enter offset: ");
+                if (scanf("%lu", &position) != 1) {
+                    clear_input_buffer();
+                    printf("Invalid number\n");
+                    break;
+                }
+                clear_input_buffer();
 
-    // Initialize directory entries
-    if (type == DIR_TYPE) {
-        dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
-        strncpy(dir[0].name, ".", MAX_NAME_LEN);
-        dir[0].inode_id = inode->id;
-        strncpy(dir[1].name, "..", MAX_NAME_LEN);
-        dir[1].inode_id = vfs->current_dir->id;
-        inode->size = 2 * sizeof(dir_entry_t);
-    }
+                if (choice == 14) {
+                    if (vfs_truncate(&vfs, sparse, position) == 0) {
+                        printf("File '%s' is now %lu bytes\n", name, position);
+                    } else {
+                        printf("Error truncating file\n");
+                    }
+                    break;
+                }
 
-    // Add to current directory
-    uint32_t dir_block = vfs->current_dir->blocks[0];
-    if (dir_block >= MAX_BLOCKS || !vfs->blocks[dir_block]) {
-        printf("Current directory invalid\n");
-        free(vfs->blocks[block_id]);
-        memset(inode, 0, sizeof(inode_t));
+                printf("Enter content (max %d chars): ", BLOCK_SIZE - 1);
+                if (!fgets(content, BLOCK_SIZE, stdin)) {
+                    printf("Error reading content\n");
+                    break;
+                }
+                content[strcspn(content, "\n")] = '\0';
+
+                ssize_t put = vfs_pwrite(&vfs, sparse, position, content, strlen(content));
+                if (put >= 0) {
+                    printf("Wrote %ld bytes at offset %lu\n", (long)put, position);
+                } else {
+                    printf("Error writing to file\n");
+                }
+                break;
+
+            case 16: // Statistics
+                printf("Enter stats command (show/histogram/dump/reset): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
+
+                if (strcmp(path, "show") == 0 || strcmp(path, "histogram") == 0) {
+                    vfs_stats_print(&vfs, stdout, strcmp(path, "histogram") == 0);
+                } else if (strcmp(path, "reset") == 0) {
+                    memset(&vfs.stats, 0, sizeof(vfs.stats));
+                    vfs.cache_hits = vfs.cache_misses = vfs.dedup_hits = 0;
+                    printf("Statistics reset\n");
+                } else if (strcmp(path, "dump") == 0) {
+                    printf("Enter output file: ");
+                    if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                        printf("Error reading input\n");
+                        break;
+                    }
+                    path[strcspn(path, "\n")] = '\0';
+                    if (vfs_stats_dump(&vfs, path) == 0) {
+                        printf("Statistics written to %s\n", path);
+                    }
+                } else {
+                    printf("Unknown stats command\n");
+                }
+                break;
+
+            case 17: // Remove recursively
+                printf("Enter file or directory name: ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
+
+                int removed = vfs_remove_tree(&vfs, name);
+                if (removed > 0) {
+                    printf("Removed '%s' (%d entries)\n", name, removed);
+                } else if (removed == -3) {
+                    printf("Cannot delete from a read-only snapshot\n");
+                } else if (removed == -2) {
+                    printf("Cannot collect everything under '%s'; nothing removed\n", name);
+                } else {
+                    printf("File not found\n");
+                }
+                break;
+
+            case 18: // Disk usage
+                printf("Enter name (or '.' for current): ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
+
+                vfs_usage_t usage;
+                if (vfs_du(&vfs, name, &usage) == 0) {
+                    printf("%u files, %u directories, %llu bytes in %llu blocks (%llu KB)\n",
+                           usage.files, usage.dirs, (unsigned long long)usage.bytes,
+                           (unsigned long long)usage.blocks,
+                           (unsigned long long)(usage.blocks * BLOCK_SIZE / 1024));
+                } else {
+                    printf("Not found\n");
+                }
+                break;
+
+            case 19: { // Find
+                vfs_find_t query;
+                memset(&query, 0, sizeof(query));
+                unsigned long min_size, max_size, minutes;
+
+                printf("Enter name pattern (* and ? allowed, empty for any): ");
+                if (!fgets(query.pattern, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                query.pattern[strcspn(query.pattern, "\n")] = '\0';
+
+                printf("Enter min size, max size (0 = no limit) and modified within minutes (0 = any): ");
+                if (scanf("%lu %lu %lu", &min_size, &max_size, &minutes) != 3) {
+                    clear_input_buffer();
+                    printf("Invalid numbers\n");
+                    break;
+                }
+                clear_input_buffer();
+                query.min_size = min_size;
+                query.max_size = max_size;
+                query.newer_than = minutes ? time(NULL) - (time_t)minutes * 60 : 0;
+
+                if (vfs_find(&vfs, ".", &query) == 0) {
+                    printf("Found: %u\n", query.matches);
+                }
+                break;
+            }
+
+            case 20: // Defragment
+                printf("Enter defrag command (run/background/status): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
+
+                if (strcmp(path, "status") == 0) {
+                    vfs_defrag_report(&vfs);
+                } else if (vfs.mounted >= 0) {
+                    printf("Unmount the snapshot before defragmenting\n");
+                } else if (strcmp(path, "run") == 0) {
+                    vfs_checkpoint_wait(&vfs);
+                    vfs_defrag_start(&vfs);
+                    while (vfs_defrag_step(&vfs, UINT64_MAX)) {}
+                    vfs_defrag_report(&vfs);
+                } else if (strcmp(path, "background") == 0) {
+                    vfs_defrag_start(&vfs);
+                    printf("Defragmentation will continue between commands\n");
+                } else {
+                    printf("Unknown defrag command\n");
+                }
+                break;
+
+            case 21: { // List with options
+                unsigned page_size;
+                printf("Enter name pattern (* and ? allowed, empty for all): ");
+                if (!fgets(name, MAX_NAME_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                name[strcspn(name, "\n")] = '\0';
+
+                printf("Sort by name (y/n): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+
+                printf("Enter page size (0 = no paging): ");
+                if (scanf("%u", &page_size) != 1) {
+                    clear_input_buffer();
+                    printf("Invalid number\n");
+                    break;
+                }
+                clear_input_buffer();
+
+                vfs_list(&vfs, name, path[0] == 'y' || path[0] == 'Y', page_size);
+                break;
+            }
+
+            case 22: // Checkpoints
+                printf("Enter checkpoint command (now/interval/status): ");
+                if (!fgets(path, MAX_PATH_LEN, stdin)) {
+                    printf("Error reading input\n");
+                    break;
+                }
+                path[strcspn(path, "\n")] = '\0';
+
+                if (strcmp(path, "status") == 0) {
+                    vfs_checkpoint_report(&vfs);
+                } else if (strcmp(path, "now") == 0) {
+                    int started = vfs_checkpoint_start(&vfs, SAVE_FILE);
+                    if (started == 0) {
+                        printf("Checkpoint of %s under way\n", SAVE_FILE);
+                    } else if (started == 1) {
+                        printf("A checkpoint is already running\n");
+                    }
+                } else if (strcmp(path, "interval") == 0) {
+                    int seconds;
+                    printf("Enter seconds between checkpoints (0 = off): ");
+                    if (scanf("%d", &seconds) != 1 || seconds < 0) {
+                        clear_input_buffer();
+                        printf("Invalid number\n");
+                        break;
+                    }
+                    clear_input_buffer();
+                    vfs.checkpoint_interval = seconds;
+                    printf("Checkpoint interval: %d s\n", seconds);
+                } else {
+                    printf("Unknown checkpoint command\n");
+                }
+                break;
+
+            default:
+                printf("Invalid choice. Please try again.\n");
+        }
+    }
+    return 0;
+}
+
+/* Function Implementations */
+// Block map of an inode of the active table
+static inode_map_t* inode_map(vfs_state_t* vfs, const inode_t* inode) {
+    return &vfs->maps[inode - vfs->inodes];
+}
+
+void vfs_init(vfs_state_t* vfs) {
+    if (vfs_format(vfs, DEFAULT_BLOCKS, DEFAULT_FILES) != 0) {
+        fprintf(stderr, "FATAL: Failed to initialize VFS\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Empty file system with room for the given number of blocks and inodes
+int vfs_format(vfs_state_t* vfs, uint32_t blocks, uint32_t inodes) {
+    memset(vfs, 0, sizeof(vfs_state_t));
+    vfs->super.magic = VFS_MAGIC;
+    vfs->super.block_size = BLOCK_SIZE;
+    vfs->mounted = -1;
+    vfs->checkpoint_interval = CHECKPOINT_INTERVAL;
+    vfs->checkpoint_time = time(NULL);
+    if (vfs_resize(vfs, blocks < 32 ? 32 : blocks, inodes ? inodes : 1) != 0) return -1;
+
+    // Initialize root directory
+    vfs->root = &vfs->inodes[0];
+    vfs->root->id = 1;
+    vfs->root->type = DIR_TYPE;
+    vfs->maps[0].ctime = time(NULL);
+    vfs->current_dir = vfs->root;
+    strcpy(vfs->current_path, "/");
+
+    // Block 0 is reserved: a block slot holding 0 is a hole
+    vfs->super.free_blocks[0] |= 1;
+
+    // Allocate root directory block
+    uint32_t root_block = vfs_alloc_block(vfs, 1);
+    if (root_block >= vfs->super.block_count) {
+        fprintf(stderr, "Failed to allocate root block\n");
+        return -1;
+    }
+    vfs->maps[0].blocks[0] = root_block;
+
+    // Initialize root directory entries
+    dir_entry_t* root_dir = (dir_entry_t*)vfs->blocks[root_block];
+    strncpy(root_dir[0].name, ".", MAX_NAME_LEN);
+    root_dir[0].inode_id = 1;
+    strncpy(root_dir[1].name, "..", MAX_NAME_LEN);
+    root_dir[1].inode_id = 1;
+    vfs->root->size = 2 * sizeof(dir_entry_t);
+    return 0;
+}
+
+int is_name_valid(const char* name) {
+    // Check for empty name
+    if (name == NULL || name[0] == '\0') {
+        return 0;
+    }
+
+    // Check if name starts with space or tab
+    if (name[0] == ' ' || name[0] == '\t') {
+        return 0;
+    }
+
+    // Check each character in the name
+    for (int i = 0; name[i] != '\0'; i++) {
+        unsigned char c = name[i];
+
+        // Allow only printable characters (ASCII 32-126)
+        if (c < 32 || c > 126) {
+            return 0;
+        }
+
+        // Additional forbidden characters for safety
+        if (c == '/' || c == '\\' || c == ':' ||
+            c == '*' || c == '?' || c == '"' ||
+            c == '<' || c == '>' || c == '|') {
+            return 0;
+        }
+    }
+
+    // Check if name consists only of whitespace
+    for (int i = 0; name[i] != '\0'; i++) {
+        if (name[i] != ' ' && name[i] != '\t') {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static inode_t* vfs_create_op(vfs_state_t* vfs, const char* name, inode_type type) {
+    if (vfs_read_only(vfs)) return NULL;
+
+    // Validate name
+    if (!is_name_valid(name)) {
+        printf("Invalid name: cannot be empty\n");
+        return NULL;
+    }
+
+    // Check if name exists
+    if (vfs_lookup(vfs, name)) {
+        printf("Name '%s' already exists\n", name);
+        return NULL;
+    }
+
+    // Find free inode
+    uint32_t inode_id = 0;
+    for (; inode_id < vfs->super.inode_count; inode_id++) {
+        if (vfs->inodes[inode_id].id == 0) break;
+    }
+    if (inode_id >= vfs->super.inode_count) {
+        // Full: double the inode tables (current_dir is re-pointed if they move)
+        uint32_t count = vfs->super.inode_count;
+        if (vfs_resize(vfs, vfs->super.block_count, count < FILE_LIMIT / 2 ? count * 2 : FILE_LIMIT) != 0 ||
+            inode_id >= vfs->super.inode_count) {
+            printf("No free inodes\n");
+            return NULL;
+        }
+    }
+
+    // Find free block (files get their blocks on first write)
+    uint32_t block_id = (type == DIR_TYPE) ? vfs_alloc_block(vfs, 1) : 0;
+    if (block_id >= vfs->super.block_count) {
+        printf("No free blocks\n");
+        return NULL;
+    }
+
+    // Initialize inode
+    inode_t* inode = &vfs->inodes[inode_id];
+    inode_map_t* map = &vfs->maps[inode_id];
+    memset(inode, 0, sizeof(inode_t));
+    memset(map, 0, sizeof(inode_map_t));
+    inode->id = inode_id + 1;
+    inode->type = type;
+    map->ctime = time(NULL);
+    inode->size = 0;
+    map->blocks[0] = block_id;
+    if (type == FILE_TYPE && vfs->compress_new) inode->flags |= INODE_COMPRESSED;
+
+    // Initialize directory entries
+    if (type == DIR_TYPE) {
+        dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
+        strncpy(dir[0].name, ".", MAX_NAME_LEN);
+        dir[0].inode_id = inode->id;
+        strncpy(dir[1].name, "..", MAX_NAME_LEN);
+        dir[1].inode_id = vfs->current_dir->id;
+        inode->size = 2 * sizeof(dir_entry_t);
+    }
+
+    // Add to current directory (copying its block first if a snapshot shares it)
+    uint32_t dir_block = vfs_block_private(vfs, &inode_map(vfs, vfs->current_dir)->blocks[0]);
+    if (dir_block >= vfs->super.block_count || !vfs->blocks[dir_block]) {
+        printf("Current directory invalid\n");
+        if (block_id) vfs_release_block(vfs, block_id);
+        memset(inode, 0, sizeof(inode_t));
         return NULL;
     }
 
@@ -380,7 +1127,7 @@ inode_t* vfs_create(vfs_state_t* vfs, const char* name, inode_type type) {
     uint32_t entry_count = vfs->current_dir->size / sizeof(dir_entry_t);
     if ((entry_count + 1) * sizeof(dir_entry_t) >= BLOCK_SIZE) {
         printf("Directory full\n");
-        free(vfs->blocks[block_id]);
+        if (block_id) vfs_release_block(vfs, block_id);
         memset(inode, 0, sizeof(inode_t));
         return NULL;
     }
@@ -393,22 +1140,22 @@ inode_t* vfs_create(vfs_state_t* vfs, const char* name, inode_type type) {
     return inode;
 }
 
-inode_t* vfs_lookup(vfs_state_t* vfs, const char* name) {
+static inode_t* vfs_lookup_op(vfs_state_t* vfs, const char* name) {
     if (!name || !*name) return NULL;
 
     // Special directories
     if (strcmp(name, ".") == 0) return vfs->current_dir;
     if (strcmp(name, "..") == 0) {
         if (vfs->current_dir == vfs->root) return vfs->root;
-        uint32_t block_id = vfs->current_dir->blocks[0];
-        if (block_id >= MAX_BLOCKS || !vfs->blocks[block_id]) return NULL;
+        uint32_t block_id = inode_map(vfs, vfs->current_dir)->blocks[0];
+        if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) return NULL;
         dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
         return &vfs->inodes[dir[1].inode_id - 1];
     }
 
     // Regular lookup
-    uint32_t block_id = vfs->current_dir->blocks[0];
-    if (block_id >= MAX_BLOCKS || !vfs->blocks[block_id]) return NULL;
+    uint32_t block_id = inode_map(vfs, vfs->current_dir)->blocks[0];
+    if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) return NULL;
 
     dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
     uint32_t entry_count = vfs->current_dir->size / sizeof(dir_entry_t);
@@ -421,14 +1168,15 @@ inode_t* vfs_lookup(vfs_state_t* vfs, const char* name) {
     return NULL;
 }
 
-int vfs_unlink(vfs_state_t* vfs, const char* name) {
+static int vfs_unlink_op(vfs_state_t* vfs, const char* name) {
     if (!name || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
         printf("Invalid name\n");
         return -1;
     }
+    if (vfs_read_only(vfs)) return -3;
 
-    uint32_t dir_block = vfs->current_dir->blocks[0];
-    if (dir_block >= MAX_BLOCKS || !vfs->blocks[dir_block]) {
+    uint32_t dir_block = vfs_block_private(vfs, &inode_map(vfs, vfs->current_dir)->blocks[0]);
+    if (dir_block >= vfs->super.block_count || !vfs->blocks[dir_block]) {
         printf("Directory invalid\n");
         return -1;
     }
@@ -456,18 +1204,23 @@ int vfs_unlink(vfs_state_t* vfs, const char* name) {
         }
     }
 
-    // Free blocks
+    // Drop references to blocks; blocks still shared with snapshots survive
+    inode_map_t* map = inode_map(vfs, target);
     for (int i = 0; i < INODE_BLOCKS; i++) {
-        uint32_t block_id = target->blocks[i];
-        if (block_id && block_id < MAX_BLOCKS && vfs->blocks[block_id]) {
-            free(vfs->blocks[block_id]);
-            vfs->blocks[block_id] = NULL;
-            vfs->super.free_blocks[block_id / 32] &= ~(1 << (block_id % 32));
+        uint32_t block_id = map->blocks[i];
+        if (block_id && block_id < vfs->super.block_count && vfs->blocks[block_id]) {
+            vfs_release_block(vfs, block_id);
         }
     }
 
+    // Cached clusters of the removed file must not match a future inode with the same id
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++) {
+        if (vfs->cluster_cache[i].inode_id == target->id) vfs->cluster_cache[i].inode_id = 0;
+    }
+
     // Remove from directory
     memset(target, 0, sizeof(inode_t));
+    memset(map, 0, sizeof(inode_map_t));
     if (index < entry_count - 1) {
         memmove(&dir[index], &dir[index + 1],
                 (entry_count - index - 1) * sizeof(dir_entry_t));
@@ -478,106 +1231,790 @@ int vfs_unlink(vfs_state_t* vfs, const char* name) {
     return 0;
 }
 
-ssize_t vfs_write(vfs_state_t* vfs, inode_t* file, const char* data, size_t size) {
-    if (!file || file->type != FILE_TYPE || !data || size == 0) return -1;
+// Re-indexes every fingerprinted block except exclude
+static void vfs_dedup_rebuild(vfs_state_t* vfs, uint32_t exclude) {
+    memset(vfs->dedup_table, 0, ((size_t)vfs->dedup_mask + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < vfs->super.block_count; i++) {
+        if (i == exclude || vfs->block_hash[i] == 0) continue;
+        uint32_t b = (uint32_t)vfs->block_hash[i] & vfs->dedup_mask;
+        while (vfs->dedup_table[b]) b = (b + 1) & vfs->dedup_mask;
+        vfs->dedup_table[b] = i + 1;
+    }
+}
+
+/* Grows the block and inode tables to at least the given sizes; new entries start empty.
+ * The inode tables may move: root and current_dir follow, other inode pointers go stale. */
+int vfs_resize(vfs_state_t* vfs, uint32_t blocks, uint32_t inodes) {
+    uint32_t old_blocks = vfs->super.block_count, old_inodes = vfs->super.inode_count;
+    if (blocks > BLOCK_LIMIT || inodes > FILE_LIMIT) {
+        printf("Capacity limit is %u blocks and %u inodes\n", BLOCK_LIMIT, FILE_LIMIT);
+        return -1;
+    }
+    blocks = (blocks + 31) / 32 * 32;
+    if (blocks < old_blocks) blocks = old_blocks;
+    if (inodes < old_inodes) inodes = old_inodes;
 
-    size_t offset = 0;
-    size_t remaining = size;
+    if (blocks > old_blocks) {
+        // Each table is kept as soon as it has grown, so a failure leaves a consistent state
+        uint32_t* bitmap = realloc(vfs->super.free_blocks, blocks / 32 * sizeof(uint32_t));
+        if (bitmap) vfs->super.free_blocks = bitmap;
+        uint32_t* refs = realloc(vfs->super.block_refs, blocks * sizeof(uint32_t));
+        if (refs) vfs->super.block_refs = refs;
+        uint8_t** data = realloc(vfs->blocks, blocks * sizeof(uint8_t*));
+        if (data) vfs->blocks = data;
+        uint64_t* hash = realloc(vfs->block_hash, blocks * sizeof(uint64_t));
+        if (hash) vfs->block_hash = hash;
+        uint32_t buckets = 64;
+        while (buckets < 2 * blocks) buckets *= 2;
+        uint32_t* table = calloc(buckets, sizeof(uint32_t));
+        if (!bitmap || !refs || !data || !hash || !table) {
+            printf("Failed to grow block tables to %u blocks\n", blocks);
+            free(table);
+            return -1;
+        }
 
-    // We find the first free block for writing
-    int start_block = 0;
-    while (start_block < INODE_BLOCKS && file->blocks[start_block] != 0) {
-        start_block++;
+        memset(bitmap + old_blocks / 32, 0, (blocks - old_blocks) / 32 * sizeof(uint32_t));
+        memset(refs + old_blocks, 0, (blocks - old_blocks) * sizeof(uint32_t));
+        memset(data + old_blocks, 0, (blocks - old_blocks) * sizeof(uint8_t*));
+        memset(hash + old_blocks, 0, (blocks - old_blocks) * sizeof(uint64_t));
+        free(vfs->dedup_table);
+        vfs->dedup_table = table;
+        vfs->dedup_mask = buckets - 1;
+        vfs->super.block_count = blocks;
+        vfs_dedup_rebuild(vfs, NO_BLOCK);
     }
 
-    // Recording data starting from the current position
-    for (int i = start_block; i < INODE_BLOCKS && remaining > 0; i++) {
-        uint32_t block_id = file->blocks[i];
+    if (inodes > old_inodes) {
+        if (vfs->mounted >= 0) return -1; // The live tables are put away
 
-        // Allocation of a new block (if necessary)
-        if (block_id == 0) {
-            // Search for a free block
-            for (block_id = 0; block_id < MAX_BLOCKS; block_id++) {
-                uint32_t block_idx = block_id / 32;
-                uint32_t bit_mask = 1 << (block_id % 32);
-
-                if (!(vfs->super.free_blocks[block_idx] & bit_mask)) {
-                    // block as occupied
-                    vfs->super.free_blocks[block_idx] |= bit_mask;
-                    file->blocks[i] = block_id;
-
-                    // Memory is allocated for the block
-                    vfs->blocks[block_id] = malloc(BLOCK_SIZE);
-                    if (!vfs->blocks[block_id]) {
-                        printf("Failed to allocate block %u\n", block_id);
-                        file->blocks[i] = 0;
-                        vfs->super.free_blocks[block_idx] &= ~bit_mask;
-                        break;
-                    }
-                    memset(vfs->blocks[block_id], 0, BLOCK_SIZE);
-                    break;
-                }
-            }
-            if (block_id >= MAX_BLOCKS) {
-                printf("No free blocks available\n");
-                break;
-            }
+        size_t cwd = vfs->current_dir ? (size_t)(vfs->current_dir - vfs->inodes) : 0;
+        inode_t* table = realloc(vfs->inodes, inodes * sizeof(inode_t));
+        if (table) {
+            vfs->inodes = table;
+            if (vfs->root) vfs->root = &table[0];
+            if (vfs->current_dir) vfs->current_dir = &table[cwd];
+        }
+        inode_map_t* maps = realloc(vfs->maps, inodes * sizeof(inode_map_t));
+        if (maps) vfs->maps = maps;
+        uint32_t* order = realloc(vfs->defrag_order, (inodes + 1) * sizeof(uint32_t));
+        if (order) vfs->defrag_order = order;
+        int ok = table && maps && order;
+        for (int i = 0; ok && i < MAX_SNAPSHOTS; i++) {
+            vfs_snapshot_t* snap = vfs->snapshots[i];
+            if (!snap) continue;
+            inode_t* snap_table = realloc(snap->inodes, inodes * sizeof(inode_t));
+            if (snap_table) snap->inodes = snap_table;
+            inode_map_t* snap_maps = realloc(snap->maps, inodes * sizeof(inode_map_t));
+            if (snap_maps) snap->maps = snap_maps;
+            ok = snap_table && snap_maps;
+        }
+        if (!ok) {
+            printf("Failed to grow inode tables to %u inodes\n", inodes);
+            return -1;
         }
 
-        // Checking the validity of the block
-        if (block_id >= MAX_BLOCKS || !vfs->blocks[block_id]) {
-            printf("Invalid block %u\n", block_id);
-            break;
+        size_t added = inodes - old_inodes;
+        memset(vfs->inodes + old_inodes, 0, added * sizeof(inode_t));
+        memset(vfs->maps + old_inodes, 0, added * sizeof(inode_map_t));
+        memset(vfs->defrag_order + old_inodes + 1, 0, added * sizeof(uint32_t));
+        if (old_inodes == 0) vfs->defrag_order[0] = 0;
+        for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+            if (!vfs->snapshots[i]) continue;
+            memset(vfs->snapshots[i]->inodes + old_inodes, 0, added * sizeof(inode_t));
+            memset(vfs->snapshots[i]->maps + old_inodes, 0, added * sizeof(inode_map_t));
         }
+        vfs->super.inode_count = inodes;
+    }
+    return 0;
+}
 
-        // Calculating the size of the data to write to the current block
-        size_t block_offset = file->size % BLOCK_SIZE;
-        size_t space_in_block = BLOCK_SIZE - block_offset;
-        size_t to_copy = (remaining < space_in_block) ? remaining : space_in_block;
+/* Drops the free tail of the block tables, keeping every block in use and at least 32.
+ * Block data does not move, so run it after defragmentation has packed the low ids. */
+int vfs_shrink(vfs_state_t* vfs) {
+    uint32_t blocks = vfs->super.block_count;
+    while (blocks > 1 && vfs->super.block_refs[blocks - 1] == 0) blocks--;
+    blocks = (blocks + 31) / 32 * 32;
+    if (blocks < 32) blocks = 32;
+    if (blocks >= vfs->super.block_count) return 0;
 
-        // Coping data in block
-        memcpy(vfs->blocks[block_id] + block_offset, data + offset, to_copy);
+    uint32_t buckets = 64;
+    while (buckets < 2 * blocks) buckets *= 2;
+    uint32_t* table = calloc(buckets, sizeof(uint32_t));
+    if (!table) return -1;
+
+    // A failed shrinking realloc leaves the larger table in place, which is still valid
+    uint32_t* bitmap = realloc(vfs->super.free_blocks, blocks / 32 * sizeof(uint32_t));
+    if (bitmap) vfs->super.free_blocks = bitmap;
+    uint32_t* refs = realloc(vfs->super.block_refs, blocks * sizeof(uint32_t));
+    if (refs) vfs->super.block_refs = refs;
+    uint8_t** data = realloc(vfs->blocks, blocks * sizeof(uint8_t*));
+    if (data) vfs->blocks = data;
+    uint64_t* hash = realloc(vfs->block_hash, blocks * sizeof(uint64_t));
+    if (hash) vfs->block_hash = hash;
+
+    free(vfs->dedup_table);
+    vfs->dedup_table = table;
+    vfs->dedup_mask = buckets - 1;
+    vfs->super.block_count = blocks;
+    vfs_dedup_rebuild(vfs, NO_BLOCK);
+    vfs->generation++;
+    return 0;
+}
+
+uint32_t vfs_alloc_block(vfs_state_t* vfs, uint32_t hint) {
+    // Search from the hint first so consecutive allocations form contiguous runs
+    vfs->stats.alloc_calls++;
+    for (;;) {
+        uint32_t count = vfs->super.block_count;
+        for (uint32_t n = 0; n < count; n++) {
+            uint32_t block_id = (hint + n) % count;
+            uint32_t block_idx = block_id / 32;
+            uint32_t bit_mask = 1u << (block_id % 32);
+
+            // Whole words of used blocks are passed over at once
+            if (block_id % 32 == 0 && vfs->super.free_blocks[block_idx] == UINT32_MAX) {
+                n += 31;
+                continue;
+            }
+            if (vfs->super.free_blocks[block_idx] & bit_mask) continue;
 
-        offset += to_copy;
-        remaining -= to_copy;
+            vfs->stats.alloc_scanned += n + 1;
+            if (n + 1 > vfs->stats.alloc_max_scan) vfs->stats.alloc_max_scan = n + 1;
+            vfs->blocks[block_id] = calloc(1, BLOCK_SIZE);
+            if (!vfs->blocks[block_id]) {
+                printf("Failed to allocate block %u\n", block_id);
+                return NO_BLOCK;
+            }
+            vfs->super.free_blocks[block_idx] |= bit_mask;
+            vfs->super.block_refs[block_id] = 1;
+            return block_id;
+        }
 
-        // Update size data
-        if (block_offset + to_copy > file->size % BLOCK_SIZE) {
-            file->size += to_copy;
+        // Full: double the file system and continue with the first new block
+        if (vfs_resize(vfs, count < BLOCK_LIMIT / 2 ? count * 2 : BLOCK_LIMIT, vfs->super.inode_count) != 0 ||
+            vfs->super.block_count == count) {
+            return NO_BLOCK; // No free blocks
         }
+        hint = count;
     }
-
-    file->mtime = time(NULL);
-    return offset; // Return the number of bytes written
 }
 
-void vfs_ls(vfs_state_t* vfs) {
-    if (!vfs->current_dir) {
-        printf("No current directory\n");
-        return;
+void vfs_release_block(vfs_state_t* vfs, uint32_t block_id) {
+    if (block_id >= vfs->super.block_count || vfs->super.block_refs[block_id] == 0) return;
+
+    if (--vfs->super.block_refs[block_id] == 0) {
+        free(vfs->blocks[block_id]);
+        vfs->blocks[block_id] = NULL;
+        vfs->block_hash[block_id] = 0;
+        vfs->super.free_blocks[block_id / 32] &= ~(1u << (block_id % 32));
     }
+}
 
-    uint32_t block_id = vfs->current_dir->blocks[0];
-    if (block_id >= MAX_BLOCKS || !vfs->blocks[block_id]) {
-        printf("Directory data invalid\n");
-        return;
+uint32_t vfs_block_private(vfs_state_t* vfs, uint32_t* slot) {
+    uint32_t block_id = *slot;
+    if (block_id >= vfs->super.block_count || vfs->super.block_refs[block_id] <= 1) return block_id;
+
+    // Shared with a snapshot: give the live inode its own copy
+    uint32_t copy_id = vfs_alloc_block(vfs, block_id + 1);
+    if (copy_id >= vfs->super.block_count) return NO_BLOCK;
+
+    memcpy(vfs->blocks[copy_id], vfs->blocks[block_id], BLOCK_SIZE);
+    vfs->super.block_refs[block_id]--;
+    *slot = copy_id;
+    return copy_id;
+}
+
+// 64-bit multiply-xorshift fingerprint of a whole block, never 0
+static uint64_t block_fingerprint(const uint8_t* data) {
+    uint64_t h = 0x9E3779B97F4A7C15ULL;
+    for (int i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * 0xFF51AFD7ED558CCDULL;
+        h ^= h >> 32;
     }
+    return h ? h : 1;
+}
 
-    dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
-    uint32_t entry_count = vfs->current_dir->size / sizeof(dir_entry_t);
+// Returns an in-use block (other than exclude) with exactly this content, or NO_BLOCK
+static uint32_t vfs_dedup_find(vfs_state_t* vfs, const uint8_t* data, uint32_t exclude) {
+    uint64_t h = block_fingerprint(data);
+    uint32_t bucket = (uint32_t)h & vfs->dedup_mask;
 
-    printf("\nContents of %s:\n", vfs->current_path);
-    printf("%-20s %-8s %s\n", "Name", "Type", "Created");
-    printf("----------------------------------------\n");
+    for (uint32_t n = 0; n <= vfs->dedup_mask; n++, bucket = (bucket + 1) & vfs->dedup_mask) {
+        uint32_t entry = vfs->dedup_table[bucket];
+        if (entry == 0) break;
 
-    for (uint32_t i = 0; i < entry_count; i++) {
-        inode_t* inode = &vfs->inodes[dir[i].inode_id - 1];
-        char* type = (inode->type == DIR_TYPE) ? "DIR" : "FILE";
-        char time_buf[32];
-        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&inode->ctime));
-        printf("%-20s %-8s %s\n", dir[i].name, type, time_buf);
+        // Entries are never removed; a freed or rewritten block simply fails these checks
+        uint32_t block_id = entry - 1;
+        if (block_id != exclude && vfs->block_hash[block_id] == h &&
+            vfs->super.block_refs[block_id] > 0 &&
+            memcmp(vfs->blocks[block_id], data, BLOCK_SIZE) == 0) {
+            return block_id;
+        }
+    }
+    return NO_BLOCK;
+}
+
+static void vfs_dedup_insert(vfs_state_t* vfs, uint32_t block_id, uint64_t h) {
+    vfs->block_hash[block_id] = h;
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        uint32_t bucket = (uint32_t)h & vfs->dedup_mask;
+        for (uint32_t n = 0; n <= vfs->dedup_mask; n++, bucket = (bucket + 1) & vfs->dedup_mask) {
+            uint32_t entry = vfs->dedup_table[bucket];
+            // Empty buckets and buckets of freed blocks can be (re)used
+            if (entry == 0 || entry == block_id + 1 || vfs->block_hash[entry - 1] == 0) {
+                vfs->dedup_table[bucket] = block_id + 1;
+                return;
+            }
+        }
+
+        // Table clogged with stale entries: rebuild it from the live fingerprints
+        vfs_dedup_rebuild(vfs, block_id);
+    }
+}
+
+void vfs_dedup_block(vfs_state_t* vfs, uint32_t* slot) {
+    uint32_t block_id = *slot;
+    if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) return;
+
+    uint32_t existing = vfs_dedup_find(vfs, vfs->blocks[block_id], block_id);
+    if (existing < vfs->super.block_count) {
+        vfs->super.block_refs[existing]++;
+        vfs->dedup_hits++;
+        vfs_release_block(vfs, block_id);
+        *slot = existing;
+    } else {
+        vfs_dedup_insert(vfs, block_id, block_fingerprint(vfs->blocks[block_id]));
+    }
+}
+
+void vfs_dedup_enable(vfs_state_t* vfs, int enable) {
+    memset(vfs->block_hash, 0, vfs->super.block_count * sizeof(uint64_t));
+    memset(vfs->dedup_table, 0, ((size_t)vfs->dedup_mask + 1) * sizeof(uint32_t));
+    vfs->dedup = enable;
+    if (!enable) return;
+
+    // Index everything already stored so new writes can share with it
+    for (uint32_t i = 0; i < vfs->super.block_count; i++) {
+        if (vfs->blocks[i]) vfs_dedup_insert(vfs, i, block_fingerprint(vfs->blocks[i]));
+    }
+}
+
+void vfs_dedup_stats(vfs_state_t* vfs) {
+    uint64_t logical = 0, physical = 0;
+    for (uint32_t i = 0; i < vfs->super.block_count; i++) {
+        logical += vfs->super.block_refs[i];
+        if (vfs->super.block_refs[i] > 0) physical++;
+    }
+
+    printf("Deduplication: %s\n", vfs->dedup ? "on" : "off");
+    printf("Block references: %llu, stored blocks: %llu\n",
+           (unsigned long long)logical, (unsigned long long)physical);
+    printf("Dedup ratio: %.2f:1, saved %llu KB, %llu hits this session\n",
+           physical ? (double)logical / physical : 1.0,
+           (unsigned long long)((logical - physical) * BLOCK_SIZE / 1024),
+           (unsigned long long)vfs->dedup_hits);
+}
+
+/* LZ codec: sequences of [token][literals][offset][match length], LZ4-style.
+   The token holds the literal count (high nibble) and match length - 4 (low nibble);
+   a nibble of 15 is extended by following bytes. The last sequence has no match. */
+static size_t lz_put_length(uint8_t* dst, size_t op, size_t cap, size_t n) {
+    while (n >= 255) {
+        if (op >= cap) return 0;
+        dst[op++] = 255;
+        n -= 255;
+    }
+    if (op >= cap) return 0;
+    dst[op++] = (uint8_t)n;
+    return op;
+}
+
+static size_t lz_put_sequence(uint8_t* dst, size_t op, size_t cap, const uint8_t* lit,
+                              size_t lit_len, size_t offset, size_t match_len) {
+    size_t ml = match_len ? match_len - 4 : 0;
+    if (op >= cap) return 0;
+    dst[op++] = (uint8_t)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15 && !(op = lz_put_length(dst, op, cap, lit_len - 15))) return 0;
+
+    if (op + lit_len > cap) return 0;
+    memcpy(dst + op, lit, lit_len);
+    op += lit_len;
+    if (!match_len) return op;
+
+    if (op + 2 > cap) return 0;
+    dst[op++] = (uint8_t)(offset & 0xFF);
+    dst[op++] = (uint8_t)(offset >> 8);
+    if (ml >= 15 && !(op = lz_put_length(dst, op, cap, ml - 15))) return 0;
+    return op;
+}
+
+// Returns the compressed size, or 0 if it would not fit in cap bytes
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0, op = 0;
+    while (ip + 4 <= len) {
+        uint32_t seq;
+        memcpy(&seq, src + ip, sizeof(seq));
+        uint32_t h = (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[h];
+        table[h] = (uint16_t)ip;
+
+        if (ip > ref && ip - ref <= 0xFFFF && memcmp(src + ref, src + ip, 4) == 0) {
+            size_t match_len = 4;
+            while (ip + match_len < len && src[ref + match_len] == src[ip + match_len]) match_len++;
+
+            op = lz_put_sequence(dst, op, cap, src + anchor, ip - anchor, ip - ref, match_len);
+            if (!op) return 0;
+            ip += match_len;
+            anchor = ip;
+        } else {
+            ip++;
+        }
+    }
+    return lz_put_sequence(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+// Returns the decompressed size, or 0 if the input is corrupt
+size_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t cap) {
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t lit_len = token >> 4;
+        if (lit_len == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return 0;
+                b = src[ip++];
+                lit_len += b;
+            } while (b == 255);
+        }
+        if (ip + lit_len > len || op + lit_len > cap) return 0;
+        memcpy(dst + op, src + ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+        if (ip == len) break; // Last sequence
+
+        if (ip + 2 > len) return 0;
+        size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+        ip += 2;
+        size_t match_len = (token & 0x0F) + 4;
+        if ((token & 0x0F) == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) return 0;
+                b = src[ip++];
+                match_len += b;
+            } while (b == 255);
+        }
+        if (offset == 0 || offset > op || op + match_len > cap) return 0;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (size_t i = 0; i < match_len; i++, op++) dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+void vfs_cluster_cache_reset(vfs_state_t* vfs) {
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++) vfs->cluster_cache[i].inode_id = 0;
+}
+
+// Returns the decompressed cluster through the cache, NULL on error
+static vfs_cluster_t* vfs_cluster_load(vfs_state_t* vfs, inode_t* file, uint32_t cluster) {
+    inode_map_t* map = inode_map(vfs, file);
+    uint32_t first = map->blocks[cluster * CLUSTER_BLOCKS];
+    uint16_t len = map->cluster_len[cluster];
+    vfs_cluster_t* entry = &vfs->cluster_cache[0];
+
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++) {
+        vfs_cluster_t* c = &vfs->cluster_cache[i];
+        if (c->inode_id == file->id && c->cluster == cluster && c->block == first && c->len == len) {
+            c->stamp = ++vfs->cache_clock;
+            vfs->cache_hits++;
+            return c;
+        }
+        if (c->stamp < entry->stamp) entry = c;
+    }
+    vfs->cache_misses++;
+
+    if (!entry->data && !(entry->data = malloc(CLUSTER_SIZE))) {
+        printf("Failed to allocate cluster cache\n");
+        return NULL;
+    }
+    entry->inode_id = 0;
+
+    // Gather the stored bytes of the cluster from its blocks
+    uint8_t packed[CLUSTER_SIZE];
+    size_t stored = len & ~CLUSTER_RAW;
+    for (size_t done = 0, k = 0; done < stored; done += BLOCK_SIZE, k++) {
+        uint32_t block_id = map->blocks[cluster * CLUSTER_BLOCKS + k];
+        if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) {
+            printf("Invalid block %u\n", block_id);
+            return NULL;
+        }
+        size_t n = (stored - done < BLOCK_SIZE) ? stored - done : BLOCK_SIZE;
+        memcpy(((len & CLUSTER_RAW) ? entry->data : packed) + done, vfs->blocks[block_id], n);
+    }
+
+    // Bytes past the stored data read as zeros (holes and sparse tails)
+    size_t n = stored;
+    if (len != 0 && !(len & CLUSTER_RAW)) {
+        n = lz_decompress(packed, stored, entry->data, CLUSTER_SIZE);
+        if (n == 0) {
+            printf("Corrupt compressed cluster %u\n", cluster);
+            return NULL;
+        }
+    }
+    memset(entry->data + n, 0, CLUSTER_SIZE - n);
+
+    entry->inode_id = file->id;
+    entry->cluster = cluster;
+    entry->block = first;
+    entry->len = len;
+    entry->stamp = ++vfs->cache_clock;
+    return entry;
+}
+
+static int is_zero(const uint8_t* data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (data[i]) return 0;
+    }
+    return 1;
+}
+
+// Compresses len bytes into fresh blocks, replacing the cluster's previous blocks
+static int vfs_cluster_store(vfs_state_t* vfs, inode_t* file, uint32_t cluster, const uint8_t* data, size_t len) {
+    if (is_zero(data, len)) len = 0; // All zeros: keep the cluster as a hole
+
+    uint8_t packed[CLUSTER_SIZE];
+    size_t packed_len = lz_compress(data, len, packed, len ? len - 1 : 0);
+    const uint8_t* src = packed_len ? packed : data;
+    size_t stored = packed_len ? packed_len : len;
+
+    // Allocate the new blocks first so a failure leaves the old cluster intact
+    uint32_t new_blocks[CLUSTER_BLOCKS] = {0};
+    inode_map_t* map = inode_map(vfs, file);
+    uint32_t* slots = &map->blocks[cluster * CLUSTER_BLOCKS];
+    uint32_t hint = (cluster > 0) ? map->blocks[cluster * CLUSTER_BLOCKS - 1] + 1 : 0;
+    for (size_t done = 0, k = 0; done < stored; done += BLOCK_SIZE, k++) {
+        new_blocks[k] = vfs_alloc_block(vfs, hint);
+        if (new_blocks[k] >= vfs->super.block_count) {
+            for (size_t j = 0; j < k; j++) vfs_release_block(vfs, new_blocks[j]);
+            return -1;
+        }
+        size_t n = (stored - done < BLOCK_SIZE) ? stored - done : BLOCK_SIZE;
+        memcpy(vfs->blocks[new_blocks[k]], src + done, n);
+        hint = new_blocks[k] + 1;
+    }
+
+    for (int k = 0; k < CLUSTER_BLOCKS; k++) {
+        if (slots[k]) vfs_release_block(vfs, slots[k]);
+        slots[k] = new_blocks[k];
+        if (vfs->dedup && slots[k] && (size_t)(k + 1) * BLOCK_SIZE <= stored) {
+            vfs_dedup_block(vfs, &slots[k]);
+        }
+    }
+    if (len == 0) {
+        map->cluster_len[cluster] = 0;
+    } else {
+        map->cluster_len[cluster] = (uint16_t)(packed_len ? packed_len : (len | CLUSTER_RAW));
+    }
+    return 0;
+}
+
+static ssize_t vfs_pwrite_compressed(vfs_state_t* vfs, inode_t* file, size_t offset, const char* data, size_t size) {
+    inode_map_t* map = inode_map(vfs, file);
+    size_t done = 0;
+
+    // Each touched cluster is decompressed, patched and compressed again
+    while (done < size) {
+        size_t pos = offset + done;
+        uint32_t cluster = pos / CLUSTER_SIZE;
+        if (cluster >= INODE_CLUSTERS) {
+            printf("File size limit reached\n");
+            break;
+        }
+
+        vfs_cluster_t* entry = vfs_cluster_load(vfs, file, cluster);
+        if (!entry) break;
+
+        size_t cluster_offset = pos % CLUSTER_SIZE;
+        size_t to_copy = CLUSTER_SIZE - cluster_offset;
+        if (to_copy > size - done) to_copy = size - done;
+        memcpy(entry->data + cluster_offset, data + done, to_copy);
+
+        size_t end = (pos + to_copy > file->size) ? pos + to_copy : file->size;
+        size_t len = end - (size_t)cluster * CLUSTER_SIZE;
+        if (len > CLUSTER_SIZE) len = CLUSTER_SIZE;
+
+        if (vfs_cluster_store(vfs, file, cluster, entry->data, len) != 0) {
+            entry->inode_id = 0;
+            printf("No free blocks available\n");
+            break;
+        }
+        entry->block = map->blocks[cluster * CLUSTER_BLOCKS];
+        entry->len = map->cluster_len[cluster];
+
+        done += to_copy;
+        file->size = end;
+    }
+
+    map->mtime = time(NULL);
+    return done;
+}
+
+static ssize_t vfs_pwrite_op(vfs_state_t* vfs, inode_t* file, size_t offset, const char* data, size_t size) {
+    if (!file || file->type != FILE_TYPE || !data || size == 0) return -1;
+    if (vfs_read_only(vfs)) return -1;
+    if (offset >= (size_t)INODE_BLOCKS * BLOCK_SIZE) {
+        printf("File size limit reached\n");
+        return -1;
+    }
+    if (file->flags & INODE_COMPRESSED) return vfs_pwrite_compressed(vfs, file, offset, data, size);
+
+    inode_map_t* map = inode_map(vfs, file);
+    size_t done = 0;
+
+    // Writing past the end leaves the skipped block slots as holes
+    while (done < size) {
+        size_t pos = offset + done;
+        size_t slot = pos / BLOCK_SIZE;
+        if (slot >= INODE_BLOCKS) {
+            printf("File size limit reached\n");
+            break;
+        }
+
+        // Calculating the size of the data to write to the current block
+        size_t block_offset = pos % BLOCK_SIZE;
+        size_t space_in_block = BLOCK_SIZE - block_offset;
+        size_t remaining = size - done;
+        size_t to_copy = (remaining < space_in_block) ? remaining : space_in_block;
+        const uint8_t* src = (const uint8_t*)data + done;
+        uint32_t block_id = map->blocks[slot];
+
+        if (to_copy == BLOCK_SIZE) {
+            uint32_t existing = NO_BLOCK;
+            if (is_zero(src, BLOCK_SIZE)) {
+                // A whole block of zeros is stored as a hole
+                if (block_id) vfs_release_block(vfs, block_id);
+                map->blocks[slot] = 0;
+                goto next;
+            }
+
+            // A whole block identical to an existing one is shared without allocating
+            if (vfs->dedup) existing = vfs_dedup_find(vfs, src, block_id ? block_id : NO_BLOCK);
+            if (existing < vfs->super.block_count) {
+                vfs->super.block_refs[existing]++;
+                vfs->dedup_hits++;
+                if (block_id) vfs_release_block(vfs, block_id);
+                map->blocks[slot] = existing;
+                goto next;
+            }
+        }
+
+        // Allocation of a new block next to the previous one (if necessary)
+        if (block_id == 0) {
+            uint32_t hint = (slot > 0 && map->blocks[slot - 1]) ? map->blocks[slot - 1] + 1 : 1;
+            block_id = vfs_alloc_block(vfs, hint);
+            if (block_id >= vfs->super.block_count) {
+                printf("No free blocks available\n");
+                break;
+            }
+            map->blocks[slot] = block_id;
+        } else {
+            // Copy-on-write: never modify a block that a snapshot still references
+            block_id = vfs_block_private(vfs, &map->blocks[slot]);
+            if (block_id >= vfs->super.block_count) {
+                printf("No free blocks available\n");
+                break;
+            }
+        }
+
+        // Checking the validity of the block
+        if (!vfs->blocks[block_id]) {
+            printf("Invalid block %u\n", block_id);
+            break;
+        }
+
+        // Coping data in block
+        memcpy(vfs->blocks[block_id] + block_offset, src, to_copy);
+
+        // A block that is now full may already exist elsewhere
+        if (vfs->dedup && (slot + 1) * BLOCK_SIZE <= ((pos + to_copy > file->size) ? pos + to_copy : file->size)) {
+            vfs_dedup_block(vfs, &map->blocks[slot]);
+        }
+
+    next:
+        done += to_copy;
+        if (pos + to_copy > file->size) file->size = pos + to_copy;
+    }
+
+    map->mtime = time(NULL);
+    return done; // Return the number of bytes written
+}
+
+ssize_t vfs_write(vfs_state_t* vfs, inode_t* file, const char* data, size_t size) {
+    if (!file) return -1;
+
+    // Data is appended at the end of the file
+    return vfs_pwrite(vfs, file, file->size, data, size);
+}
+
+int vfs_truncate(vfs_state_t* vfs, inode_t* file, size_t size) {
+    if (!file || file->type != FILE_TYPE || vfs_read_only(vfs)) return -1;
+    if (size > (size_t)INODE_BLOCKS * BLOCK_SIZE) {
+        printf("File size limit reached\n");
+        return -1;
+    }
+
+    inode_map_t* map = inode_map(vfs, file);
+
+    // Growing only moves the end of file: the new range is a hole
+    if (size < file->size) {
+        if (file->flags & INODE_COMPRESSED) {
+            for (uint32_t c = 0; c < INODE_CLUSTERS; c++) {
+                size_t start = (size_t)c * CLUSTER_SIZE;
+                if (start >= file->size || start + CLUSTER_SIZE <= size) continue;
+
+                vfs_cluster_t* entry = NULL;
+                if (start < size) {
+                    entry = vfs_cluster_load(vfs, file, c);
+                    if (!entry) return -1;
+                    memset(entry->data + (size - start), 0, CLUSTER_SIZE - (size - start));
+                }
+                if (vfs_cluster_store(vfs, file, c, entry ? entry->data : NULL, entry ? size - start : 0) != 0) {
+                    if (entry) entry->inode_id = 0;
+                    return -1;
+                }
+                if (entry) {
+                    entry->block = map->blocks[c * CLUSTER_BLOCKS];
+                    entry->len = map->cluster_len[c];
+                }
+            }
+        } else {
+            for (uint32_t slot = 0; slot < INODE_BLOCKS; slot++) {
+                size_t start = (size_t)slot * BLOCK_SIZE;
+                if (!map->blocks[slot] || start + BLOCK_SIZE <= size) continue;
+
+                if (start >= size) {
+                    vfs_release_block(vfs, map->blocks[slot]);
+                    map->blocks[slot] = 0;
+                } else {
+                    // Zero the cut-off tail so a later extension reads zeros
+                    uint32_t block_id = vfs_block_private(vfs, &map->blocks[slot]);
+                    if (block_id >= vfs->super.block_count) return -1;
+                    memset(vfs->blocks[block_id] + (size - start), 0, BLOCK_SIZE - (size - start));
+                }
+            }
+        }
+    }
+
+    file->size = size;
+    map->mtime = time(NULL);
+    vfs->generation++;
+    return 0;
+}
+
+static ssize_t vfs_read_op(vfs_state_t* vfs, inode_t* file, size_t offset, char* buf, size_t size) {
+    if (!file || file->type != FILE_TYPE || !buf) return -1;
+    if (offset >= file->size) return 0;
+    if (size > file->size - offset) size = file->size - offset;
+
+    size_t done = 0;
+    if (file->flags & INODE_COMPRESSED) {
+        while (done < size) {
+            size_t pos = offset + done;
+            vfs_cluster_t* entry = vfs_cluster_load(vfs, file, pos / CLUSTER_SIZE);
+            if (!entry) break;
+
+            size_t cluster_offset = pos % CLUSTER_SIZE;
+            size_t to_copy = CLUSTER_SIZE - cluster_offset;
+            if (to_copy > size - done) to_copy = size - done;
+
+            memcpy(buf + done, entry->data + cluster_offset, to_copy);
+            done += to_copy;
+        }
+        return done;
+    }
+
+    while (done < size) {
+        size_t pos = offset + done;
+        uint32_t block_id = inode_map(vfs, file)->blocks[pos / BLOCK_SIZE];
+        size_t block_offset = pos % BLOCK_SIZE;
+        size_t to_copy = BLOCK_SIZE - block_offset;
+        if (to_copy > size - done) to_copy = size - done;
+
+        if (block_id == 0) {
+            memset(buf + done, 0, to_copy); // Hole
+        } else if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) {
+            printf("Invalid block %u\n", block_id);
+            break;
+        } else {
+            memcpy(buf + done, vfs->blocks[block_id] + block_offset, to_copy);
+        }
+        done += to_copy;
+    }
+    return done;
+}
+
+int vfs_set_compressed(vfs_state_t* vfs, inode_t* file, int enable) {
+    if (!file || file->type != FILE_TYPE || vfs_read_only(vfs)) return -1;
+    if (!!(file->flags & INODE_COMPRESSED) == !!enable) return 0;
+
+    char* buffer = malloc(IO_BUFFER_SIZE);
+    if (!buffer) {
+        printf("Failed to allocate conversion buffer\n");
+        return -1;
+    }
+
+    // Rewrite the whole file in the new representation
+    ssize_t n = vfs_read(vfs, file, 0, buffer, file->size);
+    if (n < 0 || (size_t)n != file->size) {
+        free(buffer);
+        return -1;
+    }
+
+    inode_map_t* map = inode_map(vfs, file);
+    for (int i = 0; i < INODE_BLOCKS; i++) {
+        if (map->blocks[i]) vfs_release_block(vfs, map->blocks[i]);
+        map->blocks[i] = 0;
+    }
+    memset(map->cluster_len, 0, sizeof(map->cluster_len));
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++) {
+        if (vfs->cluster_cache[i].inode_id == file->id) vfs->cluster_cache[i].inode_id = 0;
+    }
+    file->size = 0;
+    file->flags ^= INODE_COMPRESSED;
+    vfs->generation++;
+
+    int result = (n == 0 || vfs_write(vfs, file, buffer, n) == n) ? 0 : -1;
+    free(buffer);
+    return result;
+}
+
+void vfs_compression_stats(vfs_state_t* vfs) {
+    uint32_t files = 0;
+    uint64_t logical = 0, stored = 0;
+    for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+        inode_t* inode = &vfs->inodes[i];
+        if (inode->id == 0 || !(inode->flags & INODE_COMPRESSED)) continue;
+        files++;
+        logical += inode->size;
+        for (int c = 0; c < INODE_CLUSTERS; c++) stored += vfs->maps[i].cluster_len[c] & ~CLUSTER_RAW;
     }
-    printf("Total: %u items\n", entry_count);
+
+    printf("Compress new files: %s\n", vfs->compress_new ? "on" : "off");
+    printf("Compressed files: %u, %llu bytes stored as %llu (%.2f:1)\n", files,
+           (unsigned long long)logical, (unsigned long long)stored,
+           stored ? (double)logical / stored : 1.0);
+    uint64_t lookups = vfs->cache_hits + vfs->cache_misses;
+    printf("Cluster cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+           (unsigned long long)vfs->cache_hits, (unsigned long long)vfs->cache_misses,
+           lookups ? 100.0 * vfs->cache_hits / lookups : 0.0);
 }
 
 int vfs_cd(vfs_state_t* vfs, const char* path) {
@@ -594,8 +2031,8 @@ int vfs_cd(vfs_state_t* vfs, const char* path) {
     if (strcmp(path, "..") == 0) {
         if (vfs->current_dir == vfs->root) return 0;
 
-        uint32_t block_id = vfs->current_dir->blocks[0];
-        if (block_id >= MAX_BLOCKS || !vfs->blocks[block_id]) return -1;
+        uint32_t block_id = inode_map(vfs, vfs->current_dir)->blocks[0];
+        if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) return -1;
 
         dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
         vfs->current_dir = &vfs->inodes[dir[1].inode_id - 1];
@@ -625,108 +2062,2555 @@ int vfs_cd(vfs_state_t* vfs, const char* path) {
     return 0;
 }
 
-int vfs_save(vfs_state_t* vfs, const char* filename) {
-    FILE* f = fopen(filename, "wb");
+int host_mkdir(const char* path) {
+#ifdef _WIN32
+    if (_mkdir(path) != 0 && GetLastError() != ERROR_ALREADY_EXISTS) return -1;
+#else
+    struct stat st;
+    if (mkdir(path, 0777) != 0 && (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))) return -1;
+#endif
+    return 0;
+}
+
+// Copies one host file into a new VFS file of the current directory
+static int vfs_import_file(vfs_state_t* vfs, const char* host_path, const char* name, char* buffer) {
+    FILE* f = fopen(host_path, "rb");
     if (!f) {
-        perror("Failed to open save file");
+        perror("Failed to open host file");
         return -1;
     }
 
-    // Save super-block
-    if (fwrite(&vfs->super, sizeof(superblock_t), 1, f) != 1) {
-        perror("Failed to write superblock");
+    inode_t* file = vfs_create(vfs, name, FILE_TYPE);
+    if (!file) {
         fclose(f);
         return -1;
     }
 
-    // Save inodes
-    if (fwrite(vfs->inodes, sizeof(inode_t), MAX_FILES, f) != MAX_FILES) {
-        perror("Failed to write inodes");
-        fclose(f);
-        return -1;
+    // One large read per file: a VFS file never exceeds IO_BUFFER_SIZE
+    size_t n = fread(buffer, 1, IO_BUFFER_SIZE, f);
+    if (n > 0 && vfs_write(vfs, file, buffer, n) != (ssize_t)n) {
+        printf("Warning: '%s' truncated to %zu bytes\n", host_path, file->size);
+    } else if (n == IO_BUFFER_SIZE && fgetc(f) != EOF) {
+        printf("Warning: '%s' exceeds %d bytes and was truncated\n", host_path, IO_BUFFER_SIZE);
     }
 
-    // Save data blocks
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (vfs->blocks[i]) {
-            if (fwrite(vfs->blocks[i], BLOCK_SIZE, 1, f) != 1) {
-                perror("Failed to write data block");
-                fclose(f);
-                return -1;
+    fclose(f);
+    return 0;
+}
+
+// Recursively imports the contents of host_dir into the current directory
+static int vfs_import_dir(vfs_state_t* vfs, const char* host_dir, char* buffer) {
+    int count = 0;
+    char host_path[MAX_PATH_LEN];
+
+#ifdef _WIN32
+    char pattern[MAX_PATH_LEN];
+    snprintf(pattern, sizeof(pattern), "%s\\*", host_dir);
+    WIN32_FIND_DATA findFileData;
+    HANDLE hFind = FindFirstFile(pattern, &findFileData);
+    if (hFind == INVALID_HANDLE_VALUE) return -1;
+
+    do {
+        const char* name = findFileData.cFileName;
+        int is_dir = (findFileData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    DIR* dir = opendir(host_dir);
+    if (!dir) return -1;
+
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* name = entry->d_name;
+        struct stat st;
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, name);
+        if (stat(host_path, &st) != 0) continue;
+        int is_dir = S_ISDIR(st.st_mode);
+        if (!is_dir && !S_ISREG(st.st_mode)) continue;
+#endif
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) continue;
+
+        if (!is_name_valid(name) || strlen(name) >= MAX_NAME_LEN) {
+            printf("Skipping '%s': name not allowed in VFS\n", name);
+            continue;
+        }
+        snprintf(host_path, sizeof(host_path), "%s/%s", host_dir, name);
+
+        if (is_dir) {
+            inode_t* sub = vfs_lookup(vfs, name);
+            if (!sub) sub = vfs_create(vfs, name, DIR_TYPE);
+            if (!sub || sub->type != DIR_TYPE) {
+                printf("Skipping directory '%s'\n", host_path);
+                continue;
             }
+
+            // Creating entries may move the inode table, so the parent is kept by id
+            uint32_t parent = vfs->current_dir->id;
+            vfs->current_dir = sub;
+            int sub_count = vfs_import_dir(vfs, host_path, buffer);
+            vfs->current_dir = &vfs->inodes[parent - 1];
+            count += 1 + (sub_count > 0 ? sub_count : 0);
+        } else if (vfs_import_file(vfs, host_path, name, buffer) == 0) {
+            count++;
         }
+#ifdef _WIN32
+    } while (FindNextFile(hFind, &findFileData) != 0);
+    FindClose(hFind);
+#else
     }
+    closedir(dir);
+#endif
+    return count;
+}
 
-    // Save current path
-    size_t path_len = strlen(vfs->current_path) + 1;
-    if (fwrite(vfs->current_path, path_len, 1, f) != 1) {
-        perror("Failed to write current path");
-        fclose(f);
+int vfs_import(vfs_state_t* vfs, const char* host_dir) {
+    if (vfs_read_only(vfs)) return -1;
+
+    char* buffer = malloc(IO_BUFFER_SIZE);
+    if (!buffer) {
+        printf("Failed to allocate import buffer\n");
         return -1;
     }
 
-    fclose(f);
-    return 0;
+    int count = vfs_import_dir(vfs, host_dir, buffer);
+    free(buffer);
+    return count;
 }
 
-int vfs_load(vfs_state_t* vfs, const char* filename) {
-    FILE* f = fopen(filename, "rb");
-    if (!f) {
-        return -1; // File not exist yet
-    }
-
-    // Load super-block
-    if (fread(&vfs->super, sizeof(superblock_t), 1, f) != 1) {
+// Recursively writes a VFS inode to host_path
+static int vfs_export_inode(vfs_state_t* vfs, inode_t* inode, const char* host_path, char* buffer) {
+    if (inode->type == FILE_TYPE) {
+        FILE* f = fopen(host_path, "wb");
+        if (!f) {
+            perror("Failed to create host file");
+            return -1;
+        }
+        ssize_t n = vfs_read(vfs, inode, 0, buffer, inode->size);
+        if (n > 0 && fwrite(buffer, 1, n, f) != (size_t)n) {
+            perror("Failed to write host file");
+            fclose(f);
+            return -1;
+        }
         fclose(f);
-        return -1;
+        return 1;
     }
 
-    // Load inodes
-    if (fread(vfs->inodes, sizeof(inode_t), MAX_FILES, f) != MAX_FILES) {
-        fclose(f);
+    if (host_mkdir(host_path) != 0) {
+        perror("Failed to create host directory");
         return -1;
     }
 
-    // Free existing blocks if any
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (vfs->blocks[i]) {
-            free(vfs->blocks[i]);
-            vfs->blocks[i] = NULL;
-        }
-    }
+    uint32_t block_id = inode_map(vfs, inode)->blocks[0];
+    if (block_id >= vfs->super.block_count || !vfs->blocks[block_id]) return -1;
 
-    // Load data blocks
-    for (int i = 0; i < MAX_BLOCKS; i++) {
-        if (vfs->super.free_blocks[i / 32] & (1 << (i % 32))) {
-            vfs->blocks[i] = malloc(BLOCK_SIZE);
-            if (!vfs->blocks[i]) {
-                perror("Failed to allocate memory for block");
-                fclose(f);
-                return -1;
-            }
-            if (fread(vfs->blocks[i], BLOCK_SIZE, 1, f) != 1) {
-                free(vfs->blocks[i]);
-                vfs->blocks[i] = NULL;
-                fclose(f);
-                return -1;
-            }
-        }
+    dir_entry_t* dir = (dir_entry_t*)vfs->blocks[block_id];
+    uint32_t entry_count = inode->size / sizeof(dir_entry_t);
+    int count = 0;
+    char child_path[MAX_PATH_LEN];
+
+    // Entries 0 and 1 are "." and ".."
+    for (uint32_t i = 2; i < entry_count; i++) {
+        snprintf(child_path, sizeof(child_path), "%s/%s", host_path, dir[i].name);
+        int n = vfs_export_inode(vfs, &vfs->inodes[dir[i].inode_id - 1], child_path, buffer);
+        if (n > 0) count += n;
     }
+    return count + 1;
+}
 
-    // Load current path
-    if (fread(vfs->current_path, MAX_PATH_LEN, 1, f) != 1) {
-        strcpy(vfs->current_path, "/");
+int vfs_export(vfs_state_t* vfs, const char* name, const char* host_dir) {
+    inode_t* inode = vfs_lookup(vfs, name);
+    if (!inode) {
+        printf("'%s' not found\n", name);
+        return -1;
     }
 
-    // Set root and current directory pointers
-    vfs->root = &vfs->inodes[0];
-    if (vfs_cd(vfs, vfs->current_path) != 0) {
-        // Fall-back to root if path is invalid
-        strcpy(vfs->current_path, "/");
-        vfs->current_dir = vfs->root;
+    char* buffer = malloc(IO_BUFFER_SIZE);
+    if (!buffer) {
+        printf("Failed to allocate export buffer\n");
+        return -1;
     }
 
-    fclose(f);
+    int count = vfs_export_inode(vfs, inode, host_dir, buffer);
+    free(buffer);
+    return count;
+}
+
+/* Recursive operations */
+static dir_entry_t* dir_entries(vfs_state_t* vfs, inode_t* dir, uint32_t* count) {
+    uint32_t block_id = inode_map(vfs, dir)->blocks[0];
+    if (dir->type != DIR_TYPE || block_id == 0 || block_id >= vfs->super.block_count || !vfs->blocks[block_id]) return NULL;
+    *count = dir->size / sizeof(dir_entry_t);
+    return (dir_entry_t*)vfs->blocks[block_id];
+}
+
+/* Visits start and everything below it, parents before children, without recursion.
+ * Every child is visited; a path too long for MAX_PATH_LEN is cut and ends in "...".
+ * Returns the number of inodes visited, or -1 if the walk could not cover the tree. */
+int vfs_walk(vfs_state_t* vfs, inode_t* start, const char* start_path, vfs_visit_fn visit, void* ctx) {
+    typedef struct {
+        uint32_t inode_id;
+        char path[MAX_PATH_LEN];
+    } walk_frame_t;
+
+    uint32_t capacity = 64;
+    walk_frame_t* stack = malloc(capacity * sizeof(walk_frame_t));
+    uint8_t* visited = calloc(vfs->super.inode_count, 1); // Guards against loops in a damaged tree
+    if (!stack || !visited) {
+        printf("Failed to allocate walk stack\n");
+        free(stack);
+        free(visited);
+        return -1;
+    }
+
+    uint32_t top = 0;
+    int count = 0;
+    stack[top].inode_id = start->id;
+    snprintf(stack[top++].path, MAX_PATH_LEN, "%s", start_path);
+    visited[start->id - 1] = 1;
+
+    int result = 0;
+    while (top > 0 && result == 0) {
+        walk_frame_t frame = stack[--top];
+        inode_t* inode = &vfs->inodes[frame.inode_id - 1];
+        count++;
+        if (visit(vfs, inode, frame.path, ctx) != 0) break;
+
+        uint32_t entry_count;
+        dir_entry_t* dir = dir_entries(vfs, inode, &entry_count);
+        if (!dir) continue;
+
+        // Entries 0 and 1 are "." and ".."
+        for (uint32_t i = 2; i < entry_count; i++) {
+            uint32_t id = dir[i].inode_id;
+            if (id == 0 || id > vfs->super.inode_count || visited[id - 1]) continue;
+            if (top == capacity) {
+                walk_frame_t* grown = realloc(stack, 2 * capacity * sizeof(walk_frame_t));
+                if (!grown) {
+                    printf("Failed to grow walk stack\n");
+                    result = -1;
+                    break;
+                }
+                stack = grown;
+                capacity *= 2;
+            }
+            visited[id - 1] = 1;
+
+            // The inode is walked whatever its path; only the reported path is cut short
+            walk_frame_t* child = &stack[top++];
+            child->inode_id = id;
+            int len = snprintf(child->path, MAX_PATH_LEN, "%s%s%s", frame.path,
+                               strcmp(frame.path, "/") == 0 ? "" : "/", dir[i].name);
+            if (len < 0 || len >= MAX_PATH_LEN) strcpy(child->path + MAX_PATH_LEN - 4, "...");
+        }
+    }
+
+    free(stack);
+    free(visited);
+    return result == 0 ? count : -1;
+}
+
+static int du_visit(vfs_state_t* vfs, inode_t* inode, const char* path, void* ctx) {
+    vfs_usage_t* usage = ctx;
+    (void)path;
+
+    if (inode->type == DIR_TYPE) {
+        usage->dirs++;
+    } else {
+        usage->files++;
+        usage->bytes += inode->size;
+    }
+    for (int i = 0; i < INODE_BLOCKS; i++) {
+        if (inode_map(vfs, inode)->blocks[i]) usage->blocks++;
+    }
+    return 0;
+}
+
+int vfs_du(vfs_state_t* vfs, const char* name, vfs_usage_t* usage) {
+    inode_t* start = vfs_lookup(vfs, name);
+    if (!start) return -1;
+
+    memset(usage, 0, sizeof(*usage));
+    return vfs_walk(vfs, start, name, du_visit, usage) < 0 ? -1 : 0;
+}
+
+// Shell-style wildcard match supporting '*' and '?'
+static int name_match(const char* pattern, const char* name) {
+    const char* star = NULL;
+    const char* resume = NULL;
+    while (*name) {
+        if (*pattern == '?' || *pattern == *name) {
+            pattern++;
+            name++;
+        } else if (*pattern == '*') {
+            star = pattern++;
+            resume = name;
+        } else if (star) {
+            pattern = star + 1;
+            name = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pattern == '*') pattern++;
+    return *pattern == '\0';
+}
+
+static int find_visit(vfs_state_t* vfs, inode_t* inode, const char* path, void* ctx) {
+    vfs_find_t* query = ctx;
+    const char* base = strrchr(path, '/');
+    base = base ? base + 1 : path;
+
+    if (query->pattern[0] && !name_match(query->pattern, base)) return 0;
+    if (inode->size < query->min_size || (query->max_size && inode->size > query->max_size)) return 0;
+    if (query->newer_than && inode_map(vfs, inode)->mtime < query->newer_than &&
+        inode_map(vfs, inode)->ctime < query->newer_than) return 0;
+
+    printf("%-40s %-5s %8zu\n", path, inode->type == DIR_TYPE ? "DIR" : "FILE", inode->size);
+    query->matches++;
+    return 0;
+}
+
+int vfs_find(vfs_state_t* vfs, const char* name, vfs_find_t* query) {
+    inode_t* start = vfs_lookup(vfs, name);
+    if (!start) return -1;
+
+    query->matches = 0;
+    return vfs_walk(vfs, start, strcmp(name, ".") == 0 ? vfs->current_path : name, find_visit, query) < 0 ? -1 : 0;
+}
+
+static int collect_visit(vfs_state_t* vfs, inode_t* inode, const char* path, void* ctx) {
+    uint32_t* ids = ctx;
+    (void)vfs;
+    (void)path;
+    ids[++ids[0]] = inode->id;
+    return 0;
+}
+
+int vfs_remove_tree(vfs_state_t* vfs, const char* name) {
+    if (!name || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) return -1;
+    if (vfs_read_only(vfs)) return -3;
+
+    inode_t* target = vfs_lookup(vfs, name);
+    if (!target) return -1;
+    if (target->type != DIR_TYPE) return vfs_unlink(vfs, name) == 0 ? 1 : -1;
+
+    // ids[0] is the count; the target itself comes first
+    uint32_t* ids = calloc((size_t)vfs->super.inode_count + 1, sizeof(uint32_t));
+    if (!ids) return -1;
+    if (vfs_walk(vfs, target, name, collect_visit, ids) < 0) {
+        free(ids);
+        return -2;
+    }
+
+    // Nothing is freed unless the walk collected every inode the subtree links to
+    uint8_t* collected = calloc(vfs->super.inode_count, 1);
+    uint32_t* batch = malloc((size_t)ids[0] * INODE_BLOCKS * sizeof(uint32_t));
+    int complete = collected && batch;
+    for (uint32_t i = 1; complete && i <= ids[0]; i++) collected[ids[i] - 1] = 1;
+    for (uint32_t i = 1; complete && i <= ids[0]; i++) {
+        uint32_t entry_count;
+        dir_entry_t* dir = dir_entries(vfs, &vfs->inodes[ids[i] - 1], &entry_count);
+        for (uint32_t j = 2; dir && j < entry_count; j++) {
+            uint32_t id = dir[j].inode_id;
+            if (id && id <= vfs->super.inode_count && !collected[id - 1]) complete = 0;
+        }
+    }
+    free(collected);
+    if (!complete) {
+        free(batch);
+        free(ids);
+        return -2;
+    }
+    size_t batch_len = 0;
+    for (uint32_t i = 2; i <= ids[0]; i++) {
+        inode_t* inode = &vfs->inodes[ids[i] - 1];
+        inode_map_t* map = &vfs->maps[ids[i] - 1];
+        for (int j = 0; j < INODE_BLOCKS; j++) {
+            if (map->blocks[j]) batch[batch_len++] = map->blocks[j];
+        }
+        for (int j = 0; j < CLUSTER_CACHE_SLOTS; j++) {
+            if (vfs->cluster_cache[j].inode_id == inode->id) vfs->cluster_cache[j].inode_id = 0;
+        }
+        memset(inode, 0, sizeof(inode_t));
+        memset(map, 0, sizeof(inode_map_t));
+    }
+    for (size_t i = 0; i < batch_len; i++) vfs_release_block(vfs, batch[i]);
+    free(batch);
+
+    // The target is now logically empty and goes through the normal unlink path
+    int removed = (int)ids[0];
+    free(ids);
+    target->size = 2 * sizeof(dir_entry_t);
+    if (vfs_unlink(vfs, name) != 0) return -1;
+    return removed;
+}
+
+/* Directory listing */
+// Formats timestamps, calling localtime() only when the hour changes
+typedef struct {
+    time_t hour_start; // Local time offsets only change on hour boundaries
+    char prefix[16]; // "YYYY-MM-DD HH:"
+} time_fmt_t;
+
+static const char* time_fmt(time_fmt_t* tf, time_t t, char* buf, size_t len) {
+    if (tf->prefix[0] == '\0' || t < tf->hour_start || t >= tf->hour_start + 3600) {
+        struct tm* tm = localtime(&t);
+        if (!tm) {
+            snprintf(buf, len, "?");
+            return buf;
+        }
+        strftime(tf->prefix, sizeof(tf->prefix), "%Y-%m-%d %H:", tm);
+        tf->hour_start = t - tm->tm_min * 60 - tm->tm_sec;
+    }
+    unsigned rest = (unsigned)(t - tf->hour_start) % 3600;
+    snprintf(buf, len, "%s%02u:%02u", tf->prefix, rest / 60, rest % 60);
+    return buf;
+}
+
+// Sort key of one entry; "." and ".." are not sorted and stay first
+typedef struct {
+    const char* name;
+    uint16_t pos;
+} dir_sort_t;
+
+static int compare_dir_sort(const void* a, const void* b) {
+    return strcmp(((const dir_sort_t*)a)->name, ((const dir_sort_t*)b)->name);
+}
+
+/* A directory is one block of at most 15 entries, so the sorted view is sorted again on
+ * every open instead of being kept as a persistent index: ordering 13 names costs less
+ * than keeping an index current through create, unlink, repairs and snapshot mounts. */
+int vfs_opendir(vfs_state_t* vfs, inode_t* dir, int sorted, vfs_dir_t* it) {
+    memset(it, 0, sizeof(*it));
+    dir_entry_t* entries = dir ? dir_entries(vfs, dir, &it->count) : NULL;
+    if (!entries) return -1;
+    it->dir = dir;
+    if (!sorted || it->count <= 3) return 0;
+
+    dir_sort_t* keys = malloc(it->count * sizeof(dir_sort_t));
+    it->order = malloc(it->count * sizeof(uint16_t));
+    if (!keys || !it->order) {
+        free(keys);
+        vfs_closedir(it);
+        return -1;
+    }
+    for (uint32_t i = 0; i < it->count; i++) {
+        keys[i].name = entries[i].name;
+        keys[i].pos = (uint16_t)i;
+    }
+    qsort(keys + 2, it->count - 2, sizeof(dir_sort_t), compare_dir_sort);
+    for (uint32_t i = 0; i < it->count; i++) it->order[i] = keys[i].pos;
+    free(keys);
+    return 0;
+}
+
+// Fills up to max entries and returns how many were filled, 0 at the end of the directory
+int vfs_readdir(vfs_state_t* vfs, vfs_dir_t* it, vfs_dirent_t* out, int max) {
+    uint32_t count;
+    dir_entry_t* entries = dir_entries(vfs, it->dir, &count);
+    if (!entries) return 0;
+    if (count < it->count) it->count = count; // Shrunk since opendir
+
+    int filled = 0;
+    while (filled < max && it->pos < it->count) {
+        dir_entry_t* e = &entries[it->order ? it->order[it->pos] : it->pos];
+        it->pos++;
+        if (e->inode_id == 0 || e->inode_id > vfs->super.inode_count) continue;
+
+        inode_t* inode = &vfs->inodes[e->inode_id - 1];
+        inode_map_t* map = &vfs->maps[e->inode_id - 1];
+        vfs_dirent_t* d = &out[filled++];
+        memcpy(d->name, e->name, MAX_NAME_LEN);
+        d->inode_id = e->inode_id;
+        d->type = inode->type;
+        d->size = inode->size;
+        d->mtime = map->mtime ? map->mtime : map->ctime;
+    }
+    return filled;
+}
+
+void vfs_closedir(vfs_dir_t* it) {
+    free(it->order);
+    it->order = NULL;
+    it->pos = it->count = 0;
+}
+
+/* Lists the current directory in batches; pattern may be NULL or empty for everything.
+ * With a page size, waits for Enter after each page ('q' stops). Returns entries shown. */
+int vfs_list(vfs_state_t* vfs, const char* pattern, int sorted, uint32_t page_size) {
+    vfs_dir_t it;
+    if (!vfs->current_dir || vfs_opendir(vfs, vfs->current_dir, sorted, &it) != 0) {
+        printf("Directory data invalid\n");
+        return -1;
+    }
+
+    vfs_dirent_t* batch = malloc(LS_BATCH * sizeof(vfs_dirent_t));
+    if (!batch) {
+        vfs_closedir(&it);
+        return -1;
+    }
+
+    printf("\nContents of %s:\n", vfs->current_path);
+    printf("%-20s %-8s %10s  %s\n", "Name", "Type", "Size", "Modified");
+    printf("--------------------------------------------------------\n");
+
+    time_fmt_t tf = {0};
+    char time_buf[32];
+    uint32_t shown = 0;
+    int n, stop = 0;
+    while (!stop && (n = vfs_readdir(vfs, &it, batch, LS_BATCH)) > 0) {
+        for (int i = 0; i < n && !stop; i++) {
+            if (pattern && pattern[0] && !name_match(pattern, batch[i].name)) continue;
+            printf("%-20s %-8s %10zu  %s\n", batch[i].name, batch[i].type == DIR_TYPE ? "DIR" : "FILE",
+                   batch[i].size, time_fmt(&tf, batch[i].mtime, time_buf, sizeof(time_buf)));
+
+            if (page_size && ++shown % page_size == 0 && (i + 1 < n || it.pos < it.count)) {
+                printf("-- More (Enter to continue, q to stop) --");
+                int c = getchar();
+                if (c != '\n' && c != EOF) clear_input_buffer();
+                stop = (c == 'q' || c == EOF);
+            } else if (!page_size) {
+                shown++;
+            }
+        }
+    }
+    printf("Total: %u items\n", shown);
+
+    free(batch);
+    vfs_closedir(&it);
+    return shown;
+}
+
+void vfs_ls(vfs_state_t* vfs) {
+    vfs_list(vfs, NULL, 0, 0);
+}
+
+int vfs_read_only(vfs_state_t* vfs) {
+    if (vfs->mounted < 0) return 0;
+    printf("Snapshot '%s' is mounted read-only\n", vfs->snapshots[vfs->mounted]->name);
+    return 1;
+}
+
+static void snapshot_free(vfs_snapshot_t* snap) {
+    if (!snap) return;
+    free(snap->inodes);
+    free(snap->maps);
+    free(snap);
+}
+
+// Adds delta to the reference count of every block used by an inode table
+static void vfs_ref_inodes(vfs_state_t* vfs, const inode_t* inodes, const inode_map_t* maps, uint32_t count, int delta) {
+    for (uint32_t i = 0; i < count; i++) {
+        if (inodes[i].id == 0) continue;
+        for (int j = 0; j < INODE_BLOCKS; j++) {
+            uint32_t block_id = maps[i].blocks[j];
+            if (block_id == 0) continue;
+            if (block_id >= vfs->super.block_count) continue;
+            if (delta > 0) {
+                vfs->super.block_refs[block_id]++;
+            } else {
+                vfs_release_block(vfs, block_id);
+            }
+        }
+    }
+}
+
+// Snapshot with empty tables of count inodes
+static vfs_snapshot_t* snapshot_alloc(uint32_t count) {
+    vfs_snapshot_t* snap = calloc(1, sizeof(vfs_snapshot_t));
+    if (!snap) return NULL;
+    snap->inodes = calloc(count, sizeof(inode_t));
+    snap->maps = calloc(count, sizeof(inode_map_t));
+    if (!snap->inodes || !snap->maps) {
+        snapshot_free(snap);
+        return NULL;
+    }
+    return snap;
+}
+
+static int vfs_snapshot_find(vfs_state_t* vfs, const char* name) {
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (vfs->snapshots[i] && strcmp(vfs->snapshots[i]->name, name) == 0) return i;
+    }
+    return -1;
+}
+
+int vfs_snapshot_create(vfs_state_t* vfs, const char* name) {
+    if (vfs_read_only(vfs)) return -1;
+    if (!is_name_valid(name) || vfs_snapshot_find(vfs, name) >= 0) {
+        printf("Invalid or duplicate snapshot name\n");
+        return -1;
+    }
+
+    int index = 0;
+    while (index < MAX_SNAPSHOTS && vfs->snapshots[index]) index++;
+    if (index >= MAX_SNAPSHOTS) {
+        printf("No free snapshot slots\n");
+        return -1;
+    }
+
+    vfs_snapshot_t* snap = snapshot_alloc(vfs->super.inode_count);
+    if (!snap) {
+        printf("Failed to allocate snapshot\n");
+        return -1;
+    }
+
+    // Only the inode table is copied; data blocks become shared copy-on-write
+    strncpy(snap->name, name, MAX_NAME_LEN - 1);
+    snap->name[MAX_NAME_LEN - 1] = '\0';
+    snap->ctime = time(NULL);
+    memcpy(snap->inodes, vfs->inodes, vfs->super.inode_count * sizeof(inode_t));
+    memcpy(snap->maps, vfs->maps, vfs->super.inode_count * sizeof(inode_map_t));
+    vfs_ref_inodes(vfs, snap->inodes, snap->maps, vfs->super.inode_count, 1);
+
+    vfs->snapshots[index] = snap;
+    vfs->generation++;
+    return 0;
+}
+
+int vfs_snapshot_delete(vfs_state_t* vfs, const char* name) {
+    int index = vfs_snapshot_find(vfs, name);
+    if (index < 0) return -1;
+    if (index == vfs->mounted) {
+        printf("Unmount the snapshot first\n");
+        return -2;
+    }
+
+    vfs_ref_inodes(vfs, vfs->snapshots[index]->inodes, vfs->snapshots[index]->maps, vfs->super.inode_count, -1);
+    snapshot_free(vfs->snapshots[index]);
+    vfs->snapshots[index] = NULL;
+    vfs->generation++;
+    return 0;
+}
+
+int vfs_snapshot_mount(vfs_state_t* vfs, const char* name) {
+    int index = vfs_snapshot_find(vfs, name);
+    if (index < 0) return -1;
+    if (vfs->mounted >= 0) vfs_snapshot_unmount(vfs);
+
+    inode_t* inodes = malloc(vfs->super.inode_count * sizeof(inode_t));
+    inode_map_t* maps = malloc(vfs->super.inode_count * sizeof(inode_map_t));
+    if (!inodes || !maps) {
+        printf("Failed to allocate inode table\n");
+        free(inodes);
+        free(maps);
+        return -1;
+    }
+
+    // Swap a copy of the snapshot's inode table in; all mutating operations are refused
+    memcpy(inodes, vfs->snapshots[index]->inodes, vfs->super.inode_count * sizeof(inode_t));
+    memcpy(maps, vfs->snapshots[index]->maps, vfs->super.inode_count * sizeof(inode_map_t));
+    vfs->live_inodes = vfs->inodes;
+    vfs->live_maps = vfs->maps;
+    vfs->inodes = inodes;
+    vfs->maps = maps;
+    vfs->root = &vfs->inodes[0];
+    strcpy(vfs->live_path, vfs->current_path);
+    vfs->mounted = index;
+    vfs_cluster_cache_reset(vfs);
+
+    vfs->current_dir = vfs->root;
+    strcpy(vfs->current_path, "/");
+    return 0;
+}
+
+int vfs_snapshot_unmount(vfs_state_t* vfs) {
+    if (vfs->mounted < 0) return -1;
+
+    free(vfs->inodes);
+    free(vfs->maps);
+    vfs->inodes = vfs->live_inodes;
+    vfs->maps = vfs->live_maps;
+    vfs->live_inodes = NULL;
+    vfs->live_maps = NULL;
+    vfs->root = &vfs->inodes[0];
+    vfs->mounted = -1;
+    vfs_cluster_cache_reset(vfs);
+
+    vfs->current_dir = vfs->root;
+    strcpy(vfs->current_path, "/");
+    char path[MAX_PATH_LEN];
+    strcpy(path, vfs->live_path);
+    if (strcmp(path, "/") != 0) {
+        // Re-enter the live working directory one component at a time
+        for (char* part = strtok(path + 1, "/"); part; part = strtok(NULL, "/")) {
+            if (vfs_cd(vfs, part) != 0) break;
+        }
+    }
+    return 0;
+}
+
+void vfs_snapshot_list(vfs_state_t* vfs) {
+    int count = 0;
+    printf("%-20s %-20s %s\n", "Snapshot", "Created", "Status");
+    printf("----------------------------------------\n");
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (!vfs->snapshots[i]) continue;
+        char time_buf[32];
+        strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&vfs->snapshots[i]->ctime));
+        printf("%-20s %-20s %s\n", vfs->snapshots[i]->name, time_buf, i == vfs->mounted ? "mounted" : "");
+        count++;
+    }
+
+    // Blocks referenced more than once are shared between the live tree and snapshots
+    uint32_t used = 0, shared = 0;
+    for (uint32_t i = 0; i < vfs->super.block_count; i++) {
+        if (vfs->super.block_refs[i] > 0) used++;
+        if (vfs->super.block_refs[i] > 1) shared++;
+    }
+    printf("Total: %d snapshots, %u blocks used, %u shared\n", count, used, shared);
+}
+
+// Raw-struct images keep the inode layout from before the hot/cold split
+static void inodes_unpack(const inode_disk_t* in, inode_t* inodes, inode_map_t* maps) {
+    for (int i = 0; i < LEGACY_FILES; i++) {
+        inodes[i].id = in[i].id;
+        inodes[i].type = in[i].type;
+        inodes[i].size = in[i].size;
+        inodes[i].flags = in[i].flags;
+        maps[i].ctime = in[i].ctime;
+        maps[i].mtime = in[i].mtime;
+        memcpy(maps[i].blocks, in[i].blocks, sizeof(maps[i].blocks));
+        memcpy(maps[i].cluster_len, in[i].cluster_len, sizeof(maps[i].cluster_len));
+    }
+}
+
+/* Image format: all integers little-endian.
+ *   header   magic u32, version u32, section count u32, CRC-32 of the section table u32
+ *   table    per section: type u32, record count u32, offset u64, length u64, CRC-32 u32, 0 u32
+ *   sections in the order of image_section_type; readers skip types they do not know */
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    for (int i = 0; i < 4; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_u64(uint8_t* p, uint64_t v) {
+    for (int i = 0; i < 8; i++) p[i] = (uint8_t)(v >> (8 * i));
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_u64(const uint8_t* p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+// Standard CRC-32 (as in zip and PNG), continued from a previous result
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t len) {
+    static uint32_t table[256];
+    if (table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+// 64-bit file offsets on every platform
+static int image_seek(FILE* f, uint64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(f, (__int64)offset, SEEK_SET);
+#else
+    return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static uint64_t image_tell(FILE* f) {
+#ifdef _WIN32
+    return (uint64_t)_ftelli64(f);
+#else
+    return (uint64_t)ftello(f);
+#endif
+}
+
+// Copies all of f to filename, so an image can be kept before a repair changes it
+static int image_copy(FILE* f, const char* filename) {
+    FILE* out = fopen(filename, "wb");
+    char* buf = malloc(IMAGE_IO_BUFFER);
+    int ok = out && buf && image_seek(f, 0) == 0;
+    size_t n;
+    while (ok && (n = fread(buf, 1, IMAGE_IO_BUFFER, f)) > 0) {
+        ok = fwrite(buf, 1, n, out) == n;
+    }
+    if (ferror(f)) ok = 0;
+    if (out && fclose(out) != 0) ok = 0;
+    if (out && !ok) remove(filename);
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+static void inodes_encode(uint8_t* out, const inode_t* inodes, const inode_map_t* maps, uint32_t count) {
+    memset(out, 0, (size_t)count * IMAGE_INODE_SIZE);
+    for (uint32_t i = 0; i < count; i++, out += IMAGE_INODE_SIZE) {
+        put_u32(out, inodes[i].id);
+        put_u32(out + 4, (uint32_t)inodes[i].type);
+        put_u32(out + 8, inodes[i].flags);
+        put_u64(out + 16, inodes[i].size);
+        put_u64(out + 24, (uint64_t)(int64_t)maps[i].ctime);
+        put_u64(out + 32, (uint64_t)(int64_t)maps[i].mtime);
+        for (int j = 0; j < INODE_BLOCKS; j++) put_u32(out + 40 + 4 * j, maps[i].blocks[j]);
+        for (int c = 0; c < INODE_CLUSTERS; c++) put_u16(out + 104 + 2 * c, maps[i].cluster_len[c]);
+    }
+}
+
+static void inodes_decode(const uint8_t* in, inode_t* inodes, inode_map_t* maps, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, in += IMAGE_INODE_SIZE) {
+        inodes[i].id = get_u32(in);
+        inodes[i].type = get_u32(in + 4) == DIR_TYPE ? DIR_TYPE : FILE_TYPE;
+        inodes[i].flags = get_u32(in + 8);
+        inodes[i].size = (size_t)get_u64(in + 16);
+        maps[i].ctime = (time_t)(int64_t)get_u64(in + 24);
+        maps[i].mtime = (time_t)(int64_t)get_u64(in + 32);
+        for (int j = 0; j < INODE_BLOCKS; j++) maps[i].blocks[j] = get_u32(in + 40 + 4 * j);
+        for (int c = 0; c < INODE_CLUSTERS; c++) maps[i].cluster_len[c] = get_u16(in + 104 + 2 * c);
+    }
+}
+
+// Appends bytes to the open section, keeping its length and checksum current
+static int image_write(FILE* f, image_section_t* section, const void* data, size_t len) {
+    if (len && fwrite(data, len, 1, f) != 1) return -1;
+    section->length += len;
+    section->crc = crc32_update(section->crc, data, len);
+    return 0;
+}
+
+// Appends an inode table, encoded IMAGE_CHUNK entries at a time
+static int image_write_inodes(FILE* f, image_section_t* section, uint8_t* buf,
+                              const inode_t* inodes, const inode_map_t* maps, uint32_t count) {
+    for (uint32_t i = 0; i < count; i += IMAGE_CHUNK) {
+        uint32_t n = (count - i < IMAGE_CHUNK) ? count - i : IMAGE_CHUNK;
+        inodes_encode(buf, inodes + i, maps + i, n);
+        if (image_write(f, section, buf, (size_t)n * IMAGE_INODE_SIZE) != 0) return -1;
+    }
+    return 0;
+}
+
+/* Writes an image to filename. Touches nothing but the image, so it may run on another
+ * thread. Returns -1 with errno set on failure. */
+static int image_save(const vfs_image_t* image, const char* filename, uint64_t* bytes) {
+    FILE* f = fopen(filename, "wb");
+    if (!f) return -1;
+
+    // Tables are encoded in chunks through one buffer; any size of file system fits
+    uint8_t* buf = malloc((size_t)IMAGE_CHUNK * IMAGE_INODE_SIZE);
+    char* io = malloc(IMAGE_IO_BUFFER);
+    if (!buf || !io) {
+        free(buf);
+        free(io);
+        fclose(f);
+        errno = ENOMEM;
+        return -1;
+    }
+    setvbuf(f, io, _IOFBF, IMAGE_IO_BUFFER);
+
+    // Header and section table are written last, once offsets and checksums are known
+    image_section_t sections[SECTION_LIMIT - 1];
+    uint8_t head[IMAGE_HEADER_SIZE + (SECTION_LIMIT - 1) * IMAGE_SECTION_SIZE] = {0};
+    memset(sections, 0, sizeof(sections));
+    int ok = fwrite(head, sizeof(head), 1, f) == 1;
+
+    for (int type = SECTION_GEOMETRY; ok && type < SECTION_LIMIT; type++) {
+        image_section_t* section = &sections[type - 1];
+        section->type = type;
+        section->offset = image_tell(f);
+
+        switch (type) {
+            case SECTION_GEOMETRY:
+                put_u32(buf, BLOCK_SIZE);
+                put_u32(buf + 4, image->block_count);
+                put_u32(buf + 8, image->inode_count);
+                put_u32(buf + 12, INODE_BLOCKS);
+                put_u32(buf + 16, CLUSTER_BLOCKS);
+                section->count = 1;
+                ok = image_write(f, section, buf, 20) == 0;
+                break;
+
+            case SECTION_REFS:
+                for (uint32_t i = 0; ok && i < image->block_count; i += IMAGE_CHUNK) {
+                    uint32_t n = (image->block_count - i < IMAGE_CHUNK) ? image->block_count - i : IMAGE_CHUNK;
+                    for (uint32_t k = 0; k < n; k++) put_u32(buf + 4 * k, image->block_refs[i + k]);
+                    ok = image_write(f, section, buf, (size_t)n * 4) == 0;
+                }
+                section->count = image->block_count;
+                break;
+
+            case SECTION_INODES:
+                section->count = image->inode_count;
+                ok = image_write_inodes(f, section, buf, image->inodes, image->maps, image->inode_count) == 0;
+                break;
+
+            case SECTION_DATA:
+                for (uint32_t i = 1; ok && i < image->block_count; i++) {
+                    if (image->block_refs[i] == 0 || !image->blocks[i]) continue;
+                    section->count++;
+                    ok = image_write(f, section, image->blocks[i], BLOCK_SIZE) == 0;
+                }
+                break;
+
+            case SECTION_SNAPSHOTS:
+                for (int i = 0; ok && i < MAX_SNAPSHOTS; i++) {
+                    const vfs_snapshot_t* snap = image->snapshots[i];
+                    if (!snap) continue;
+                    memcpy(buf, snap->name, MAX_NAME_LEN);
+                    buf[MAX_NAME_LEN - 1] = 0;
+                    put_u64(buf + MAX_NAME_LEN, (uint64_t)(int64_t)snap->ctime);
+                    section->count++;
+                    ok = image_write(f, section, buf, MAX_NAME_LEN + 8) == 0 &&
+                         image_write_inodes(f, section, buf, snap->inodes, snap->maps, image->inode_count) == 0;
+                }
+                break;
+
+            case SECTION_PATH:
+                section->count = 1;
+                ok = image_write(f, section, image->path, strlen(image->path)) == 0;
+                break;
+        }
+    }
+    free(buf);
+
+    uint8_t* table = head + IMAGE_HEADER_SIZE;
+    for (int i = 0; i < SECTION_LIMIT - 1; i++) {
+        uint8_t* entry = table + i * IMAGE_SECTION_SIZE;
+        put_u32(entry, sections[i].type);
+        put_u32(entry + 4, sections[i].count);
+        put_u64(entry + 8, sections[i].offset);
+        put_u64(entry + 16, sections[i].length);
+        put_u32(entry + 24, sections[i].crc);
+    }
+    put_u32(head, VFS_MAGIC);
+    put_u32(head + 4, VFS_VERSION);
+    put_u32(head + 8, SECTION_LIMIT - 1);
+    put_u32(head + 12, crc32_update(0, table, (SECTION_LIMIT - 1) * IMAGE_SECTION_SIZE));
+
+    *bytes = image_tell(f);
+    if (!ok || image_seek(f, 0) != 0 || fwrite(head, sizeof(head), 1, f) != 1) {
+        int error = errno;
+        fclose(f);
+        free(io);
+        errno = error;
+        return -1;
+    }
+    int result = fclose(f);
+    free(io);
+    return result == 0 ? 0 : -1;
+}
+
+static int vfs_save_op(vfs_state_t* vfs, const char* filename) {
+    // A mounted snapshot is only a view; the live tree is what gets saved
+    int mounted = vfs->mounted >= 0;
+    vfs_image_t image = {
+        vfs->super.block_count, vfs->super.inode_count, vfs->super.block_refs, vfs->blocks,
+        mounted ? vfs->live_inodes : vfs->inodes, mounted ? vfs->live_maps : vfs->maps,
+        vfs->snapshots, mounted ? vfs->live_path : vfs->current_path,
+    };
+
+    uint64_t total = 0;
+    if (image_save(&image, filename, &total) != 0) {
+        perror("Failed to write image");
+        return -1;
+    }
+    vfs->stats.ops[OP_SAVE].bytes += total;
+    return 0;
+}
+
+// Releases every block, snapshot and table; the geometry drops to zero
+static void vfs_free_tables(vfs_state_t* vfs) {
+    for (uint32_t i = 0; i < vfs->super.block_count; i++) free(vfs->blocks[i]);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        snapshot_free(vfs->snapshots[i]);
+        vfs->snapshots[i] = NULL;
+    }
+    if (vfs->mounted >= 0) {
+        free(vfs->live_inodes);
+        free(vfs->live_maps);
+        vfs->live_inodes = NULL;
+        vfs->live_maps = NULL;
+        vfs->mounted = -1;
+    }
+    free(vfs->super.free_blocks);
+    free(vfs->super.block_refs);
+    free(vfs->blocks);
+    free(vfs->block_hash);
+    free(vfs->dedup_table);
+    free(vfs->inodes);
+    free(vfs->maps);
+    free(vfs->defrag_order);
+    vfs->super.free_blocks = NULL;
+    vfs->super.block_refs = NULL;
+    vfs->blocks = NULL;
+    vfs->block_hash = NULL;
+    vfs->dedup_table = NULL;
+    vfs->dedup_mask = 0;
+    vfs->inodes = NULL;
+    vfs->maps = NULL;
+    vfs->defrag_order = NULL;
+    vfs->super.block_count = 0;
+    vfs->super.inode_count = 0;
+    vfs->root = NULL;
+    vfs->current_dir = NULL;
+}
+
+/* The first build gave every new file an empty block in slot 0 and wrote each piece of
+ * data into the next empty slot, at offset size % BLOCK_SIZE. Moves such data so byte n
+ * is in slot n / BLOCK_SIZE and drops the empty block. Files already written that way
+ * (one slot per started block) are left alone. buffer holds IO_BUFFER_SIZE bytes. */
+static void legacy_convert_file(vfs_state_t* vfs, inode_t* inode, inode_map_t* map, uint8_t* buffer) {
+    uint32_t* slots = map->blocks;
+    size_t needed = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint32_t data[INODE_BLOCKS];
+    size_t count = 0;
+    for (int j = 1; j < INODE_BLOCKS; j++) {
+        if (slots[j]) data[count++] = slots[j];
+    }
+    if (!slots[0] || count + 1 <= needed || inode->size > IO_BUFFER_SIZE) return;
+
+    // A write filled its slots from size % BLOCK_SIZE on; menu text has no NUL bytes,
+    // so the data of a slot ends at the first NUL or the end of the block
+    size_t pos = 0;
+    memset(buffer, 0, needed * BLOCK_SIZE);
+    for (size_t k = 0; k < count && pos < inode->size; k++) {
+        const uint8_t* block = vfs->blocks[data[k]];
+        if (data[k] >= vfs->super.block_count || !block) break;
+        size_t start = pos % BLOCK_SIZE, len = BLOCK_SIZE - start;
+        const uint8_t* end = memchr(block + start, 0, len);
+        if (end && k + 1 < count) len = (size_t)(end - (block + start));
+        if (len > inode->size - pos) len = inode->size - pos;
+        memcpy(buffer + pos, block + start, len);
+        pos += len;
+    }
+
+    vfs_release_block(vfs, slots[0]);
+    memset(slots, 0, INODE_BLOCKS * sizeof(uint32_t));
+    if (pos != inode->size) {
+        // Not text: keep the blocks in order, one slot down
+        memcpy(slots, data, count * sizeof(uint32_t));
+        return;
+    }
+    for (size_t j = 0; j < count; j++) {
+        if (j < needed) {
+            memcpy(vfs->blocks[data[j]], buffer + j * BLOCK_SIZE, BLOCK_SIZE);
+            slots[j] = data[j];
+        } else {
+            vfs_release_block(vfs, data[j]);
+        }
+    }
+}
+
+// Images written as raw structs (V0 and V1); f is positioned at the start
+static int vfs_load_legacy(vfs_state_t* vfs, FILE* f) {
+    uint32_t header[2];
+    if (fread(header, sizeof(header), 1, f) != 1 || header[1] != BLOCK_SIZE) {
+        return -1;
+    }
+    if (header[0] != VFS_MAGIC_V1 && header[0] != VFS_MAGIC_V0) {
+        return -1;
+    }
+
+    // Load the superblock and inodes (older images lack reference counts, inode flags and cluster tables)
+    superblock_disk_t* super = calloc(1, sizeof(superblock_disk_t));
+    snapshot_disk_t* disk = calloc(1, sizeof(snapshot_disk_t));
+    if (!super || !disk || vfs_resize(vfs, LEGACY_BLOCKS, LEGACY_FILES) != 0) {
+        free(super);
+        free(disk);
+        return -1;
+    }
+    int ok;
+    if (header[0] == VFS_MAGIC_V1) {
+        rewind(f);
+        ok = fread(super, sizeof(superblock_disk_t), 1, f) == 1 &&
+             fread(disk->inodes, sizeof(inode_disk_t), LEGACY_FILES, f) == LEGACY_FILES;
+    } else {
+        ok = fread(super->free_blocks, sizeof(super->free_blocks), 1, f) == 1;
+        for (int i = 0; ok && i < LEGACY_FILES; i++) {
+            ok = fread(&disk->inodes[i], offsetof(inode_disk_t, flags), 1, f) == 1;
+        }
+        // Every used block has one owner
+        for (int i = 0; i < LEGACY_BLOCKS; i++) {
+            if (super->free_blocks[i / 32] & (1u << (i % 32))) super->block_refs[i] = 1;
+        }
+    }
+    if (ok) {
+        memcpy(vfs->super.free_blocks, super->free_blocks, sizeof(super->free_blocks));
+        for (int i = 0; i < LEGACY_BLOCKS; i++) vfs->super.block_refs[i] = super->block_refs[i];
+        inodes_unpack(disk->inodes, vfs->inodes, vfs->maps);
+    }
+    free(super);
+
+    // Load data blocks (the reserved block 0 has no references and is not stored)
+    for (int i = 0; ok && i < LEGACY_BLOCKS; i++) {
+        if (vfs->super.block_refs[i] > 0) {
+            vfs->blocks[i] = malloc(BLOCK_SIZE);
+            if (!vfs->blocks[i]) {
+                perror("Failed to allocate memory for block");
+                ok = 0;
+            } else if (fread(vfs->blocks[i], BLOCK_SIZE, 1, f) != 1) {
+                ok = 0;
+            }
+        }
+    }
+
+    // Load snapshots
+    uint32_t snapshot_count = 0;
+    if (ok && header[0] == VFS_MAGIC_V1 && fread(&snapshot_count, sizeof(snapshot_count), 1, f) != 1) {
+        ok = 0;
+    }
+    for (uint32_t i = 0; ok && i < snapshot_count && i < MAX_SNAPSHOTS; i++) {
+        vfs->snapshots[i] = snapshot_alloc(LEGACY_FILES);
+        if (!vfs->snapshots[i] || fread(disk, sizeof(snapshot_disk_t), 1, f) != 1) {
+            ok = 0;
+            break;
+        }
+        memcpy(vfs->snapshots[i]->name, disk->name, MAX_NAME_LEN);
+        vfs->snapshots[i]->name[MAX_NAME_LEN - 1] = '\0';
+        vfs->snapshots[i]->ctime = disk->ctime;
+        inodes_unpack(disk->inodes, vfs->snapshots[i]->inodes, vfs->snapshots[i]->maps);
+    }
+    free(disk);
+    if (!ok) return -1;
+
+    // Older images keep the root directory in block 0, which now means "hole"
+    if (vfs->blocks[0]) {
+        uint32_t moved = 1;
+        while (moved < LEGACY_BLOCKS && (vfs->super.free_blocks[moved / 32] & (1u << (moved % 32)))) moved++;
+        if (moved >= LEGACY_BLOCKS) {
+            printf("No free block to relocate the root directory\n");
+            return -1;
+        }
+        vfs->blocks[moved] = vfs->blocks[0];
+        vfs->super.block_refs[moved] = vfs->super.block_refs[0];
+        vfs->super.free_blocks[moved / 32] |= 1u << (moved % 32);
+        vfs->blocks[0] = NULL;
+        vfs->super.block_refs[0] = 0;
+
+        vfs->maps[0].blocks[0] = moved;
+        for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+            if (vfs->snapshots[i] && vfs->snapshots[i]->maps[0].blocks[0] == 0) {
+                vfs->snapshots[i]->maps[0].blocks[0] = moved;
+            }
+        }
+    }
+    vfs->super.free_blocks[0] |= 1;
+
+    // Files of the first build; V1 images only still have the empty block of files never written
+    uint8_t* buffer = malloc(IO_BUFFER_SIZE);
+    if (!buffer) return -1;
+    for (int t = -1; t < MAX_SNAPSHOTS; t++) {
+        if (t >= 0 && !vfs->snapshots[t]) continue;
+        inode_t* inodes = (t < 0) ? vfs->inodes : vfs->snapshots[t]->inodes;
+        inode_map_t* maps = (t < 0) ? vfs->maps : vfs->snapshots[t]->maps;
+        for (uint32_t i = 0; i < LEGACY_FILES; i++) {
+            if (inodes[i].id && inodes[i].type == FILE_TYPE && !(inodes[i].flags & INODE_COMPRESSED)) {
+                legacy_convert_file(vfs, &inodes[i], &maps[i], buffer);
+            }
+        }
+    }
+    free(buffer);
+
+    // Load current path
+    memset(vfs->current_path, 0, MAX_PATH_LEN);
+    if (fread(vfs->current_path, 1, MAX_PATH_LEN - 1, f) == 0) {
+        strcpy(vfs->current_path, "/");
+    }
+    return 0;
+}
+
+// Reference count of block i in a SECTION_REFS of ref_size-byte entries
+static uint32_t image_ref(const uint8_t* refs, uint32_t ref_size, uint32_t i) {
+    return (ref_size == 2) ? get_u16(refs + 2 * (size_t)i) : get_u32(refs + 4 * (size_t)i);
+}
+
+// Reads and verifies every section before anything in vfs is replaced
+static int vfs_load_image(vfs_state_t* vfs, FILE* f) {
+    uint8_t header[IMAGE_HEADER_SIZE];
+    if (fread(header, sizeof(header), 1, f) != 1) return -1;
+    uint32_t version = get_u32(header + 4);
+    if (version == 0 || version > VFS_VERSION) {
+        printf("Unsupported image version %u\n", version);
+        return -1;
+    }
+    uint32_t ref_size = (version == 1) ? 2 : 4;
+
+    uint32_t section_count = get_u32(header + 8);
+    if (section_count == 0 || section_count > 64) return -1;
+    uint8_t* table = malloc((size_t)section_count * IMAGE_SECTION_SIZE);
+    if (!table || fread(table, IMAGE_SECTION_SIZE, section_count, f) != section_count ||
+        crc32_update(0, table, (size_t)section_count * IMAGE_SECTION_SIZE) != get_u32(header + 12)) {
+        printf("Image section table is damaged\n");
+        free(table);
+        return -1;
+    }
+
+    // One bulk read per metadata section, checked against its CRC; data blocks are read last
+    uint8_t* data[SECTION_LIMIT] = {0};
+    image_section_t sections[SECTION_LIMIT];
+    memset(sections, 0, sizeof(sections));
+    int result = 0;
+    for (uint32_t i = 0; i < section_count && result == 0; i++) {
+        const uint8_t* entry = table + i * IMAGE_SECTION_SIZE;
+        uint32_t type = get_u32(entry);
+        if (type == 0 || type >= SECTION_LIMIT || sections[type].type) continue; // Newer or duplicate section
+
+        image_section_t* section = &sections[type];
+        section->type = type;
+        section->count = get_u32(entry + 4);
+        section->offset = get_u64(entry + 8);
+        section->length = get_u64(entry + 16);
+        section->crc = get_u32(entry + 24);
+        if (type == SECTION_DATA) continue;
+        if (section->length > MAX_SNAPSHOTS * IMAGE_SNAPSHOT_SIZE(FILE_LIMIT)) {
+            result = -1;
+            break;
+        }
+
+        data[type] = malloc(section->length ? section->length : 1);
+        if (!data[type] || image_seek(f, section->offset) != 0 ||
+            (section->length && fread(data[type], section->length, 1, f) != 1) ||
+            crc32_update(0, data[type], section->length) != section->crc) {
+            printf("Image section %u is damaged\n", type);
+            result = -1;
+        }
+    }
+    free(table);
+
+    // Block size and per-inode layout must match this build; table sizes come from the image
+    uint32_t blocks = 0, inodes = 0, used = 0;
+    if (result == 0) {
+        for (int type = SECTION_GEOMETRY; type <= SECTION_DATA; type++) {
+            if (!sections[type].type) result = -1;
+        }
+    }
+    if (result == 0) {
+        const uint8_t* g = data[SECTION_GEOMETRY];
+        if (sections[SECTION_GEOMETRY].length >= 20) {
+            blocks = get_u32(g + 4);
+            inodes = get_u32(g + 8);
+        }
+        if (sections[SECTION_GEOMETRY].length < 20 || get_u32(g) != BLOCK_SIZE || get_u32(g + 12) != INODE_BLOCKS ||
+            get_u32(g + 16) != CLUSTER_BLOCKS || blocks < 32 || blocks % 32 || blocks > BLOCK_LIMIT ||
+            inodes == 0 || inodes > FILE_LIMIT) {
+            printf("Image geometry is not supported by this build\n");
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        int refs_ok = sections[SECTION_REFS].length == (uint64_t)blocks * ref_size;
+        for (uint32_t i = 1; i < blocks && refs_ok; i++) {
+            if (image_ref(data[SECTION_REFS], ref_size, i)) used++;
+        }
+        if (!refs_ok || image_ref(data[SECTION_REFS], ref_size, 0) != 0 ||
+            sections[SECTION_INODES].length != (uint64_t)inodes * IMAGE_INODE_SIZE ||
+            sections[SECTION_DATA].length != (uint64_t)used * BLOCK_SIZE ||
+            sections[SECTION_SNAPSHOTS].count > MAX_SNAPSHOTS ||
+            sections[SECTION_SNAPSHOTS].length != sections[SECTION_SNAPSHOTS].count * IMAGE_SNAPSHOT_SIZE(inodes) ||
+            sections[SECTION_PATH].length >= MAX_PATH_LEN) {
+            printf("Image sections have unexpected sizes\n");
+            result = -1;
+        }
+    }
+    if (result == 0 && vfs_resize(vfs, blocks, inodes) != 0) result = -1;
+
+    // Data blocks go straight into place; the CRC is checked once all are read
+    if (result == 0) {
+        uint32_t crc = 0;
+        const uint8_t* refs = data[SECTION_REFS];
+        if (image_seek(f, sections[SECTION_DATA].offset) != 0) result = -1;
+        for (uint32_t i = 1; i < blocks && result == 0; i++) {
+            vfs->super.block_refs[i] = image_ref(refs, ref_size, i);
+            if (vfs->super.block_refs[i] == 0) continue;
+            vfs->super.free_blocks[i / 32] |= 1u << (i % 32);
+            vfs->blocks[i] = malloc(BLOCK_SIZE);
+            if (!vfs->blocks[i]) {
+                perror("Failed to allocate memory for block");
+                result = -1;
+                break;
+            }
+            if (fread(vfs->blocks[i], BLOCK_SIZE, 1, f) != 1) result = -1;
+            crc = crc32_update(crc, vfs->blocks[i], BLOCK_SIZE);
+        }
+        vfs->super.free_blocks[0] |= 1;
+        if (result != 0 || crc != sections[SECTION_DATA].crc) {
+            printf("Image section %u is damaged\n", SECTION_DATA);
+            result = -1;
+        }
+    }
+
+    if (result == 0) {
+        inodes_decode(data[SECTION_INODES], vfs->inodes, vfs->maps, inodes);
+        for (uint32_t i = 0; result == 0 && i < sections[SECTION_SNAPSHOTS].count; i++) {
+            const uint8_t* rec = data[SECTION_SNAPSHOTS] + i * IMAGE_SNAPSHOT_SIZE(inodes);
+            vfs_snapshot_t* snap = snapshot_alloc(inodes);
+            if (!snap) {
+                result = -1;
+                break;
+            }
+            memcpy(snap->name, rec, MAX_NAME_LEN);
+            snap->name[MAX_NAME_LEN - 1] = '\0';
+            snap->ctime = (time_t)(int64_t)get_u64(rec + MAX_NAME_LEN);
+            inodes_decode(rec + MAX_NAME_LEN + 8, snap->inodes, snap->maps, inodes);
+            vfs->snapshots[i] = snap;
+        }
+
+        memset(vfs->current_path, 0, MAX_PATH_LEN);
+        if (data[SECTION_PATH] && sections[SECTION_PATH].length > 0) {
+            memcpy(vfs->current_path, data[SECTION_PATH], sections[SECTION_PATH].length);
+        } else {
+            strcpy(vfs->current_path, "/");
+        }
+    }
+
+    for (int i = 0; i < SECTION_LIMIT; i++) free(data[i]);
+    return result;
+}
+
+static int vfs_load_op(vfs_state_t* vfs, const char* filename) {
+    vfs_checkpoint_wait(vfs); // Its references belong to the state about to be replaced
+    FILE* f = fopen(filename, "rb");
+    if (!f) {
+        return -1; // File not exist yet
+    }
+
+    // Sectioned images are identified by their little-endian magic, older ones by a raw u32
+    uint8_t magic[4];
+    if (fread(magic, sizeof(magic), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
+    rewind(f);
+
+    // The image is loaded into fresh tables and only replaces the current ones once complete
+    vfs_state_t* fresh = calloc(1, sizeof(vfs_state_t));
+    if (!fresh) {
+        fclose(f);
+        return -1;
+    }
+    fresh->mounted = -1;
+    int result = (get_u32(magic) == VFS_MAGIC) ? vfs_load_image(fresh, f) : vfs_load_legacy(fresh, f);
+    if (result != 0) {
+        vfs_free_tables(fresh);
+        free(fresh);
+        fclose(f);
+        return -1;
+    }
+    vfs_free_tables(vfs);
+    vfs->super = fresh->super;
+    vfs->super.magic = VFS_MAGIC;
+    vfs->super.block_size = BLOCK_SIZE;
+    vfs->inodes = fresh->inodes;
+    vfs->maps = fresh->maps;
+    vfs->blocks = fresh->blocks;
+    vfs->block_hash = fresh->block_hash;
+    vfs->dedup_table = fresh->dedup_table;
+    vfs->dedup_mask = fresh->dedup_mask;
+    vfs->defrag_order = fresh->defrag_order;
+    memcpy(vfs->snapshots, fresh->snapshots, sizeof(vfs->snapshots));
+    memcpy(vfs->current_path, fresh->current_path, MAX_PATH_LEN);
+    free(fresh);
+
+    // Set root and current directory pointers
+    vfs->root = &vfs->inodes[0];
+    vfs->current_dir = vfs->root;
+    vfs->mounted = -1;
+    vfs->defrag_active = 0;
+    if (!vfs->skip_load_check) {
+        // Checked read-only first; a repair only runs once the image as found is kept
+        int problems = vfs_check(vfs, 0, 1);
+        char backup[MAX_PATH_LEN + 8];
+        snprintf(backup, sizeof(backup), "%s.bak", filename);
+        if (problems > 0 && image_copy(f, backup) == 0) {
+            vfs_check(vfs, 1, 0);
+            printf("Repaired %d problems in %s; the image as found is kept in %s\n", problems, filename, backup);
+        } else if (problems > 0) {
+            printf("Found %d problems in %s; no copy could be kept in %s, so they are left for fsck --repair\n", problems,
+                   filename, backup);
+        }
+    }
+    vfs_dedup_enable(vfs, vfs->dedup);
+    vfs_cluster_cache_reset(vfs);
+    if (vfs->skip_load_check || vfs_cd(vfs, vfs->current_path) != 0) {
+        // Fall-back to root if path is invalid (or not yet checked)
+        strcpy(vfs->current_path, "/");
+        vfs->current_dir = vfs->root;
+    }
+
+    fseek(f, 0, SEEK_END);
+    vfs->stats.ops[OP_LOAD].bytes += image_tell(f);
+    fclose(f);
+    vfs->saved_generation = vfs->generation;
+    return 0;
+}
+
+/* Statistics */
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void vfs_stat_record(vfs_state_t* vfs, vfs_op_t op, uint64_t start, int ok, uint64_t bytes) {
+    vfs_op_stats_t* st = &vfs->stats.ops[op];
+    uint64_t ns = now_ns() - start;
+
+    // Bucket b holds latencies in [2^(b-1), 2^b) nanoseconds
+    int bucket = 0;
+    for (uint64_t v = ns; v && bucket < STAT_BUCKETS - 1; v >>= 1) bucket++;
+
+    st->calls++;
+    st->failed += !ok;
+    st->total_ns += ns;
+    st->bytes += bytes;
+    st->hist[bucket]++;
+}
+
+inode_t* vfs_create(vfs_state_t* vfs, const char* name, inode_type type) {
+    uint64_t start = now_ns();
+    inode_t* inode = vfs_create_op(vfs, name, type);
+    vfs_stat_record(vfs, OP_CREATE, start, inode != NULL, 0);
+    vfs->generation += inode != NULL;
+    return inode;
+}
+
+inode_t* vfs_lookup(vfs_state_t* vfs, const char* name) {
+    uint64_t start = now_ns();
+    inode_t* inode = vfs_lookup_op(vfs, name);
+    vfs_stat_record(vfs, OP_LOOKUP, start, inode != NULL, 0);
+    return inode;
+}
+
+int vfs_unlink(vfs_state_t* vfs, const char* name) {
+    uint64_t start = now_ns();
+    int result = vfs_unlink_op(vfs, name);
+    vfs_stat_record(vfs, OP_UNLINK, start, result == 0, 0);
+    vfs->generation += result == 0;
+    return result;
+}
+
+ssize_t vfs_pwrite(vfs_state_t* vfs, inode_t* file, size_t offset, const char* data, size_t size) {
+    uint64_t start = now_ns();
+    ssize_t n = vfs_pwrite_op(vfs, file, offset, data, size);
+    vfs_stat_record(vfs, OP_WRITE, start, n >= 0 && (size_t)n == size, n > 0 ? n : 0);
+    vfs->generation += n > 0;
+    return n;
+}
+
+ssize_t vfs_read(vfs_state_t* vfs, inode_t* file, size_t offset, char* buf, size_t size) {
+    uint64_t start = now_ns();
+    ssize_t n = vfs_read_op(vfs, file, offset, buf, size);
+    vfs_stat_record(vfs, OP_READ, start, n >= 0, n > 0 ? n : 0);
+    return n;
+}
+
+int vfs_save(vfs_state_t* vfs, const char* filename) {
+    uint64_t start = now_ns();
+    uint64_t generation = vfs->generation;
+    int result = vfs_save_op(vfs, filename);
+    vfs_stat_record(vfs, OP_SAVE, start, result == 0, 0);
+    if (result == 0) vfs->saved_generation = generation;
+    return result;
+}
+
+int vfs_load(vfs_state_t* vfs, const char* filename) {
+    uint64_t start = now_ns();
+    int result = vfs_load_op(vfs, filename);
+    vfs_stat_record(vfs, OP_LOAD, start, result == 0, 0);
+    return result;
+}
+
+// Upper bound of the histogram bucket holding the given fraction of calls
+static double stat_percentile_us(const vfs_op_stats_t* st, double p) {
+    uint64_t target = (uint64_t)(p * st->calls + 0.5), seen = 0;
+    for (int b = 0; b < STAT_BUCKETS; b++) {
+        seen += st->hist[b];
+        if (seen >= target && seen > 0) return (double)(1ULL << b) / 1000.0;
+    }
+    return 0.0;
+}
+
+void vfs_stats_print(vfs_state_t* vfs, FILE* out, int histograms) {
+    static const char* names[OP_COUNT] = {"create", "lookup", "unlink", "write", "read", "save", "load"};
+
+    fprintf(out, "%-8s %10s %8s %12s %10s %10s %10s\n",
+            "Op", "Calls", "Failed", "Bytes", "Avg us", "p50 us", "p99 us");
+    for (int i = 0; i < OP_COUNT; i++) {
+        const vfs_op_stats_t* st = &vfs->stats.ops[i];
+        fprintf(out, "%-8s %10llu %8llu %12llu %10.2f %10.2f %10.2f\n", names[i],
+                (unsigned long long)st->calls, (unsigned long long)st->failed,
+                (unsigned long long)st->bytes, st->calls ? st->total_ns / 1000.0 / st->calls : 0.0,
+                stat_percentile_us(st, 0.5), stat_percentile_us(st, 0.99));
+    }
+
+    const vfs_stats_t* st = &vfs->stats;
+    fprintf(out, "Allocator: %llu allocations, %.1f avg / %llu max blocks scanned\n",
+            (unsigned long long)st->alloc_calls,
+            st->alloc_calls ? (double)st->alloc_scanned / st->alloc_calls : 0.0,
+            (unsigned long long)st->alloc_max_scan);
+    uint64_t lookups = vfs->cache_hits + vfs->cache_misses;
+    fprintf(out, "Cluster cache: %llu hits, %llu misses (%.1f%% hit rate)\n",
+            (unsigned long long)vfs->cache_hits, (unsigned long long)vfs->cache_misses,
+            lookups ? 100.0 * vfs->cache_hits / lookups : 0.0);
+    fprintf(out, "Dedup: %llu blocks shared on write\n", (unsigned long long)vfs->dedup_hits);
+    fprintf(out, "Capacity: %u blocks (%.1f MB), %u inodes\n", vfs->super.block_count,
+            (double)vfs->super.block_count * BLOCK_SIZE / (1 << 20), vfs->super.inode_count);
+
+    if (!histograms) return;
+    for (int i = 0; i < OP_COUNT; i++) {
+        if (!vfs->stats.ops[i].calls) continue;
+        fprintf(out, "\nLatency histogram: %s\n", names[i]);
+        for (int b = 0; b < STAT_BUCKETS; b++) {
+            if (!vfs->stats.ops[i].hist[b]) continue;
+            fprintf(out, "  < %10.3f us: %llu\n", (double)(1ULL << b) / 1000.0,
+                    (unsigned long long)vfs->stats.ops[i].hist[b]);
+        }
+    }
+}
+
+int vfs_stats_dump(vfs_state_t* vfs, const char* filename) {
+    FILE* f = fopen(filename, "w");
+    if (!f) {
+        perror("Failed to open stats file");
+        return -1;
+    }
+    time_t now = time(NULL);
+    char time_buf[32];
+    strftime(time_buf, sizeof(time_buf), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    fprintf(f, "VFS statistics at %s\n\n", time_buf);
+    vfs_stats_print(vfs, f, 1);
+    fclose(f);
+    return 0;
+}
+
+void vfs_free(vfs_state_t* vfs) {
+    vfs_checkpoint_wait(vfs);
+    vfs_free_tables(vfs);
+    for (int i = 0; i < CLUSTER_CACHE_SLOTS; i++) {
+        free(vfs->cluster_cache[i].data);
+        vfs->cluster_cache[i].data = NULL;
+    }
+}
+
+/* Checkpoints */
+static void checkpoint_write(vfs_checkpoint_t* cp) {
+    // Written beside the image and renamed over it, so an interrupted write leaves the old one
+    char tmp[MAX_PATH_LEN + 8];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cp->filename);
+    vfs_image_t image = {
+        cp->block_count, cp->inode_count, cp->block_refs, cp->blocks, cp->inodes, cp->maps, cp->snapshots, cp->path,
+    };
+
+    uint64_t start = now_ns();
+    cp->result = image_save(&image, tmp, &cp->bytes);
+#ifdef _WIN32
+    if (cp->result == 0) remove(cp->filename); // rename does not replace on Windows
+#endif
+    if (cp->result == 0 && rename(tmp, cp->filename) != 0) cp->result = -1;
+    if (cp->result != 0) {
+        cp->error = errno;
+        remove(tmp);
+    }
+    cp->ns = now_ns() - start;
+}
+
+#ifndef __STDC_NO_THREADS__
+static int checkpoint_thread(void* arg) {
+    vfs_checkpoint_t* cp = arg;
+    checkpoint_write(cp);
+    mtx_lock(&cp->lock);
+    cp->done = 1;
+    mtx_unlock(&cp->lock);
+    return 0;
+}
+#endif
+
+static void checkpoint_free(vfs_checkpoint_t* cp) {
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) snapshot_free(cp->snapshots[i]);
+    free(cp->block_refs);
+    free(cp->blocks);
+    free(cp->inodes);
+    free(cp->maps);
+    free(cp);
+}
+
+// Drops the references held for the checkpoint and records how it went
+static int checkpoint_finish(vfs_state_t* vfs) {
+    vfs_checkpoint_t* cp = vfs->checkpoint;
+#ifndef __STDC_NO_THREADS__
+    if (cp->threaded) {
+        thrd_join(cp->thread, NULL);
+        mtx_destroy(&cp->lock);
+    }
+#endif
+    vfs_ref_inodes(vfs, cp->inodes, cp->maps, cp->inode_count, -1);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (cp->snapshots[i]) vfs_ref_inodes(vfs, cp->snapshots[i]->inodes, cp->snapshots[i]->maps, cp->inode_count, -1);
+    }
+
+    int result = cp->result;
+    if (result == 0) {
+        vfs->checkpoints++;
+        vfs->checkpoint_ns = cp->ns;
+        vfs->checkpoint_bytes = cp->bytes;
+        if (cp->generation > vfs->saved_generation) vfs->saved_generation = cp->generation;
+    } else {
+        printf("Checkpoint to %s failed: %s\n", cp->filename, strerror(cp->error));
+    }
+    checkpoint_free(cp);
+    vfs->checkpoint = NULL;
+    return result;
+}
+
+/* Captures the live tree and snapshots, then writes them on a background thread while
+ * the caller carries on. Returns 0 when started (or written, without thread support),
+ * 1 if a checkpoint is already running and -1 on failure. */
+int vfs_checkpoint_start(vfs_state_t* vfs, const char* filename) {
+    if (vfs->checkpoint) return 1;
+
+    vfs_checkpoint_t* cp = calloc(1, sizeof(vfs_checkpoint_t));
+    if (!cp) {
+        printf("Failed to allocate checkpoint\n");
+        return -1;
+    }
+    uint32_t blocks = vfs->super.block_count, inodes = vfs->super.inode_count;
+    cp->block_count = blocks;
+    cp->inode_count = inodes;
+    cp->block_refs = malloc(blocks * sizeof(uint32_t));
+    cp->blocks = malloc(blocks * sizeof(uint8_t*));
+    cp->inodes = malloc(inodes * sizeof(inode_t));
+    cp->maps = malloc(inodes * sizeof(inode_map_t));
+    int ok = cp->block_refs && cp->blocks && cp->inodes && cp->maps;
+    for (int i = 0; ok && i < MAX_SNAPSHOTS; i++) {
+        if (!vfs->snapshots[i]) continue;
+        cp->snapshots[i] = snapshot_alloc(inodes);
+        if (!cp->snapshots[i]) {
+            ok = 0;
+            break;
+        }
+        memcpy(cp->snapshots[i]->name, vfs->snapshots[i]->name, MAX_NAME_LEN);
+        cp->snapshots[i]->ctime = vfs->snapshots[i]->ctime;
+        memcpy(cp->snapshots[i]->inodes, vfs->snapshots[i]->inodes, inodes * sizeof(inode_t));
+        memcpy(cp->snapshots[i]->maps, vfs->snapshots[i]->maps, inodes * sizeof(inode_map_t));
+    }
+    if (!ok) {
+        printf("Failed to allocate checkpoint\n");
+        checkpoint_free(cp);
+        return -1;
+    }
+
+    // Only tables and block pointers are copied; the blocks themselves become copy-on-write
+    int mounted = vfs->mounted >= 0;
+    memcpy(cp->block_refs, vfs->super.block_refs, blocks * sizeof(uint32_t));
+    memcpy(cp->blocks, vfs->blocks, blocks * sizeof(uint8_t*));
+    memcpy(cp->inodes, mounted ? vfs->live_inodes : vfs->inodes, inodes * sizeof(inode_t));
+    memcpy(cp->maps, mounted ? vfs->live_maps : vfs->maps, inodes * sizeof(inode_map_t));
+    strcpy(cp->path, mounted ? vfs->live_path : vfs->current_path);
+    snprintf(cp->filename, sizeof(cp->filename), "%s", filename);
+    cp->generation = vfs->generation;
+    vfs_ref_inodes(vfs, cp->inodes, cp->maps, inodes, 1);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (cp->snapshots[i]) vfs_ref_inodes(vfs, cp->snapshots[i]->inodes, cp->snapshots[i]->maps, inodes, 1);
+    }
+    vfs->checkpoint = cp;
+    vfs->checkpoint_time = time(NULL);
+    crc32_update(0, NULL, 0); // Build the CRC table here rather than on the writer
+
+#ifndef __STDC_NO_THREADS__
+    if (mtx_init(&cp->lock, mtx_plain) == thrd_success) {
+        if (thrd_create(&cp->thread, checkpoint_thread, cp) == thrd_success) {
+            cp->threaded = 1;
+            return 0;
+        }
+        mtx_destroy(&cp->lock);
+    }
+#endif
+    checkpoint_write(cp);
+    return checkpoint_finish(vfs);
+}
+
+// Blocks until the running checkpoint, if any, is on disk
+int vfs_checkpoint_wait(vfs_state_t* vfs) {
+    return vfs->checkpoint ? checkpoint_finish(vfs) : 0;
+}
+
+// Collects a checkpoint whose write has ended; returns 1 while one is still being written
+static int checkpoint_running(vfs_state_t* vfs) {
+    if (!vfs->checkpoint) return 0;
+#ifndef __STDC_NO_THREADS__
+    mtx_lock(&vfs->checkpoint->lock);
+    int done = vfs->checkpoint->done;
+    mtx_unlock(&vfs->checkpoint->lock);
+    if (!done) return 1;
+#endif
+    checkpoint_finish(vfs);
+    return 0;
+}
+
+// Starts the next checkpoint once the interval has passed and something has changed
+void vfs_checkpoint_tick(vfs_state_t* vfs, const char* filename) {
+    if (checkpoint_running(vfs)) return;
+
+    if (vfs->checkpoint_interval > 0 && vfs->generation != vfs->saved_generation &&
+        time(NULL) - vfs->checkpoint_time >= vfs->checkpoint_interval) {
+        vfs_checkpoint_start(vfs, filename);
+    }
+}
+
+void vfs_checkpoint_report(vfs_state_t* vfs) {
+    int running = checkpoint_running(vfs);
+    printf("Checkpoints written: %llu", (unsigned long long)vfs->checkpoints);
+    if (vfs->checkpoints) {
+        printf(", last %llu bytes in %.2f ms", (unsigned long long)vfs->checkpoint_bytes, vfs->checkpoint_ns / 1e6);
+    }
+    printf("\n");
+    if (vfs->checkpoint_interval > 0) {
+        printf("Interval: %d s, ", vfs->checkpoint_interval);
+    } else {
+        printf("Periodic checkpoints off, ");
+    }
+    printf("%s\n", running ? "writing now" :
+                   vfs->generation != vfs->saved_generation ? "unsaved changes" : "up to date");
+}
+
+/* Defragmentation */
+// Slots of every inode table that point at ids from base up, grouped by block id
+typedef struct {
+    uint32_t base;
+    uint32_t* first; // Per id - base: start of its group in slots
+    uint32_t* count;
+    uint32_t** slots;
+} defrag_index_t;
+
+// Collects the inode tables whose maps hold block ids; returns how many
+static int defrag_tables(vfs_state_t* vfs, inode_t** tables, inode_map_t** maps) {
+    int table_count = 0;
+    tables[table_count] = vfs->inodes;
+    maps[table_count++] = vfs->maps;
+    if (vfs->live_inodes) {
+        tables[table_count] = vfs->live_inodes;
+        maps[table_count++] = vfs->live_maps;
+    }
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        // The mounted snapshot is already covered through vfs->inodes
+        if (!vfs->snapshots[i] || i == vfs->mounted) continue;
+        tables[table_count] = vfs->snapshots[i]->inodes;
+        maps[table_count++] = vfs->snapshots[i]->maps;
+    }
+    return table_count;
+}
+
+static void defrag_index_free(defrag_index_t* index) {
+    free(index->first);
+    free(index->count);
+    free(index->slots);
+}
+
+// Indexes the slots that still need placing; ids below the cursor are never moved again
+static int defrag_index_build(vfs_state_t* vfs, defrag_index_t* index) {
+    inode_t* tables[MAX_SNAPSHOTS + 2];
+    inode_map_t* maps[MAX_SNAPSHOTS + 2];
+    int table_count = defrag_tables(vfs, tables, maps);
+    uint32_t base = vfs->defrag_cursor;
+    size_t ids = vfs->super.block_count > base ? vfs->super.block_count - base : 0;
+
+    memset(index, 0, sizeof(*index));
+    index->base = base;
+    index->first = calloc(ids + 1, sizeof(uint32_t));
+    index->count = calloc(ids + 1, sizeof(uint32_t));
+    if (!index->first || !index->count) {
+        defrag_index_free(index);
+        return -1;
+    }
+
+    size_t total = 0;
+    for (int t = 0; t < table_count; t++) {
+        for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+            for (int j = 0; tables[t][i].id && j < INODE_BLOCKS; j++) {
+                uint32_t block_id = maps[t][i].blocks[j];
+                if (block_id < base || block_id >= vfs->super.block_count) continue;
+                index->count[block_id - base]++;
+                total++;
+            }
+        }
+    }
+    index->slots = malloc((total + 1) * sizeof(uint32_t*));
+    if (!index->slots) {
+        defrag_index_free(index);
+        return -1;
+    }
+
+    uint32_t next = 0;
+    for (size_t k = 0; k < ids; k++) {
+        index->first[k] = next;
+        next += index->count[k];
+        index->count[k] = 0;
+    }
+    for (int t = 0; t < table_count; t++) {
+        for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+            for (int j = 0; tables[t][i].id && j < INODE_BLOCKS; j++) {
+                uint32_t block_id = maps[t][i].blocks[j];
+                if (block_id < base || block_id >= vfs->super.block_count) continue;
+                uint32_t k = block_id - base;
+                index->slots[index->first[k] + index->count[k]++] = &maps[t][i].blocks[j];
+            }
+        }
+    }
+    return 0;
+}
+
+// Bucket of the dedup table naming block_id, or NULL if the block is not indexed
+static uint32_t* dedup_entry(vfs_state_t* vfs, uint32_t block_id) {
+    uint64_t h = vfs->block_hash[block_id];
+    if (h == 0) return NULL;
+
+    uint32_t bucket = (uint32_t)h & vfs->dedup_mask;
+    for (uint32_t n = 0; n <= vfs->dedup_mask; n++, bucket = (bucket + 1) & vfs->dedup_mask) {
+        if (vfs->dedup_table[bucket] == 0) break;
+        if (vfs->dedup_table[bucket] == block_id + 1) return &vfs->dedup_table[bucket];
+    }
+    return NULL;
+}
+
+// Exchanges two indexed block ids everywhere: data, counts, bitmap, fingerprints and inode slots
+static void vfs_swap_blocks(vfs_state_t* vfs, defrag_index_t* index, uint32_t a, uint32_t b) {
+    uint8_t* data = vfs->blocks[a];
+    vfs->blocks[a] = vfs->blocks[b];
+    vfs->blocks[b] = data;
+    vfs->generation++;
+
+    uint32_t refs = vfs->super.block_refs[a];
+    vfs->super.block_refs[a] = vfs->super.block_refs[b];
+    vfs->super.block_refs[b] = refs;
+
+    // The dedup buckets stay where the fingerprints put them and take the new ids
+    uint32_t* entry_a = dedup_entry(vfs, a);
+    uint32_t* entry_b = dedup_entry(vfs, b);
+    if (entry_a) *entry_a = b + 1;
+    if (entry_b) *entry_b = a + 1;
+    uint64_t h = vfs->block_hash[a];
+    vfs->block_hash[a] = vfs->block_hash[b];
+    vfs->block_hash[b] = h;
+
+    uint32_t used_a = vfs->super.free_blocks[a / 32] & (1u << (a % 32));
+    uint32_t used_b = vfs->super.free_blocks[b / 32] & (1u << (b % 32));
+    vfs->super.free_blocks[a / 32] &= ~(1u << (a % 32));
+    vfs->super.free_blocks[b / 32] &= ~(1u << (b % 32));
+    if (used_b) vfs->super.free_blocks[a / 32] |= 1u << (a % 32);
+    if (used_a) vfs->super.free_blocks[b / 32] |= 1u << (b % 32);
+
+    uint32_t ka = a - index->base, kb = b - index->base;
+    for (uint32_t k = 0; k < index->count[ka]; k++) *index->slots[index->first[ka] + k] = b;
+    for (uint32_t k = 0; k < index->count[kb]; k++) *index->slots[index->first[kb] + k] = a;
+    uint32_t first = index->first[ka], count = index->count[ka];
+    index->first[ka] = index->first[kb];
+    index->count[ka] = index->count[kb];
+    index->first[kb] = first;
+    index->count[kb] = count;
+}
+
+// Plans a pass: live tree first (directories ahead of their contents), then snapshot-only blocks
+void vfs_defrag_start(vfs_state_t* vfs) {
+    inode_t* inodes = (vfs->mounted >= 0) ? vfs->live_inodes : vfs->inodes;
+    uint8_t* listed = calloc(vfs->super.inode_count, 1);
+    if (!listed) {
+        printf("Failed to allocate defragmentation state\n");
+        return;
+    }
+
+    memset(vfs->defrag_order, 0, ((size_t)vfs->super.inode_count + 1) * sizeof(uint32_t));
+    if (vfs->mounted < 0) {
+        vfs_walk(vfs, vfs->root, "/", collect_visit, vfs->defrag_order);
+    }
+    for (uint32_t i = 1; i <= vfs->defrag_order[0]; i++) listed[vfs->defrag_order[i] - 1] = 1;
+
+    // Inodes the walk could not reach still own blocks
+    for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+        if (inodes[i].id && !listed[i]) vfs->defrag_order[++vfs->defrag_order[0]] = inodes[i].id;
+    }
+    free(listed);
+
+    vfs->defrag_cursor = 1;
+    vfs->defrag_table = 0;
+    vfs->defrag_pos = 0;
+    vfs->defrag_active = 1;
+}
+
+/* Moves blocks into their final place, one inode at a time, until the budget runs out.
+ * The slot index is built once per call, so a whole pass is best run as one call.
+ * Returns 1 while work remains, 0 once the pass is complete and the image is shrunk. */
+int vfs_defrag_step(vfs_state_t* vfs, uint64_t budget_ns) {
+    if (!vfs->defrag_active) return 0;
+    if (vfs->mounted >= 0) return 1; // Paused while a snapshot is mounted
+    if (vfs->checkpoint) return 1; // Moving blocks would invalidate the checkpoint's references
+
+    uint64_t start = now_ns();
+    defrag_index_t index;
+    if (defrag_index_build(vfs, &index) != 0) {
+        printf("Failed to allocate defragmentation state\n");
+        vfs->defrag_active = 0;
+        return 0;
+    }
+    int moved = 0, stopped = 0;
+
+    while (!stopped && vfs->defrag_table <= MAX_SNAPSHOTS) {
+        inode_t* inode = NULL;
+        inode_map_t* map = NULL;
+        uint32_t count = 0;
+        if (vfs->defrag_table == 0) {
+            count = vfs->defrag_order[0];
+            if (vfs->defrag_pos < count) {
+                inode = &vfs->inodes[vfs->defrag_order[vfs->defrag_pos + 1] - 1];
+                map = inode_map(vfs, inode);
+            }
+        } else if (vfs->snapshots[vfs->defrag_table - 1]) {
+            count = vfs->super.inode_count;
+            if (vfs->defrag_pos < count) {
+                inode = &vfs->snapshots[vfs->defrag_table - 1]->inodes[vfs->defrag_pos];
+                map = &vfs->snapshots[vfs->defrag_table - 1]->maps[vfs->defrag_pos];
+            }
+        }
+        if (vfs->defrag_pos >= count) {
+            vfs->defrag_table++;
+            vfs->defrag_pos = 0;
+            continue;
+        }
+
+        // Blocks below the cursor are placed, including those shared with an earlier inode,
+        // so an inode left halfway when the budget runs out is simply resumed
+        for (int j = 0; !stopped && inode->id && j < INODE_BLOCKS; j++) {
+            uint32_t block_id = map->blocks[j];
+            if (block_id == 0 || block_id >= vfs->super.block_count || block_id < vfs->defrag_cursor) continue;
+            if (block_id != vfs->defrag_cursor) {
+                vfs_swap_blocks(vfs, &index, block_id, vfs->defrag_cursor);
+                moved++;
+                stopped = now_ns() - start >= budget_ns;
+            }
+            vfs->defrag_cursor++;
+        }
+        if (stopped) break;
+        vfs->defrag_pos++;
+
+        if (now_ns() - start >= budget_ns) break;
+    }
+    defrag_index_free(&index);
+
+    // Cached clusters are keyed by block id
+    if (moved) vfs_cluster_cache_reset(vfs);
+    if (vfs->defrag_table > MAX_SNAPSHOTS) {
+        vfs->defrag_active = 0;
+        vfs_shrink(vfs);
+    }
+    return vfs->defrag_active;
+}
+
+void vfs_defrag_report(vfs_state_t* vfs) {
+    inode_t* inodes = (vfs->mounted >= 0) ? vfs->live_inodes : vfs->inodes;
+    inode_map_t* maps = (vfs->mounted >= 0) ? vfs->live_maps : vfs->maps;
+    uint32_t used = 0, highest = 0, fragments = 0, files = 0;
+
+    for (uint32_t i = 1; i < vfs->super.block_count; i++) {
+        if (vfs->super.block_refs[i]) {
+            used++;
+            highest = i;
+        }
+    }
+
+    // A fragment is a run of consecutive block ids; holes do not break a run
+    for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+        uint32_t last = 0;
+        int runs = 0;
+        for (int j = 0; inodes[i].id && j < INODE_BLOCKS; j++) {
+            uint32_t block_id = maps[i].blocks[j];
+            if (!block_id) continue;
+            if (block_id != last + 1) runs++;
+            last = block_id;
+        }
+        if (runs > 1) files++;
+        fragments += runs;
+    }
+
+    printf("Blocks in use: %u of %u, highest block id: %u (%u gaps)\n", used, vfs->super.block_count, highest,
+           highest - used);
+    printf("Extents: %u, fragmented files: %u\n", fragments, files);
+    if (vfs->defrag_active) {
+        printf("Defragmentation in progress: %u blocks placed%s\n", vfs->defrag_cursor - 1,
+               vfs->mounted >= 0 ? " (paused while a snapshot is mounted)" : "");
+    }
+}
+
+/* Consistency check */
+static void fsck_report(int verbose, int* problems, const char* fmt, ...) {
+    (*problems)++;
+    if (!verbose) return;
+
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+}
+
+// Block slots and sizes of one inode; bad references become holes
+static void fsck_inode(vfs_state_t* vfs, inode_t* inode, inode_map_t* map, const char* table, int repair, int verbose, int* problems) {
+    size_t max_size = (inode->type == DIR_TYPE) ? BLOCK_SIZE : (size_t)INODE_BLOCKS * BLOCK_SIZE;
+    if (inode->size > max_size) {
+        fsck_report(verbose, problems, "%s: inode %u size %zu too large", table, inode->id, inode->size);
+        if (repair) inode->size = max_size;
+    }
+
+    for (int j = 0; j < INODE_BLOCKS; j++) {
+        uint32_t block_id = map->blocks[j];
+        if (block_id && (block_id >= vfs->super.block_count || !vfs->blocks[block_id])) {
+            fsck_report(verbose, problems, "%s: inode %u references missing block %u", table, inode->id, block_id);
+            if (repair) map->blocks[j] = 0;
+        }
+    }
+
+    // Slots past the end of the data must be holes
+    size_t used_slots;
+    if (inode->type == DIR_TYPE) {
+        used_slots = 1;
+    } else if (inode->flags & INODE_COMPRESSED) {
+        used_slots = (inode->size + CLUSTER_SIZE - 1) / CLUSTER_SIZE * CLUSTER_BLOCKS;
+    } else {
+        used_slots = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+    for (size_t j = used_slots; j < INODE_BLOCKS; j++) {
+        if (map->blocks[j] && map->blocks[j] < vfs->super.block_count && vfs->blocks[map->blocks[j]]) {
+            fsck_report(verbose, problems, "%s: inode %u has block %u past its end", table, inode->id, map->blocks[j]);
+            if (repair) map->blocks[j] = 0;
+        }
+    }
+    if (inode->type == DIR_TYPE || !(inode->flags & INODE_COMPRESSED)) return;
+
+    // A compressed cluster fills exactly the leading slots its stored length needs
+    for (int c = 0; c < INODE_CLUSTERS; c++) {
+        uint32_t* slots = &map->blocks[c * CLUSTER_BLOCKS];
+        size_t stored = map->cluster_len[c] & ~CLUSTER_RAW;
+        size_t needed = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int bad = stored > CLUSTER_SIZE;
+        for (size_t k = 0; !bad && k < CLUSTER_BLOCKS; k++) {
+            if (!!slots[k] != (k < needed)) bad = 1;
+        }
+        if (bad) {
+            fsck_report(verbose, problems, "%s: inode %u cluster %d does not match its blocks", table, inode->id, c);
+            if (repair) {
+                memset(slots, 0, CLUSTER_BLOCKS * sizeof(uint32_t));
+                map->cluster_len[c] = 0;
+            }
+        }
+    }
+}
+
+// Drops inode and everything only it references
+static void fsck_release_inode(vfs_state_t* vfs, inode_t* inode, inode_map_t* map) {
+    for (int j = 0; j < INODE_BLOCKS; j++) {
+        if (map->blocks[j]) vfs_release_block(vfs, map->blocks[j]);
+    }
+    memset(inode, 0, sizeof(inode_t));
+    memset(map, 0, sizeof(inode_map_t));
+}
+
+/* Verifies inode tables, block reference counts and the bitmap, then the live directory tree.
+ * Returns the number of problems found; with repair set they are fixed as they are found. */
+int vfs_check(vfs_state_t* vfs, int repair, int verbose) {
+    int problems = 0;
+    inode_t* live = (vfs->mounted >= 0) ? vfs->live_inodes : vfs->inodes;
+    inode_map_t* live_maps = (vfs->mounted >= 0) ? vfs->live_maps : vfs->maps;
+
+    // Pass 1: every inode table, snapshots included
+    for (int t = -1; t < MAX_SNAPSHOTS; t++) {
+        if (t >= 0 && !vfs->snapshots[t]) continue;
+        inode_t* inodes = (t < 0) ? live : vfs->snapshots[t]->inodes;
+        inode_map_t* maps = (t < 0) ? live_maps : vfs->snapshots[t]->maps;
+        const char* table = (t < 0) ? "live" : vfs->snapshots[t]->name;
+
+        for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+            inode_t* inode = &inodes[i];
+            if (inode->id == 0) continue;
+            if (inode->id != i + 1 || (inode->type != FILE_TYPE && inode->type != DIR_TYPE)) {
+                fsck_report(verbose, &problems, "%s: inode slot %u is corrupt", table, i + 1);
+                if (repair) {
+                    memset(inode, 0, sizeof(inode_t));
+                    memset(&maps[i], 0, sizeof(inode_map_t));
+                }
+                continue;
+            }
+            fsck_inode(vfs, inode, &maps[i], table, repair, verbose, &problems);
+        }
+    }
+
+    // Pass 2: reference counts and bitmap against the inode tables
+    uint32_t* refs = calloc(vfs->super.block_count, sizeof(uint32_t));
+    if (!refs) {
+        printf("Failed to allocate reference table\n");
+        return -1;
+    }
+    for (int t = -1; t < MAX_SNAPSHOTS; t++) {
+        if (t >= 0 && !vfs->snapshots[t]) continue;
+        inode_t* inodes = (t < 0) ? live : vfs->snapshots[t]->inodes;
+        inode_map_t* maps = (t < 0) ? live_maps : vfs->snapshots[t]->maps;
+        for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+            for (int j = 0; j < INODE_BLOCKS; j++) {
+                uint32_t block_id = maps[i].blocks[j];
+                if (inodes[i].id && block_id && block_id < vfs->super.block_count && vfs->blocks[block_id]) refs[block_id]++;
+            }
+        }
+    }
+    for (uint32_t i = 1; i < vfs->super.block_count; i++) {
+        int used = !!(vfs->super.free_blocks[i / 32] & (1u << (i % 32)));
+        if (refs[i] != vfs->super.block_refs[i]) {
+            fsck_report(verbose, &problems, "block %u has %u references, superblock says %u", i, refs[i],
+                        vfs->super.block_refs[i]);
+        }
+        if (used != (refs[i] > 0)) {
+            fsck_report(verbose, &problems, "block %u is marked %s in the bitmap", i, used ? "used" : "free");
+        }
+        if (vfs->blocks[i] && refs[i] == 0) {
+            fsck_report(verbose, &problems, "block %u is allocated but unreferenced", i);
+        }
+        if (!repair) continue;
+
+        vfs->super.block_refs[i] = refs[i];
+        if (refs[i]) {
+            vfs->super.free_blocks[i / 32] |= 1u << (i % 32);
+        } else {
+            free(vfs->blocks[i]);
+            vfs->blocks[i] = NULL;
+            vfs->block_hash[i] = 0;
+            vfs->super.free_blocks[i / 32] &= ~(1u << (i % 32));
+        }
+    }
+    free(refs);
+    if (vfs->super.block_refs[0] || !(vfs->super.free_blocks[0] & 1)) {
+        fsck_report(verbose, &problems, "reserved block 0 is in use");
+        if (repair) {
+            vfs->super.block_refs[0] = 0;
+            vfs->super.free_blocks[0] |= 1;
+        }
+    }
+
+    // Pass 3: live directory tree, breadth first from the root
+    inode_t* root = &live[0];
+    if (root->id != 1 || root->type != DIR_TYPE) {
+        fsck_report(verbose, &problems, "root inode is not a directory");
+        if (!repair) return problems;
+        fsck_release_inode(vfs, root, &live_maps[0]);
+        root->id = 1;
+        root->type = DIR_TYPE;
+        live_maps[0].ctime = time(NULL);
+    }
+
+    uint32_t* queue = calloc(2 * (size_t)vfs->super.inode_count, sizeof(uint32_t));
+    uint8_t* seen = calloc(vfs->super.inode_count, 1);
+    if (!queue || !seen) {
+        printf("Failed to allocate directory walk\n");
+        free(queue);
+        free(seen);
+        return problems + 1;
+    }
+    uint32_t* parent = queue + vfs->super.inode_count;
+    uint32_t head = 0, tail = 0;
+    queue[tail++] = 1;
+    parent[0] = 1;
+    seen[0] = 1;
+
+    while (head < tail) {
+        inode_t* dir = &live[queue[head] - 1];
+        inode_map_t* map = &live_maps[queue[head++] - 1];
+        uint32_t self = dir->id;
+
+        if (!map->blocks[0]) {
+            fsck_report(verbose, &problems, "directory %u has no entry block", self);
+            if (!repair) continue;
+            uint32_t block_id = vfs_alloc_block(vfs, 1);
+            if (block_id >= vfs->super.block_count) goto out_of_space;
+            map->blocks[0] = block_id;
+            dir->size = 0;
+        }
+        if (dir->size % sizeof(dir_entry_t) || dir->size < 2 * sizeof(dir_entry_t)) {
+            fsck_report(verbose, &problems, "directory %u has invalid size %zu", self, dir->size);
+            if (!repair) continue;
+            dir->size -= dir->size % sizeof(dir_entry_t);
+            if (dir->size < 2 * sizeof(dir_entry_t)) dir->size = 2 * sizeof(dir_entry_t);
+        }
+
+        uint32_t count = dir->size / sizeof(dir_entry_t);
+        if (map->blocks[0] >= vfs->super.block_count || !vfs->blocks[map->blocks[0]]) continue;
+        dir_entry_t* entries = (dir_entry_t*)vfs->blocks[map->blocks[0]];
+        if (count > BLOCK_SIZE / sizeof(dir_entry_t)) count = BLOCK_SIZE / sizeof(dir_entry_t);
+
+        for (uint32_t i = 0; i < count; i++) {
+            dir_entry_t* e = &entries[i];
+            const char* fixed = (i == 0) ? "." : (i == 1) ? ".." : NULL;
+            uint32_t expect = (i == 0) ? self : parent[self - 1];
+            const char* fault = NULL;
+
+            if (fixed) {
+                if (strcmp(e->name, fixed) != 0 || e->inode_id != expect) fault = "bad";
+            } else if (memchr(e->name, '\0', MAX_NAME_LEN) == NULL || e->name[0] == '\0') {
+                fault = "unnamed";
+            } else if (e->inode_id == 0 || e->inode_id > vfs->super.inode_count || live[e->inode_id - 1].id == 0) {
+                fault = "dangling";
+            } else if (seen[e->inode_id - 1]) {
+                fault = "duplicate";
+            }
+
+            if (!fault) {
+                if (fixed) continue;
+                seen[e->inode_id - 1] = 1;
+                if (live[e->inode_id - 1].type == DIR_TYPE) {
+                    parent[e->inode_id - 1] = self;
+                    queue[tail++] = e->inode_id;
+                }
+                continue;
+            }
+
+            fsck_report(verbose, &problems, "directory %u: %s entry %u", self, fault, i);
+            if (!repair) continue;
+
+            // Shared with a snapshot: fix a private copy
+            uint32_t block_id = vfs_block_private(vfs, &map->blocks[0]);
+            if (block_id >= vfs->super.block_count) goto out_of_space;
+            entries = (dir_entry_t*)vfs->blocks[block_id];
+            e = &entries[i];
+
+            if (fixed) {
+                memset(e, 0, sizeof(*e));
+                strcpy(e->name, fixed);
+                e->inode_id = expect;
+            } else {
+                memmove(e, e + 1, (count - i - 1) * sizeof(dir_entry_t));
+                memset(&entries[count - 1], 0, sizeof(dir_entry_t));
+                count--;
+                i--;
+                dir->size = count * sizeof(dir_entry_t);
+            }
+        }
+    }
+
+    // Anything the tree does not reach is lost; its blocks go back to the pool
+    for (uint32_t i = 0; i < vfs->super.inode_count; i++) {
+        if (live[i].id && !seen[i]) {
+            fsck_report(verbose, &problems, "inode %u is not linked from any directory", live[i].id);
+            if (repair) fsck_release_inode(vfs, &live[i], &live_maps[i]);
+        }
+    }
+out_of_space: // A repair that cannot allocate stops before anything else is released
+    free(queue);
+    free(seen);
+    return problems;
+}
+
+// Command-line check of a saved image; exit status 0 clean, 1 repaired, 4 problems left
+int vfs_fsck(const char* filename, int repair) {
+    vfs_state_t* vfs = malloc(sizeof(vfs_state_t));
+    if (!vfs) {
+        fprintf(stderr, "Failed to allocate VFS\n");
+        return 8;
+    }
+    vfs_init(vfs);
+    vfs->skip_load_check = 1;
+    if (vfs_load(vfs, filename) != 0) {
+        fprintf(stderr, "Cannot read image %s\n", filename);
+        vfs_free(vfs);
+        free(vfs);
+        return 8;
+    }
+
+    int problems = vfs_check(vfs, repair, 1);
+    int status = 0;
+    if (problems > 0 && repair) {
+        status = (vfs_save(vfs, filename) == 0) ? 1 : 4;
+        printf("%s: %d problems repaired\n", filename, problems);
+    } else if (problems > 0) {
+        status = 4;
+        printf("%s: %d problems found, run with --repair to fix them\n", filename, problems);
+    } else if (problems == 0) {
+        printf("%s: clean\n", filename);
+    } else {
+        status = 8;
+    }
+
+    vfs_free(vfs);
+    free(vfs);
+    return status;
+}
+
+// Writes an empty image with the given capacity; it still grows on demand once in use
+int vfs_mkfs(const char* filename, uint32_t blocks, uint32_t inodes) {
+    vfs_state_t* vfs = calloc(1, sizeof(vfs_state_t));
+    if (!vfs) {
+        fprintf(stderr, "Failed to allocate VFS\n");
+        return 1;
+    }
+    int result = vfs_format(vfs, blocks, inodes);
+    if (result == 0) result = vfs_save(vfs, filename);
+    if (result == 0) {
+        printf("Formatted %s: %u blocks (%.1f MB), %u inodes\n", filename, vfs->super.block_count,
+               (double)vfs->super.block_count * BLOCK_SIZE / (1 << 20), vfs->super.inode_count);
+    } else {
+        fprintf(stderr, "Cannot format %s\n", filename);
+    }
+    vfs_free(vfs);
+    free(vfs);
+    return result == 0 ? 0 : 1;
+}
+
+/* Benchmark */
+#define BENCH_FILE "vfs_bench.bin"
+
+// Latency samples of one benchmark case
+typedef struct {
+    uint64_t* ns;
+    size_t count;
+    size_t capacity;
+    uint64_t total_ns;
+    uint64_t bytes;
+} bench_samples_t;
+
+static void bench_add(bench_samples_t* b, uint64_t ns, uint64_t bytes) {
+    if (b->count == b->capacity) {
+        size_t capacity = b->capacity ? b->capacity * 2 : 1024;
+        uint64_t* grown = realloc(b->ns, capacity * sizeof(uint64_t));
+        if (!grown) return;
+        b->ns = grown;
+        b->capacity = capacity;
+    }
+    b->ns[b->count++] = ns;
+    b->total_ns += ns;
+    b->bytes += bytes;
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const bench_samples_t* b, double p) {
+    if (b->count == 0) return 0.0;
+    size_t index = (size_t)(p * (b->count - 1) + 0.5);
+    return b->ns[index] / 1000.0;
+}
+
+// Prints one result row and resets the samples
+static void bench_report(bench_samples_t* b, int json, const char* name, const char* param) {
+    static int rows = 0;
+    qsort(b->ns, b->count, sizeof(uint64_t), compare_u64);
+
+    double seconds = b->total_ns / 1e9;
+    double ops = seconds > 0 ? b->count / seconds : 0.0;
+    double mbps = seconds > 0 ? b->bytes / seconds / (1024.0 * 1024.0) : 0.0;
+
+    if (json) {
+        printf("%s\n  {\"benchmark\": \"%s\", \"param\": \"%s\", \"ops\": %zu, \"ops_per_sec\": %.0f, "
+               "\"mb_per_sec\": %.2f, \"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+               rows++ ? "," : "[", name, param, b->count, ops, mbps, percentile_us(b, 0.5),
+               percentile_us(b, 0.9), percentile_us(b, 0.99), percentile_us(b, 1.0));
+    } else {
+        if (rows++ == 0) printf("benchmark,param,ops,ops_per_sec,mb_per_sec,p50_us,p90_us,p99_us,max_us\n");
+        printf("%s,%s,%zu,%.0f,%.2f,%.3f,%.3f,%.3f,%.3f\n", name, param, b->count, ops, mbps,
+               percentile_us(b, 0.5), percentile_us(b, 0.9), percentile_us(b, 0.99), percentile_us(b, 1.0));
+    }
+    b->count = 0;
+    b->total_ns = 0;
+    b->bytes = 0;
+}
+
+// Text-like pseudo-random data, compressible about as much as source code
+static void bench_fill(char* buf, size_t len, uint32_t* seed) {
+    static const char words[] = "the vfs block inode write read file data of and to ";
+    for (size_t i = 0; i < len; i++) {
+        *seed ^= *seed << 13;
+        *seed ^= *seed >> 17;
+        *seed ^= *seed << 5;
+        buf[i] = (*seed % 7 == 0) ? (char)('a' + *seed % 26) : words[i % (sizeof(words) - 1)];
+    }
+}
+
+static void bench_metadata(bench_samples_t* create, bench_samples_t* lookup, bench_samples_t* unlink,
+                           int json, int rounds, vfs_state_t* vfs) {
+    static const int dir_sizes[] = {1, 4, 8, 12};
+    char name[32], param[32];
+
+    for (size_t d = 0; d < sizeof(dir_sizes) / sizeof(dir_sizes[0]); d++) {
+        int n = dir_sizes[d];
+        for (int r = 0; r < rounds; r++) {
+            vfs_init(vfs);
+            for (int i = 0; i < n; i++) {
+                snprintf(name, sizeof(name), "file_%d", i);
+                uint64_t t = now_ns();
+                vfs_create(vfs, name, FILE_TYPE);
+                bench_add(create, now_ns() - t, 0);
+            }
+            for (int i = 0; i < n; i++) {
+                snprintf(name, sizeof(name), "file_%d", i);
+                uint64_t t = now_ns();
+                vfs_lookup(vfs, name);
+                bench_add(lookup, now_ns() - t, 0);
+            }
+            for (int i = n - 1; i >= 0; i--) {
+                snprintf(name, sizeof(name), "file_%d", i);
+                uint64_t t = now_ns();
+                vfs_unlink(vfs, name);
+                bench_add(unlink, now_ns() - t, 0);
+            }
+            vfs_free(vfs);
+        }
+        snprintf(param, sizeof(param), "entries=%d", n);
+        bench_report(create, json, "create", param);
+        bench_report(lookup, json, "lookup", param);
+        bench_report(unlink, json, "unlink", param);
+    }
+}
+
+static void bench_io(bench_samples_t* b, int json, int rounds, vfs_state_t* vfs, char* data) {
+    static const size_t file_sizes[] = {BLOCK_SIZE, CLUSTER_SIZE, (size_t)INODE_BLOCKS * BLOCK_SIZE};
+    char* buf = malloc(IO_BUFFER_SIZE);
+    char param[64];
+    uint32_t seed = 12345;
+    if (!buf) return;
+
+    for (int compressed = 0; compressed <= 1; compressed++) {
+        for (size_t f = 0; f < sizeof(file_sizes) / sizeof(file_sizes[0]); f++) {
+            size_t size = file_sizes[f];
+            size_t chunks = size / BLOCK_SIZE;
+            snprintf(param, sizeof(param), "size=%zu%s", size, compressed ? ";compressed" : "");
+
+            // Sequential: append the file chunk by chunk, then read it back
+            bench_samples_t* results[4] = {b, b + 1, b + 2, b + 3};
+            for (int r = 0; r < rounds; r++) {
+                vfs_init(vfs);
+                vfs->compress_new = compressed;
+                inode_t* file = vfs_create(vfs, "bench", FILE_TYPE);
+                for (size_t c = 0; c < chunks; c++) {
+                    uint64_t t = now_ns();
+                    vfs_write(vfs, file, data + c * BLOCK_SIZE, BLOCK_SIZE);
+                    bench_add(results[0], now_ns() - t, BLOCK_SIZE);
+                }
+                for (size_t c = 0; c < chunks; c++) {
+                    uint64_t t = now_ns();
+                    vfs_read(vfs, file, c * BLOCK_SIZE, buf, BLOCK_SIZE);
+                    bench_add(results[1], now_ns() - t, BLOCK_SIZE);
+                }
+
+                // Random: overwrite and read whole blocks at random offsets
+                for (size_t c = 0; c < chunks; c++) {
+                    seed = seed * 1103515245u + 12345u;
+                    size_t offset = (seed >> 8) % chunks * BLOCK_SIZE;
+                    uint64_t t = now_ns();
+                    vfs_pwrite(vfs, file, offset, data + offset, BLOCK_SIZE);
+                    bench_add(results[2], now_ns() - t, BLOCK_SIZE);
+                }
+                for (size_t c = 0; c < chunks; c++) {
+                    seed = seed * 1103515245u + 12345u;
+                    size_t offset = (seed >> 8) % chunks * BLOCK_SIZE;
+                    uint64_t t = now_ns();
+                    vfs_read(vfs, file, offset, buf, BLOCK_SIZE);
+                    bench_add(results[3], now_ns() - t, BLOCK_SIZE);
+                }
+                vfs_free(vfs);
+            }
+            bench_report(results[0], json, "seq_write", param);
+            bench_report(results[1], json, "seq_read", param);
+            bench_report(results[2], json, "rand_write", param);
+            bench_report(results[3], json, "rand_read", param);
+        }
+    }
+    free(buf);
+}
+
+static void bench_save_load(bench_samples_t* save, bench_samples_t* load, int json, int rounds,
+                            vfs_state_t* vfs, char* data) {
+    static const int fill_percent[] = {10, 50, 90};
+    char name[32], param[32];
+
+    for (size_t p = 0; p < sizeof(fill_percent) / sizeof(fill_percent[0]); p++) {
+        int files = DEFAULT_BLOCKS * fill_percent[p] / 100 / INODE_BLOCKS;
+        for (int r = 0; r < rounds; r++) {
+            // Full files spread over subdirectories (a directory holds few entries)
+            vfs_init(vfs);
+            for (int i = 0; i < files; i++) {
+                if (i % 8 == 0) {
+                    snprintf(name, sizeof(name), "dir_%d", i / 8);
+                    vfs_cd(vfs, "/");
+                    vfs_create(vfs, name, DIR_TYPE);
+                    vfs_cd(vfs, name);
+                }
+                snprintf(name, sizeof(name), "file_%d", i);
+                vfs_write(vfs, vfs_create(vfs, name, FILE_TYPE), data, IO_BUFFER_SIZE);
+            }
+            vfs_cd(vfs, "/");
+
+            uint64_t t = now_ns();
+            vfs_save(vfs, BENCH_FILE);
+            bench_add(save, now_ns() - t, (uint64_t)files * IO_BUFFER_SIZE);
+            t = now_ns();
+            vfs_load(vfs, BENCH_FILE);
+            bench_add(load, now_ns() - t, (uint64_t)files * IO_BUFFER_SIZE);
+            vfs_free(vfs);
+        }
+        snprintf(param, sizeof(param), "fill=%d%%", fill_percent[p]);
+        bench_report(save, json, "save", param);
+        bench_report(load, json, "load", param);
+    }
+    remove(BENCH_FILE);
+}
+
+static void bench_alloc(bench_samples_t* b, int json, int rounds, vfs_state_t* vfs) {
+    static const int fill_percent[] = {0, 50, 90, 99};
+    char param[32];
+
+    for (size_t p = 0; p < sizeof(fill_percent) / sizeof(fill_percent[0]); p++) {
+        vfs_init(vfs);
+        // Occupy the low blocks so every search from the start has to scan past them
+        int target = DEFAULT_BLOCKS * fill_percent[p] / 100;
+        for (int used = 2; used < target; used++) { // Block 0 and the root block
+            if (vfs_alloc_block(vfs, 1) >= vfs->super.block_count) break;
+        }
+        for (int r = 0; r < rounds * 100; r++) {
+            uint64_t t = now_ns();
+            uint32_t block_id = vfs_alloc_block(vfs, 1);
+            bench_add(b, now_ns() - t, 0);
+            vfs_release_block(vfs, block_id);
+        }
+        vfs_free(vfs);
+        snprintf(param, sizeof(param), "fill=%d%%", fill_percent[p]);
+        bench_report(b, json, "alloc", param);
+    }
+}
+
+int vfs_bench(int json, int rounds) {
+    vfs_state_t* vfs = malloc(sizeof(vfs_state_t));
+    char* data = malloc(IO_BUFFER_SIZE);
+    bench_samples_t samples[4];
+    memset(samples, 0, sizeof(samples));
+    if (!vfs || !data) {
+        fprintf(stderr, "Failed to allocate benchmark state\n");
+        free(vfs);
+        free(data);
+        return 1;
+    }
+    uint32_t seed = 2463534242u;
+    bench_fill(data, IO_BUFFER_SIZE, &seed);
+
+    bench_metadata(&samples[0], &samples[1], &samples[2], json, rounds, vfs);
+    bench_io(samples, json, rounds, vfs, data);
+    bench_save_load(&samples[0], &samples[1], json, rounds, vfs, data);
+    bench_alloc(&samples[0], json, rounds, vfs);
+    if (json) printf("\n]\n");
+
+    for (int i = 0; i < 4; i++) free(samples[i].ns);
+    free(data);
+    free(vfs);
     return 0;
 }
 
@@ -740,6 +4624,20 @@ void print_menu() {
     printf("6. Change directory\n");
     printf("7. Back to parent directory\n");
     printf("8. Exit\n");
+    printf("9. Import host directory\n");
+    printf("10. Export directory to host\n");
+    printf("11. Snapshots\n");
+    printf("12. Deduplication\n");
+    printf("13. Compression\n");
+    printf("14. Truncate file\n");
+    printf("15. Write at offset\n");
+    printf("16. Statistics\n");
+    printf("17. Remove recursively\n");
+    printf("18. Disk usage\n");
+    printf("19. Find\n");
+    printf("20. Defragment\n");
+    printf("21. List (sorted, filtered, paged)\n");
+    printf("22. Checkpoints\n");
 }
 
 void clear_input_buffer() {